@@ -0,0 +1,275 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_scene.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto_pathtrace/yocto_pathtrace.h>
+
+#include <thread>
+using namespace yocto;
+
+// Benchmark scene with the settings used to render it in scripts/run.sh
+struct bench_scene {
+  string                name     = "";
+  string                filename = "";
+  pathtrace_shader_type shader   = pathtrace_shader_type::pathtrace;
+  int                   bounces  = 4;
+};
+
+// Scenes in tests/
+const auto bench_scenes = vector<bench_scene>{
+    {"01_surface", "01_surface/surface.json", pathtrace_shader_type::pathtrace,
+        4},
+    {"02_rollingteapot", "02_rollingteapot/rollingteapot.json",
+        pathtrace_shader_type::pathtrace, 4},
+    {"03_volume", "03_volume/volume.json", pathtrace_shader_type::volpathtrace,
+        64},
+    {"04_head1", "04_head1/head1.json", pathtrace_shader_type::volpathtrace,
+        4},
+    {"05_head1ss", "05_head1ss/head1ss.json",
+        pathtrace_shader_type::volpathtrace, 64},
+    {"06_gridsdf", "06_gridsdf/gridsdf.json", pathtrace_shader_type::implicit,
+        4},
+    {"07_sdfunction", "07_sdfunction/sdfunction.json",
+        pathtrace_shader_type::implicit, 4},
+};
+
+// Root mean squared error between two linear images. Returns -1 if the
+// sizes do not match.
+double compute_rmse(const color_image& image, const color_image& reference) {
+  if (image.width != reference.width || image.height != reference.height)
+    return -1;
+  auto sum = 0.0;
+  for (auto idx = 0; idx < (int)image.pixels.size(); idx++) {
+    auto diff = xyz(image.pixels[idx]) - xyz(reference.pixels[idx]);
+    sum += dot(diff, diff) / 3;
+  }
+  return std::sqrt(sum / std::max((int)image.pixels.size(), 1));
+}
+
+// Render a scene timing each phase
+nlohmann::ordered_json run_scene(const bench_scene& bscene,
+    const string& testsdir, const string& refsdir,
+    const pathtrace_params& params_, bool makerefs, int refsamples,
+    bool compress, bool pipeline) {
+  // copy params
+  auto params    = params_;
+  params.shader  = bscene.shader;
+  params.bounces = bscene.bounces;
+
+  // timing
+  auto timer  = simple_timer{};
+  auto times  = nlohmann::ordered_json::object();
+  auto timeit = [&](const string& phase) {
+    times[phase] = elapsed_seconds(timer);
+    start_timer(timer);
+  };
+
+  // load scene and init rendering data, either overlapped or phase by phase
+  auto error  = string{};
+  auto scene  = scene_data{};
+  auto bvh    = bvh_scene{};
+  auto lights = pathtrace_lights{};
+  auto state  = pathtrace_state{};
+  if (pipeline) {
+    print_progress_begin("load " + bscene.name);
+    if (!load_render_data(path_join(testsdir, bscene.filename), scene, bvh,
+            lights, state, params, error, compress))
+      print_fatal(error);
+    print_progress_end();
+    timeit("setup");
+  } else {
+    // load scene
+    print_progress_begin("load " + bscene.name);
+    if (!load_scene(path_join(testsdir, bscene.filename), scene, error))
+      print_fatal(error);
+    print_progress_end();
+    timeit("load");
+
+    // tesselate subdivs
+    tesselate_surfaces(scene);
+    timeit("tesselate");
+
+    // compress shapes
+    if (compress) compress_shapes(scene);
+    timeit("compress");
+
+    // build bvh
+    bvh = make_bvh(scene, params);
+    timeit("bvh");
+
+    // init lights
+    lights = make_lights(scene, bvh, params);
+    timeit("lights");
+
+    // init state
+    state = make_state(scene, params);
+    timeit("state");
+  }
+
+  // render
+  auto stats = pathtrace_stats{};
+  print_progress_begin("render " + bscene.name, params.samples);
+  for (auto sample = 0; sample < params.samples; sample++) {
+    stats += pathtrace_samples(state, scene, bvh, lights, params);
+    print_progress_next();
+  }
+  timeit("render");
+
+  // reference
+  auto render    = get_render(state);
+  auto reference = path_join(refsdir, bscene.name + ".exr");
+  auto rmse      = -1.0;
+  if (makerefs) {
+    // render references apart, so that they are less noisy than the runs
+    auto refparams    = params;
+    refparams.samples = refsamples;
+    auto refstate     = make_state(scene, refparams);
+    print_progress_begin("reference " + bscene.name, refparams.samples);
+    for (auto sample = 0; sample < refparams.samples; sample++) {
+      pathtrace_samples(refstate, scene, bvh, lights, refparams);
+      print_progress_next();
+    }
+    if (!save_image(reference, get_render(refstate), error))
+      print_fatal(error);
+  } else if (path_exists(reference)) {
+    auto image = image_data{};
+    if (!load_image(reference, image, error)) print_fatal(error);
+    rmse = compute_rmse(render, image);
+    if (rmse < 0) print_info(bscene.name + ": reference size mismatch");
+  }
+
+  // results
+  auto seconds = std::max(stats.time * 1e-9, 1e-9);
+  auto json    = nlohmann::ordered_json::object();
+  json["name"]               = bscene.name;
+  json["shader"]             = pathtrace_shader_names[(int)params.shader];
+  json["width"]              = state.width;
+  json["height"]             = state.height;
+  json["samples"]            = stats.samples;
+  json["bounces"]            = params.bounces;
+  json["memory"]             = compute_memory(scene);
+  json["times"]              = times;
+  json["samples_per_second"] = stats.paths / seconds;
+#ifdef YOCTO_STATS
+  json["mrays_per_second"] = stats.rays / seconds / 1e6;
+#else
+  json["mrays_per_second"] = nlohmann::ordered_json();  // rays not counted
+#endif
+  json["rmse"] = rmse >= 0 ? nlohmann::ordered_json(rmse)
+                           : nlohmann::ordered_json();
+  json["efficiency"] = rmse > 0 ? nlohmann::ordered_json(
+                                       1 / (rmse * rmse * seconds))
+                                 : nlohmann::ordered_json();
+  auto& jstats                = json["stats"];
+  jstats["paths"]             = stats.paths;
+  jstats["bounces"]           = stats.bounces;
+  jstats["rays"]              = stats.rays;
+  jstats["nodes"]             = stats.nodes;
+  jstats["primitives"]        = stats.primitives;
+  jstats["instances"]         = stats.instances;
+  jstats["spheretrace_steps"] = stats.spheretrace_steps;
+  jstats["lightpdf_rays"]     = stats.lightpdf_rays;
+  return json;
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto params     = pathtrace_params{};
+  auto testsdir   = "tests"s;
+  auto refsdir    = "references"s;
+  auto output     = "bench.json"s;
+  auto selected   = ""s;
+  auto makerefs   = false;
+  auto refsamples = 1024;
+  auto compress   = false;
+  auto pipeline   = false;
+  params.samples  = 16;
+
+  // command line parsing
+  auto cli = make_cli("ybench", "Benchmark the test scenes.");
+  add_option(cli, "tests", testsdir, "Test scenes directory.");
+  add_option(cli, "references", refsdir, "High-spp exr references directory.");
+  add_option(cli, "output", output, "Output json filename.");
+  add_option(cli, "scene", selected, "Run only the scene with this name.");
+  add_option(
+      cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
+  add_option(cli, "samples", params.samples, "Number of samples.", {1, 65536});
+  add_option(cli, "noparallel", params.noparallel, "Disable threading.");
+  add_option(cli, "makerefs", makerefs, "Render and save references.");
+  add_option(cli, "refsamples", refsamples, "Number of reference samples.",
+      {1, 65536});
+  add_option(cli, "compress", compress, "Compress shape vertex data.");
+  add_option(cli, "pipeline", pipeline, "Overlap loading and setup.");
+  add_option(cli, "sbvh", params.sbvh, "Use spatial split shape bvhs.");
+  add_option(
+      cli, "flatten", params.flatten, "Flatten single identity instances.");
+  add_option(cli, "lazy", params.lazy, "Build shape bvhs on demand.");
+  add_option(cli, "adrrs", params.adrrs,
+      "Use adjoint-driven russian roulette and splitting.");
+  add_option(cli, "guiding", params.guiding, "Use path guiding.");
+  parse_cli(cli, args);
+
+  // check references
+  auto error = string{};
+  if (makerefs && !make_directory(refsdir, error)) print_fatal(error);
+
+  // run scenes
+  auto json      = nlohmann::ordered_json::object();
+  json["threads"] = params.noparallel ? 1u
+                                      : std::thread::hardware_concurrency();
+#ifdef YOCTO_STATS
+  json["stats"] = true;
+#else
+  json["stats"] = false;
+#endif
+  json["scenes"] = nlohmann::ordered_json::array();
+  for (auto& bscene : bench_scenes) {
+    if (!selected.empty() && bscene.name != selected) continue;
+    auto result = run_scene(bscene, testsdir, refsdir, params, makerefs,
+        refsamples, compress, pipeline);
+    auto& mrays = result["mrays_per_second"];
+    print_info(bscene.name + ": " +
+               std::to_string(result["samples_per_second"].get<double>()) +
+               " samples/s, " +
+               (mrays.is_null() ? "n/a"s
+                                : std::to_string(mrays.get<double>())) +
+               " Mrays/s");
+    json["scenes"].push_back(result);
+  }
+
+  // save results
+  if (!save_text(output, json.dump(2), error)) print_fatal(error);
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
@@ -0,0 +1,339 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_scene.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto_pathtrace/yocto_pathtrace.h>
+
+#include <yocto/yocto_parallel.h>
+#include <yocto/yocto_sdfs.h>
+
+#include <cstdio>
+#include <thread>
+using namespace yocto;
+
+// Reproducible set of rays
+struct kernel_rays {
+  string        name = "";
+  vector<ray3f> rays = {};
+};
+
+// Timings of a kernel
+struct kernel_result {
+  string name        = "";
+  size_t ops         = 0;  // operations per run
+  double ns_single   = 0;  // ns per op on one thread
+  double ns_parallel = 0;  // ns per op on all threads
+  double nodes       = 0;  // bvh nodes visited per op
+};
+
+// Hit records of the primary rays, used to generate secondary rays
+struct kernel_hit {
+  instance_data instance = {};  // hit instance, invalid shape for sdfs
+  int           element  = 0;
+  vec2f         uv       = {0, 0};
+  vec3f         position = {0, 0, 0};
+  vec3f         normal   = {0, 0, 0};
+};
+
+// Time `func(idx)` over `num` operations, repeated `repeats` times, first on
+// one thread and then on all threads. Results are written to a buffer so the
+// compiler cannot drop the calls.
+template <typename Func>
+kernel_result run_kernel(
+    const string& name, size_t num, int repeats, Func&& func) {
+  auto result = kernel_result{name, num};
+  if (num == 0) return result;
+  auto sink = vector<float>(num);
+  auto ops  = (double)num * repeats;
+
+  // single thread
+  reset_bvh_stats();
+  auto timer = simple_timer{};
+  for (auto repeat = 0; repeat < repeats; repeat++) {
+    for (auto idx = (size_t)0; idx < num; idx++) sink[idx] = func(idx);
+  }
+  result.ns_single = elapsed_nanoseconds(timer) / ops;
+  result.nodes     = get_bvh_stats().nodes / ops;
+
+  // all threads
+  start_timer(timer);
+  for (auto repeat = 0; repeat < repeats; repeat++) {
+    parallel_for_batch(num, (size_t)256, [&](size_t idx) {
+      sink[idx] = func(idx);
+    });
+  }
+  result.ns_parallel = elapsed_nanoseconds(timer) / ops;
+
+  return result;
+}
+
+// Camera rays jittered inside each pixel
+kernel_rays make_primary_rays(
+    const scene_data& scene, int resolution, uint64_t seed) {
+  auto& camera = scene.cameras.at(0);
+  auto  width  = camera.aspect >= 1 ? resolution
+                                    : (int)round(resolution * camera.aspect);
+  auto  height = camera.aspect >= 1 ? (int)round(resolution / camera.aspect)
+                                    : resolution;
+  auto  rng    = make_rng(seed);
+  auto  rays   = kernel_rays{"primary"};
+  rays.rays.reserve((size_t)width * height);
+  for (auto j = 0; j < height; j++) {
+    for (auto i = 0; i < width; i++) {
+      auto puv = rand2f(rng);
+      auto uv  = vec2f{(i + puv.x) / width, (j + puv.y) / height};
+      rays.rays.push_back(eval_camera(camera, uv, rand2f(rng)));
+    }
+  }
+  return rays;
+}
+
+// Primary hits with shading frames. Implicit surfaces have no instance.
+vector<kernel_hit> make_hits(const scene_data& scene, const bvh_scene& bvh,
+    const kernel_rays& primary, const pathtrace_params& params) {
+  auto has_sdfs = !scene.sdfs.empty() || !scene.vol_instances.empty();
+  auto hits     = vector<kernel_hit>{};
+  for (auto& ray : primary.rays) {
+    auto intersection = intersect_bvh(bvh, scene, ray);
+    if (intersection.hit) {
+      auto  instance = get_instance(scene, intersection);
+      auto  position = eval_position(
+          scene, instance, intersection.element, intersection.uv);
+      auto normal = eval_normal(
+          scene, instance, intersection.element, intersection.uv);
+      if (dot(normal, ray.d) > 0) normal = -normal;
+      hits.push_back({instance, intersection.element,
+          intersection.uv, position, normal});
+    } else if (has_sdfs) {
+      auto sintersection = spheretrace(scene, ray, params.spheretrace_maxiter);
+      if (!sintersection.hit) continue;
+      auto position = ray_point(ray, sintersection.dist);
+      auto normal   = eval_sdf_normal(scene, position, sintersection.dist);
+      if (dot(normal, ray.d) > 0) normal = -normal;
+      hits.push_back({{}, 0, {0, 0}, position, normal});
+    }
+  }
+  return hits;
+}
+
+// Cosine-distributed bounce rays from the primary hits
+kernel_rays make_diffuse_rays(const vector<kernel_hit>& hits, uint64_t seed) {
+  auto rng  = make_rng(seed, 3);
+  auto rays = kernel_rays{"diffuse"};
+  for (auto& hit : hits) {
+    rays.rays.push_back(
+        {hit.position, sample_hemisphere_cos(hit.normal, rand2f(rng))});
+  }
+  return rays;
+}
+
+// Shadow rays from the primary hits to points on the area lights
+kernel_rays make_shadow_rays(const scene_data& scene,
+    const pathtrace_lights& lights, const vector<kernel_hit>& hits,
+    uint64_t seed) {
+  auto area_lights = vector<const pathtrace_light*>{};
+  for (auto& light : lights.lights) {
+    if (light.instance != invalidid) area_lights.push_back(&light);
+  }
+  auto rays = kernel_rays{"shadow"};
+  if (area_lights.empty()) return rays;
+  auto rng = make_rng(seed, 5);
+  for (auto& hit : hits) {
+    auto& light = *area_lights[sample_uniform(
+        (int)area_lights.size(), rand1f(rng))];
+    auto  instance  = get_instance(scene, light.instance);
+    auto& shape     = scene.shapes[instance.shape];
+    auto  element   = sample_discrete(light.elements_cdf, rand1f(rng));
+    auto  ruv       = rand2f(rng);
+    auto  uv        = !shape.triangles.empty() ? sample_triangle(ruv) : ruv;
+    auto  lposition = eval_position(scene, instance, element, uv);
+    auto  dist      = length(lposition - hit.position);
+    if (dist < ray_eps) continue;
+    rays.rays.push_back({hit.position, (lposition - hit.position) / dist,
+        ray_eps, dist * (1 - 1e-3f)});
+  }
+  return rays;
+}
+
+// Print a result line
+void print_result(const kernel_result& result) {
+  char buffer[256];
+  std::snprintf(buffer, sizeof(buffer), "%-28s %6zu %12.1f %12.1f %10.1f",
+      result.name.c_str(), result.ops, result.ns_single, result.ns_parallel,
+      result.nodes);
+  print_info(buffer);
+}
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto filename   = "tests/01_surface/surface.json"s;
+  auto output     = ""s;
+  auto resolution = 256;
+  auto repeats    = 4;
+  auto seed       = 7;
+  auto params     = pathtrace_params{};
+
+  // command line parsing
+  auto cli = make_cli("ykernels", "Microbenchmarks of the render kernels.");
+  add_option(cli, "scene", filename, "Scene filename.");
+  add_option(cli, "output", output, "Output json filename.");
+  add_option(cli, "resolution", resolution, "Ray set resolution.", {1, 4096});
+  add_option(cli, "repeats", repeats, "Runs per kernel.", {1, 1024});
+  add_option(cli, "seed", seed, "Random seed.");
+  add_option(cli, "stmaxiter", params.spheretrace_maxiter,
+      "Spheretrace max iterations.", {1, 10000});
+  add_option(cli, "sbvh", params.sbvh, "Use spatial split shape bvhs.");
+  add_option(
+      cli, "flatten", params.flatten, "Flatten single identity instances.");
+  add_option(cli, "lazy", params.lazy, "Build shape bvhs on demand.");
+  parse_cli(cli, args);
+
+  // scene loading
+  auto error = string{};
+  auto scene = scene_data{};
+  print_progress_begin("load scene");
+  if (!load_scene(filename, scene, error)) print_fatal(error);
+  print_progress_end();
+
+  // tesselation
+  tesselate_surfaces(scene);
+
+  // build bvh and lights
+  print_progress_begin("build bvh");
+  auto bvh = make_bvh(scene, params);
+  print_progress_end();
+  auto lights = make_lights(scene, bvh, params);
+
+  // ray sets
+  print_progress_begin("make rays");
+  auto primary = make_primary_rays(scene, resolution, seed);
+  auto hits    = make_hits(scene, bvh, primary, params);
+  auto diffuse = make_diffuse_rays(hits, seed);
+  auto shadow  = make_shadow_rays(scene, lights, hits, seed);
+  print_progress_end();
+
+  // kernels
+  auto results = vector<kernel_result>{};
+  for (auto set : {&primary, &diffuse, &shadow}) {
+    auto& rays = set->rays;
+    results.push_back(run_kernel("intersect_bvh/" + set->name, rays.size(),
+        repeats, [&](size_t idx) -> float {
+          return intersect_bvh(bvh, scene, rays[idx]).distance;
+        }));
+    results.push_back(run_kernel("intersect_bvh_any/" + set->name,
+        rays.size(), repeats, [&](size_t idx) -> float {
+          return intersect_bvh(bvh, scene, rays[idx], true).distance;
+        }));
+  }
+  if (!scene.sdfs.empty() || !scene.vol_instances.empty()) {
+    for (auto set : {&primary, &diffuse}) {
+      auto& rays = set->rays;
+      results.push_back(run_kernel("spheretrace/" + set->name, rays.size(),
+          repeats, [&](size_t idx) -> float {
+            return spheretrace(scene, rays[idx], params.spheretrace_maxiter)
+                .dist;
+          }));
+    }
+  }
+  if (!scene.volumes.empty()) {
+    auto rng     = make_rng(seed, 7);
+    auto lookups = vector<pair<int, vec3f>>(primary.rays.size());
+    for (auto& [volume, uvw] : lookups) {
+      volume = sample_uniform((int)scene.volumes.size(), rand1f(rng));
+      uvw    = rand3f(rng) * 2 - 1;
+    }
+    results.push_back(run_kernel("eval_volume", lookups.size(), repeats,
+        [&](size_t idx) -> float {
+          auto& [volume, uvw] = lookups[idx];
+          return eval_volume(scene.volumes[volume], uvw);
+        }));
+  }
+  if (!scene.textures.empty()) {
+    auto rng     = make_rng(seed, 9);
+    auto lookups = vector<pair<int, vec2f>>(primary.rays.size());
+    for (auto& [texture, uv] : lookups) {
+      texture = sample_uniform((int)scene.textures.size(), rand1f(rng));
+      uv      = rand2f(rng);
+    }
+    results.push_back(run_kernel("eval_texture", lookups.size(), repeats,
+        [&](size_t idx) -> float {
+          auto& [texture, uv] = lookups[idx];
+          return eval_texture(scene, texture, uv).x;
+        }));
+  }
+  auto surface_hits = vector<kernel_hit>{};
+  for (auto& hit : hits) {
+    if (hit.instance.shape != invalidid) surface_hits.push_back(hit);
+  }
+  results.push_back(run_kernel(
+      "eval_material", surface_hits.size(), repeats, [&](size_t idx) -> float {
+        auto& hit = surface_hits[idx];
+        return eval_material(scene, hit.instance, hit.element, hit.uv).color.x;
+      }));
+
+  // report
+  auto stats_enabled = false;
+#ifdef YOCTO_STATS
+  stats_enabled = true;
+#endif
+  auto nthreads = std::thread::hardware_concurrency();
+  print_info("threads: " + std::to_string(nthreads) +
+             (stats_enabled ? "" : " (build with YOCTO_STATS for nodes/op)"));
+  print_info("kernel" + string(26, ' ') + "ops     ns/op(1)     ns/op(" +
+             std::to_string(nthreads) + ")   nodes/op");
+  for (auto& result : results) print_result(result);
+
+  // save results
+  if (!output.empty()) {
+    auto json       = nlohmann::ordered_json::object();
+    json["scene"]   = filename;
+    json["threads"] = nthreads;
+    json["stats"]   = stats_enabled;
+    json["kernels"] = nlohmann::ordered_json::array();
+    for (auto& result : results) {
+      auto jresult           = nlohmann::ordered_json::object();
+      jresult["name"]        = result.name;
+      jresult["ops"]         = result.ops;
+      jresult["ns_single"]   = result.ns_single;
+      jresult["ns_parallel"] = result.ns_parallel;
+      jresult["nodes"]       = stats_enabled
+                                   ? nlohmann::ordered_json(result.nodes)
+                                   : nlohmann::ordered_json();
+      json["kernels"].push_back(jresult);
+    }
+    if (!save_text(output, json.dump(2), error)) print_fatal(error);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
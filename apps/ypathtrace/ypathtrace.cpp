@@ -33,50 +33,87 @@
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_sdfs.h>
 #include <yocto/yocto_shape.h>
+#ifdef YOCTO_OPENGL
 #include <yocto_gui/yocto_glview.h>
+#endif
 #include <yocto_pathtrace/yocto_pathtrace.h>
 using namespace yocto;
 
+// print render statistics
+void print_stats(const pathtrace_stats& stats) {
+#ifndef YOCTO_STATS
+  print_info("hot-path counters disabled, build with YOCTO_STATS=ON");
+#endif
+  auto seconds  = max(stats.time * 1e-9, 1e-9);
+  auto per_path = [&stats](uint64_t count) {
+    return std::to_string(stats.paths ? (double)count / stats.paths : 0.0);
+  };
+  print_info("samples:           " + std::to_string(stats.samples));
+  print_info("paths:             " + format_num(stats.paths));
+  print_info("bounces:           " + format_num(stats.bounces) + " (" +
+             per_path(stats.bounces) + " per path)");
+  print_info("rays:              " + format_num(stats.rays) + " (" +
+             per_path(stats.rays) + " per path)");
+  print_info("bvh nodes:         " + format_num(stats.nodes) + " (" +
+             per_path(stats.nodes) + " per path)");
+  print_info("primitive tests:   " + format_num(stats.primitives) + " (" +
+             per_path(stats.primitives) + " per path)");
+  print_info("instance visits:   " + format_num(stats.instances));
+  print_info("spheretrace steps: " + format_num(stats.spheretrace_steps));
+  print_info("lightpdf rays:     " + format_num(stats.lightpdf_rays));
+  print_info("render time:       " + format_duration(stats.time));
+  print_info("Mrays/s:           " + std::to_string(stats.rays / seconds / 1e6));
+  print_info("Mpaths/s:          " + std::to_string(stats.paths / seconds / 1e6));
+}
+
+// save render statistics as json
+bool save_stats(
+    const string& filename, const pathtrace_stats& stats, string& error) {
+  auto json                 = nlohmann::ordered_json::object();
+  json["samples"]           = stats.samples;
+  json["paths"]             = stats.paths;
+  json["bounces"]           = stats.bounces;
+  json["rays"]              = stats.rays;
+  json["nodes"]             = stats.nodes;
+  json["primitives"]        = stats.primitives;
+  json["instances"]         = stats.instances;
+  json["spheretrace_steps"] = stats.spheretrace_steps;
+  json["lightpdf_rays"]     = stats.lightpdf_rays;
+  json["time"]              = stats.time;
+  return save_text(filename, json.dump(2), error);
+}
+
 // render scene offline
 void run_offline(const string& filename, const string& output,
-    const pathtrace_params& params_) {
+    const pathtrace_params& params_, bool print_statistics,
+    const string& statsfile, const string& costoutput,
+    const string& tracefile, bool compress) {
   // copy params
   auto params = params_;
 
-  print_progress_begin("load scene");
-  auto error = string{};
-  auto scene = scene_data{};
-  if (!load_scene(filename, scene, error)) print_fatal(error);
+  // start tracing
+  if (!tracefile.empty()) start_tracing();
 
+  // load scene and init rendering data
+  print_progress_begin("load scene");
+  auto error  = string{};
+  auto scene  = scene_data{};
+  auto bvh    = bvh_scene{};
+  auto lights = pathtrace_lights{};
+  auto state  = pathtrace_state{};
+  if (!load_render_data(
+          filename, scene, bvh, lights, state, params, error, compress))
+    print_fatal(error);
   print_progress_end();
 
   // camera
   // params.camera = find_camera(scene, params.camname);
 
-  // tesselate subdivs
-  print_progress_begin("tesselate surfaces");
-  tesselate_surfaces(scene);
-  print_progress_end();
-
-  // build bvh
-  print_progress_begin("build bvh");
-  auto bvh = make_bvh(scene, params);
-  print_progress_end();
-
-  // build bvh
-  print_progress_begin("init lights");
-  auto lights = make_lights(scene, params);
-  print_progress_end();
-
-  // state
-  print_progress_begin("init state");
-  auto state = make_state(scene, params);
-  print_progress_end();
-
   // render
+  auto stats = pathtrace_stats{};
   print_progress_begin("render image", params.samples);
   for (auto sample = 0; sample < params.samples; sample++) {
-    pathtrace_samples(state, scene, bvh, lights, params);
+    stats += pathtrace_samples(state, scene, bvh, lights, params);
     print_progress_next();
   }
 
@@ -84,45 +121,136 @@ void run_offline(const string& filename, const string& output,
   print_progress_begin("save image");
   if (!save_image(output, get_render(state), error)) print_fatal(error);
   print_progress_end();
+
+  // save cost, raw for hdr images and false colored otherwise
+  if (!costoutput.empty()) {
+    print_progress_begin("save cost");
+    auto cost = get_cost(state, !is_hdr_filename(costoutput));
+    if (!save_image(costoutput, cost, error)) print_fatal(error);
+    print_progress_end();
+  }
+
+  // trace
+  if (!tracefile.empty()) {
+    stop_tracing();
+    if (!save_trace(tracefile, error)) print_fatal(error);
+  }
+
+  // statistics
+  if (print_statistics) print_stats(stats);
+  if (!statsfile.empty()) {
+    if (!save_stats(statsfile, stats, error)) print_fatal(error);
+  }
+}
+
+#ifdef YOCTO_OPENGL
+
+// Triple buffered display shared by the render workers and the ui. Workers
+// write tiles in the back buffer, which always holds the whole render, and
+// swap it with the ready one, the ui swaps the ready buffer with the front one
+// when it is fresh. Swaps are atomic, so neither side waits for the other. The
+// new back buffer is updated by copying only the tiles it missed.
+struct display_buffers {
+  array<color_image, 3>                images   = {};  // linear renders
+  array<color_image, 3>                displays = {};  // tonemapped renders
+  array<vector<pair<vec2i, vec2i>>, 3> missed   = {};  // tiles to update
+  std::atomic<int>                     ready    = 1;   // ready buffer, fresh
+  int                                  back     = 0;   // owned by the worker
+  int                                  front    = 2;   // owned by the ui
+};
+
+// Flag marking the ready buffer as not yet seen by the ui
+const auto display_fresh = 4;
+
+// Allocate buffers. Call only when the worker is stopped.
+void init_display(display_buffers& buffers, int width, int height) {
+  for (auto idx = 0; idx < 3; idx++) {
+    buffers.images[idx]   = make_image(width, height, true);
+    buffers.displays[idx] = make_image(width, height, false);
+  }
+  for (auto& missed : buffers.missed) missed.clear();
+  buffers.ready = 1;
+  buffers.back  = 0;
+  buffers.front = 2;
+}
+
+// Mark a tile as written in the back buffer, so that the others copy it when
+// they become the back buffer
+void update_display(
+    display_buffers& buffers, const vec2i& start, const vec2i& end) {
+  for (auto idx = 0; idx < 3; idx++) {
+    if (idx != buffers.back) buffers.missed[idx].push_back({start, end});
+  }
+}
+
+// Make the back buffer the ready one, not yet fresh, and update the new back
+// buffer from it. Returns the buffer to present. Workers should not write
+// tiles while swapping.
+int swap_display(display_buffers& buffers) {
+  auto  ready  = buffers.back;
+  auto& source = buffers.images[ready];
+  buffers.back = buffers.ready.exchange(ready) & 3;
+  auto& image  = buffers.images[buffers.back];
+  for (auto& [start, end] : buffers.missed[buffers.back]) {
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        image.pixels[j * image.width + i] = source.pixels[j * image.width + i];
+      }
+    }
+  }
+  buffers.missed[buffers.back].clear();
+  return ready;
+}
+
+// Tonemap the ready buffer and mark it fresh for the ui. No worker writes it,
+// so this can run while they write tiles in the back buffer.
+void present_display(
+    display_buffers& buffers, int ready, float exposure, bool filmic) {
+  tonemap_image_mt(
+      buffers.displays[ready], buffers.images[ready], exposure, filmic);
+  buffers.ready.fetch_or(display_fresh);
+}
+
+// Hand the back buffer to the ui
+void publish_display(display_buffers& buffers, float exposure, bool filmic) {
+  present_display(buffers, swap_display(buffers), exposure, filmic);
+}
+
+// Take the last published buffer as front buffer, if any. The exchange fails
+// if a worker is swapping a buffer that is not yet presented.
+bool consume_display(display_buffers& buffers) {
+  auto ready = buffers.ready.load();
+  if (!(ready & display_fresh)) return false;
+  if (!buffers.ready.compare_exchange_strong(ready, buffers.front))
+    return false;
+  buffers.front = ready & 3;
+  return true;
 }
 
 // render scene interactively
 void run_interactive(const string& filename, const string& output,
-    const pathtrace_params& params_) {
+    const pathtrace_params& params_, bool compress) {
   // copy params
   auto params = params_;
 
+  // load scene and init rendering data
   print_progress_begin("load scene");
-  auto error = string{};
-  auto scene = scene_data{};
-  if (!load_scene(filename, scene, error)) print_fatal(error);
+  auto error  = string{};
+  auto scene  = scene_data{};
+  auto bvh    = bvh_scene{};
+  auto lights = pathtrace_lights{};
+  auto state  = pathtrace_state{};
+  if (!load_render_data(
+          filename, scene, bvh, lights, state, params, error, compress))
+    print_fatal(error);
   print_progress_end();
 
   // camera
   // params.camera = find_camera(scene, params.camname);
 
-  // tesselate subdivs
-  print_progress_begin("tesselate subdivs");
-  tesselate_surfaces(scene);
-  print_progress_end();
-
-  // build bvh
-  print_progress_begin("build bvh");
-  auto bvh = make_bvh(scene, params);
-  print_progress_end();
-
-  // build lights
-  print_progress_begin("init lights");
-  auto lights = make_lights(scene, params);
-  print_progress_end();
-
-  // init state
-  print_progress_begin("init state");
-  auto state   = make_state(scene, params);
-  auto image   = make_image(state.width, state.height, true);
-  auto display = make_image(state.width, state.height, false);
-  auto render  = make_image(state.width, state.height, true);
-  print_progress_end();
+  // display buffers
+  auto buffers = display_buffers{};
+  init_display(buffers, state.width, state.height);
 
   // opengl image
   auto glimage  = glimage_state{};
@@ -135,62 +263,103 @@ void run_interactive(const string& filename, const string& output,
   // camera names
   auto camera_names = scene.camera_names;
 
+  // preview state
+  auto pparams = params;
+  auto pstate  = pathtrace_state{};
+  auto preview = color_image{};
+
   // renderer update
-  auto render_update  = std::atomic<bool>{};
-  auto render_current = std::atomic<int>{};
-  auto render_mutex   = std::mutex{};
-  auto render_worker  = future<void>{};
-  auto render_stop    = atomic<bool>{};
-  auto reset_display  = [&]() {
+  auto render_focus    = std::atomic<vec2f>{vec2f{0.5f, 0.5f}};
+  auto render_exposure = std::atomic<float>{params.exposure};
+  auto render_filmic   = std::atomic<bool>{params.filmic};
+  auto render_current  = std::atomic<int>{};
+  auto render_worker   = future<void>{};
+  auto render_stop     = atomic<bool>{};
+  auto reset_display   = [&]() {
     // stop render
     render_stop = true;
     if (render_worker.valid()) render_worker.get();
 
-    state   = make_state(scene, params);
-    image   = make_image(state.width, state.height, true);
-    display = make_image(state.width, state.height, false);
-    render  = make_image(state.width, state.height, true);
-
-    render_worker = {};
-    render_stop   = false;
-
-    // preview
-    auto pparams = params;
-    pparams.resolution /= params.pratio;
-    pparams.samples = 1;
-    auto pstate     = make_state(scene, pparams);
-    pathtrace_samples(pstate, scene, bvh, lights, pparams);
-    auto preview = get_render(pstate);
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % render.width, j = idx / render.width;
-      auto pi            = clamp(i / params.pratio, 0, preview.width - 1),
-           pj            = clamp(j / params.pratio, 0, preview.height - 1);
-      render.pixels[idx] = preview.pixels[pj * preview.width + pi];
-    }
-    // if (current > 0) return;
-    {
-      auto lock      = std::lock_guard{render_mutex};
-      render_current = 0;
-      image          = render;
-      tonemap_image_mt(display, image, params.exposure, params.filmic);
-      render_update = true;
+    // reset accumulators, reallocating buffers only if the size changed
+    reset_state(state, scene, params);
+    auto& front = buffers.images[buffers.front];
+    if (front.width != state.width || front.height != state.height) {
+      init_display(buffers, state.width, state.height);
     }
 
-    // start renderer
+    render_worker  = {};
+    render_stop    = false;
+    render_current = 0;
+
+    // start renderer, the ui thread never waits for the preview
     render_worker = std::async(std::launch::async, [&]() {
+      // preview levels, halving the pixel ratio at each level
+      for (auto ratio = params.pratio; ratio > 1; ratio /= 2) {
+        pparams            = params;
+        pparams.resolution = max(params.resolution / ratio, 1);
+        pparams.samples    = 1;
+        reset_state(pstate, scene, pparams);
+        pathtrace_samples(
+            pstate, scene, bvh, lights, pparams, render_focus.load());
+        if (render_stop) return;
+        if (preview.width != pstate.width || preview.height != pstate.height)
+          preview = make_image(pstate.width, pstate.height, true);
+        get_render(preview, pstate);
+        auto& image = buffers.images[buffers.back];
+        for (auto idx = 0; idx < image.width * image.height; idx++) {
+          auto i = idx % image.width, j = idx / image.width;
+          auto pi           = i * preview.width / image.width,
+               pj           = j * preview.height / image.height;
+          image.pixels[idx] = preview.pixels[pj * preview.width + pi];
+        }
+        update_display(buffers, {0, 0}, {image.width, image.height});
+        publish_display(buffers, render_exposure, render_filmic);
+      }
+
+      // progressive render, tiles are written over the previous pass as they
+      // complete and shown at most every 1/30 of a second, by one worker at a
+      // time and tonemapped out of the lock
+      auto tiles_mutex = std::mutex{};
+      auto tiles_timer = simple_timer{};
+      auto presenting  = std::atomic<bool>{false};
+      auto show_tile   = [&](const pathtrace_state& state, const vec2i& start,
+                           const vec2i& end) {
+        if (render_stop) return false;
+        auto ready = -1;
+        {
+          auto  lock  = std::lock_guard{tiles_mutex};
+          auto& image = buffers.images[buffers.back];
+          auto  scale = 1.0f / (float)state.samples;
+          for (auto j = start.y; j < end.y; j++) {
+            for (auto i = start.x; i < end.x; i++) {
+              auto idx          = j * state.width + i;
+              image.pixels[idx] = state.image[idx] * scale;
+            }
+          }
+          update_display(buffers, start, end);
+          if (!presenting && elapsed_seconds(tiles_timer) > 1.0 / 30) {
+            presenting  = true;
+            ready       = swap_display(buffers);
+            tiles_timer = simple_timer{};
+          }
+        }
+        if (ready >= 0) {
+          present_display(buffers, ready, render_exposure, render_filmic);
+          presenting = false;
+        }
+        return true;
+      };
       for (auto sample = 0; sample < params.samples; sample += 1) {
         if (render_stop) return;
-        pathtrace_samples(state, scene, bvh, lights, params);
+        pathtrace_samples(
+            state, scene, bvh, lights, params, render_focus.load(), show_tile);
         if (!render_stop) {
-          auto lock      = std::lock_guard{render_mutex};
           render_current = state.samples;
-          get_render(render, state);
-          image = render;
-          tonemap_image_mt(display, image, params.exposure, params.filmic);
-          render_update = true;
+          publish_display(buffers, render_exposure, render_filmic);
+          tiles_timer = simple_timer{};
         }
       }
-     });
+    });
   };
 
   // stop render
@@ -205,24 +374,25 @@ void run_interactive(const string& filename, const string& output,
   // callbacks
   auto callbacks    = glwindow_callbacks{};
   callbacks.init_cb = [&](const glinput_state& input) {
-    auto lock = std::lock_guard{render_mutex};
+    consume_display(buffers);
     init_image(glimage);
-    set_image(glimage, display);
+    set_image(glimage, buffers.displays[buffers.front]);
   };
   callbacks.clear_cb = [&](const glinput_state& input) {
     clear_image(glimage);
   };
   callbacks.draw_cb = [&](const glinput_state& input) {
     // update image
-    if (render_update) {
-      auto lock = std::lock_guard{render_mutex};
-      set_image(glimage, display);
-      render_update = false;
+    if (consume_display(buffers)) {
+      set_image(glimage, buffers.displays[buffers.front]);
     }
+    auto& display = buffers.displays[buffers.front];
+
+    // draw image
     glparams.window                           = input.window_size;
     glparams.framebuffer                      = input.framebuffer_viewport;
     std::tie(glparams.center, glparams.scale) = camera_imview(glparams.center,
-        glparams.scale, {image.width, image.height}, glparams.window,
+        glparams.scale, {display.width, display.height}, glparams.window,
         glparams.fit);
     draw_image(glimage, glparams);
   };
@@ -247,6 +417,14 @@ void run_interactive(const string& filename, const string& output,
         edited += draw_glslider(
             "spheretrace max iterations", tparams.spheretrace_maxiter, 1, 512);
       edited += draw_glslider("bounces", tparams.bounces, 1, 128);
+      edited += draw_glslider(
+          "diffuse bounces", tparams.diffuse_bounces, -1, 128);
+      edited += draw_glslider(
+          "specular bounces", tparams.specular_bounces, -1, 128);
+      edited += draw_glslider(
+          "transmission bounces", tparams.transmission_bounces, -1, 128);
+      edited += draw_glslider(
+          "volume bounces", tparams.volume_bounces, -1, 128);
       continue_glline();
       edited += draw_glslider("pratio", tparams.pratio, 1, 64);
       end_glheader();
@@ -261,12 +439,26 @@ void run_interactive(const string& filename, const string& output,
       edited += draw_glcheckbox("filmic", params.filmic);
       end_glheader();
       if (edited) {
-        tonemap_image_mt(display, image, params.exposure, params.filmic);
-        set_image(glimage, display);
+        render_exposure = params.exposure;
+        render_filmic   = params.filmic;
+        tonemap_image_mt(buffers.displays[buffers.front],
+            buffers.images[buffers.front], params.exposure, params.filmic);
+        set_image(glimage, buffers.displays[buffers.front]);
       }
     }
   };
   callbacks.uiupdate_cb = [&](const glinput_state& input) {
+    // refine around the cursor, or the center when outside the image
+    auto& image = buffers.images[buffers.front];
+    auto  ij    = image_coords(input.mouse_pos, glparams.center,
+        glparams.scale, {image.width, image.height});
+    if (ij.x >= 0 && ij.x < image.width && ij.y >= 0 && ij.y < image.height) {
+      render_focus = vec2f{(ij.x + 0.5f) / image.width,
+          (ij.y + 0.5f) / image.height};
+    } else {
+      render_focus = vec2f{0.5f, 0.5f};
+    }
+
     auto edited = false;
     auto camera = scene.cameras[params.camera];
     if (input.mouse_left && input.modifier_alt && !input.widgets_active) {
@@ -303,6 +495,16 @@ void run_interactive(const string& filename, const string& output,
   stop_render();
 }
 
+#else
+
+// render scene interactively
+void run_interactive(const string& filename, const string& output,
+    const pathtrace_params& params_, bool compress) {
+  throw std::runtime_error{"interactive mode requires OpenGL"};
+}
+
+#endif
+
 // Run
 void run(const vector<string>& args) {
   // command line parameters
@@ -310,6 +512,11 @@ void run(const vector<string>& args) {
   auto filename    = "scene.json"s;
   auto output      = "image.png"s;
   auto interactive = false;
+  auto stats       = false;
+  auto statsfile   = ""s;
+  auto costoutput  = ""s;
+  auto tracefile   = ""s;
+  auto compress    = false;
 
   // command line parsing
   auto cli = make_cli("ypathtrace", "Raytrace scenes.");
@@ -322,17 +529,44 @@ void run(const vector<string>& args) {
       cli, "shader", params.shader, "Shader type.", pathtrace_shader_names);
   add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
   add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 128});
+  add_option(cli, "diffusebounces", params.diffuse_bounces,
+      "Number of diffuse bounces, negative for no limit.", {-1, 128});
+  add_option(cli, "specularbounces", params.specular_bounces,
+      "Number of specular bounces, negative for no limit.", {-1, 128});
+  add_option(cli, "transmissionbounces", params.transmission_bounces,
+      "Number of transmission bounces, negative for no limit.", {-1, 128});
+  add_option(cli, "volumebounces", params.volume_bounces,
+      "Number of volume bounces, negative for no limit.", {-1, 128});
   add_option(cli, "noparallel", params.noparallel, "Disable threading.");
   add_option(cli, "noimplicitmis", params.noimplicit_mis, "Disable MIS on implicit shader");
   add_option(cli, "stmaxiter", params.spheretrace_maxiter,
       "Number of maximum iteration while spheretracing", {1, 512});
+  add_option(cli, "stats", stats, "Print render statistics.");
+  add_option(cli, "statsfile", statsfile, "Save render statistics as json.");
+  add_option(cli, "cost", params.cost, "Per-pixel cost type.",
+      pathtrace_cost_names);
+  add_option(cli, "costoutput", costoutput, "Per-pixel cost filename.");
+  add_option(cli, "trace", tracefile, "Save a Chrome trace json.");
+  add_option(cli, "compress", compress, "Compress shape vertex data.");
+  add_option(cli, "sbvh", params.sbvh, "Use spatial split shape bvhs.");
+  add_option(
+      cli, "flatten", params.flatten, "Flatten single identity instances.");
+  add_option(cli, "lazy", params.lazy, "Build shape bvhs on demand.");
+  add_option(cli, "adrrs", params.adrrs,
+      "Use adjoint-driven russian roulette and splitting.");
+  add_option(cli, "guiding", params.guiding, "Use path guiding.");
   parse_cli(cli, args);
 
+  // cost output
+  if (!costoutput.empty() && params.cost == pathtrace_cost_type::none)
+    params.cost = pathtrace_cost_type::time;
+
   // run
   if (!interactive) {
-    run_offline(filename, output, params);
+    run_offline(filename, output, params, stats, statsfile, costoutput,
+        tracefile, compress);
   } else {
-    run_interactive(filename, output, params);
+    run_interactive(filename, output, params, compress);
   }
 }
 
@@ -0,0 +1,74 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_shape.h>
+using namespace yocto;
+
+// Run
+void run(const vector<string>& args) {
+  // command line parameters
+  auto shapename = "shape.ply"s;
+  auto output    = "shape.yshape"s;
+  auto compress  = false;
+
+  // command line parsing
+  auto cli = make_cli("yshape", "Convert shapes, e.g. to the binary format.");
+  add_option(cli, "shape", shapename, "Input shape.");
+  add_option(cli, "output", output, "Output shape.");
+  add_option(cli, "compress", compress, "Compress vertex data.");
+  parse_cli(cli, args);
+
+  // load shape
+  auto error = string{};
+  auto shape = shape_data{};
+  print_progress_begin("load shape");
+  if (!load_shape(shapename, shape, error)) print_fatal(error);
+  print_progress_end();
+
+  // compress
+  if (compress) {
+    if (path_extension(output) != ".yshape")
+      print_fatal("compressed shapes can only be saved as yshape");
+    print_progress_begin("compress shape");
+    compress_shape(shape);
+    print_progress_end();
+  }
+
+  // save shape
+  print_progress_begin("save shape");
+  if (!save_shape(output, shape, error)) print_fatal(error);
+  print_progress_end();
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
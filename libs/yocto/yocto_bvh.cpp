@@ -39,8 +39,10 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <utility>
 
+#include "yocto_cli.h"
 #include "yocto_geometry.h"
 #include "yocto_parallel.h"
 
@@ -58,6 +60,7 @@ using std::array;
 using std::atomic;
 using std::pair;
 using std::string;
+using std::tuple;
 using namespace std::string_literals;
 
 }  // namespace yocto
@@ -133,15 +136,15 @@ static bvh_data make_embree_bvh(const shape_data& shape, bool highquality) {
     for (auto& l : shape.lines) {
       if (last_index == l.x) {
         elines.push_back((int)epositions.size() - 1);
-        auto& posy = shape.positions[l.y];
+        auto  posy = get_position(shape, l.y);
         auto& rady = shape.radius[l.y];
         epositions.push_back({posy.x, posy.y, posy.z, rady});
       } else {
         elines.push_back((int)epositions.size());
-        auto& posx = shape.positions[l.x];
+        auto  posx = get_position(shape, l.x);
         auto& radx = shape.radius[l.x];
         epositions.push_back({posx.x, posx.y, posx.z, radx});
-        auto& posy = shape.positions[l.y];
+        auto  posy = get_position(shape, l.y);
         auto& rady = shape.radius[l.y];
         epositions.push_back({posy.x, posy.y, posy.z, rady});
       }
@@ -162,14 +165,14 @@ static bvh_data make_embree_bvh(const shape_data& shape, bool highquality) {
   } else if (!shape.triangles.empty()) {
     auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_TRIANGLE);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
-    auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
+    auto embree_positions = (vec3f*)rtcSetNewGeometryBuffer(egeometry,
         RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4,
-        shape.positions.size());
+        num_vertices(shape));
     auto embree_triangles = rtcSetNewGeometryBuffer(egeometry,
         RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * 4,
         shape.triangles.size());
-    memcpy(
-        embree_positions, shape.positions.data(), shape.positions.size() * 12);
+    for (auto idx = 0; idx < num_vertices(shape); idx++)
+      embree_positions[idx] = get_position(shape, idx);
     memcpy(
         embree_triangles, shape.triangles.data(), shape.triangles.size() * 12);
     rtcCommitGeometry(egeometry);
@@ -178,13 +181,13 @@ static bvh_data make_embree_bvh(const shape_data& shape, bool highquality) {
   } else if (!shape.quads.empty()) {
     auto egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_QUAD);
     rtcSetGeometryVertexAttributeCount(egeometry, 1);
-    auto embree_positions = rtcSetNewGeometryBuffer(egeometry,
+    auto embree_positions = (vec3f*)rtcSetNewGeometryBuffer(egeometry,
         RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * 4,
-        shape.positions.size());
+        num_vertices(shape));
     auto embree_quads     = rtcSetNewGeometryBuffer(egeometry,
         RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT4, 4 * 4, shape.quads.size());
-    memcpy(
-        embree_positions, shape.positions.data(), shape.positions.size() * 12);
+    for (auto idx = 0; idx < num_vertices(shape); idx++)
+      embree_positions[idx] = get_position(shape, idx);
     memcpy(embree_quads, shape.quads.data(), shape.quads.size() * 16);
     rtcCommitGeometry(egeometry);
     rtcAttachGeometryByID(escene, egeometry, 0);
@@ -223,9 +226,9 @@ static bvh_data make_embree_bvh(
   } else {
     rtcSetSceneFlags(escene, RTC_SCENE_FLAG_COMPACT);
   }
-  for (auto instance_id = 0; instance_id < (int)scene.instances.size();
+  for (auto instance_id = 0; instance_id < num_instances(scene);
        instance_id++) {
-    auto& instance  = scene.instances[instance_id];
+    auto  instance  = get_instance(scene, instance_id);
     auto& sbvh      = bvh.shapes[instance.shape];
     auto  egeometry = rtcNewGeometry(edevice, RTC_GEOMETRY_TYPE_INSTANCE);
     rtcSetGeometryInstancedScene(egeometry, (RTCScene)sbvh.embree_bvh.get());
@@ -244,7 +247,7 @@ static void update_embree_bvh(bvh_data& bvh, const scene_data& scene,
   // scene bvh
   auto escene = (RTCScene)bvh.embree_bvh.get();
   for (auto instance_id : updated_instances) {
-    auto& instance    = scene.instances[instance_id];
+    auto  instance    = get_instance(scene, instance_id);
     auto& sbvh        = bvh.shapes[instance.shape];
     auto  embree_geom = rtcGetGeometry(escene, instance_id);
     rtcSetGeometryInstancedScene(embree_geom, (RTCScene)sbvh.embree_bvh.get());
@@ -443,6 +446,48 @@ static pair<int, int> split_middle(vector<int>& primitives,
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
+// Reorder the nodes of a bvh for cache locality. Nodes are laid out in
+// depth first order, with a padding node after the root so that sibling
+// pairs start at even indices and, with the cache aligned node storage,
+// share a cache line. Leaf primitives are reordered to match the leaves.
+// Children still follow their parents, as in build_bvh().
+static void reorder_bvh(bvh_data& bvh) {
+  if (bvh.nodes.size() <= 1) return;
+
+  // lay out nodes, patching the children of the parents as pairs are placed
+  auto nodes = bvh_vector<bvh_node>{};
+  auto stack = vector<pair<int, int>>{{0, 0}};  // old and new node ids
+  nodes.reserve(bvh.nodes.size() + 1);
+  nodes.push_back(bvh.nodes[0]);
+  nodes.push_back({});
+  while (!stack.empty()) {
+    auto [parent, parent_] = stack.back();
+    stack.pop_back();
+    if (!bvh.nodes[parent].internal) continue;
+    auto start           = bvh.nodes[parent].start;
+    nodes[parent_].start = (int)nodes.size();
+    nodes.push_back(bvh.nodes[start + 0]);
+    nodes.push_back(bvh.nodes[start + 1]);
+    stack.push_back({start + 1, nodes[parent_].start + 1});
+    stack.push_back({start + 0, nodes[parent_].start + 0});
+  }
+
+  // reorder primitives in leaf order
+  auto primitives = vector<int>{};
+  primitives.reserve(bvh.primitives.size());
+  for (auto& node : nodes) {
+    if (node.internal) continue;
+    auto start = (int)primitives.size();
+    primitives.insert(primitives.end(), bvh.primitives.begin() + node.start,
+        bvh.primitives.begin() + node.start + node.num);
+    node.start = start;
+  }
+
+  // done
+  bvh.nodes      = std::move(nodes);
+  bvh.primitives = std::move(primitives);
+}
+
 // Build BVH nodes
 static void build_bvh(
     bvh_data& bvh, const vector<bbox3f>& bboxes, bool highquality) {
@@ -504,6 +549,9 @@ static void build_bvh(
 
   // cleanup
   bvh.nodes.shrink_to_fit();
+
+  // cache friendly layout
+  reorder_bvh(bvh);
 }
 
 // Update bvh
@@ -523,7 +571,381 @@ static void refit_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes) {
   }
 }
 
-bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
+// Reference to a shape element in a spatial split bvh, with the bounds of
+// the part of the element it covers. Elements split by spatial splits have
+// one reference on each side.
+struct sbvh_reference {
+  int    primitive = 0;
+  bbox3f bbox      = invalidb3f;
+};
+
+// Surface area of a bounding box, used by the SAH costs.
+static float sbvh_area(const bbox3f& bbox) {
+  if (bbox.min.x > bbox.max.x) return 0;
+  auto size = bbox.max - bbox.min;
+  return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+// Bounds of the parts of a reference on either side of an axis plane, by
+// clipping the edges of its element and intersecting with its bounds.
+static pair<bbox3f, bbox3f> split_reference(const shape_data& shape,
+    const sbvh_reference& reference, int axis, float position) {
+  auto vertices  = array<vec3f, 4>{};
+  auto nvertices = 0;
+  if (!shape.triangles.empty()) {
+    auto& t   = shape.triangles[reference.primitive];
+    vertices  = {get_position(shape, t.x), get_position(shape, t.y),
+        get_position(shape, t.z), {0, 0, 0}};
+    nvertices = 3;
+  } else {
+    auto& q   = shape.quads[reference.primitive];
+    vertices  = {get_position(shape, q.x), get_position(shape, q.y),
+        get_position(shape, q.z), get_position(shape, q.w)};
+    nvertices = q.z == q.w ? 3 : 4;
+  }
+  auto left = invalidb3f, right = invalidb3f;
+  for (auto idx = 0; idx < nvertices; idx++) {
+    auto& v0 = vertices[idx];
+    auto& v1 = vertices[(idx + 1) % nvertices];
+    if (v0[axis] <= position) left = merge(left, v0);
+    if (v0[axis] >= position) right = merge(right, v0);
+    if ((v0[axis] < position && v1[axis] > position) ||
+        (v0[axis] > position && v1[axis] < position)) {
+      auto t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+      auto p = v0 + (v1 - v0) * clamp(t, 0.0f, 1.0f);
+      p[axis] = position;
+      left    = merge(left, p);
+      right   = merge(right, p);
+    }
+  }
+  auto clip = [&reference](bbox3f bbox) {
+    bbox.min = max(bbox.min, reference.bbox.min);
+    bbox.max = min(bbox.max, reference.bbox.max);
+    if (bbox.min.x > bbox.max.x || bbox.min.y > bbox.max.y ||
+        bbox.min.z > bbox.max.z)
+      return invalidb3f;
+    return bbox;
+  };
+  return {clip(left), clip(right)};
+}
+
+// Best split of a spatial split bvh node
+struct sbvh_split {
+  float cost     = flt_max;
+  int   axis     = 0;
+  float position = 0;
+  bool  spatial  = false;
+  float overlap  = 0;  // overlap area of the children of object splits
+};
+
+// Number of bins used to evaluate splits in spatial split bvhs.
+const int sbvh_nbins = 16;
+
+// Finds the best object split by binning the reference centers.
+static sbvh_split split_sbvh_object(
+    const vector<sbvh_reference>& references, const bbox3f& bbox) {
+  auto cbbox = invalidb3f;
+  for (auto& reference : references)
+    cbbox = merge(cbbox, center(reference.bbox));
+  auto csize = cbbox.max - cbbox.min;
+  auto split = sbvh_split{};
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    auto bins_bbox  = array<bbox3f, sbvh_nbins>{};
+    auto bins_count = array<int, sbvh_nbins>{};
+    for (auto& bin_bbox : bins_bbox) bin_bbox = invalidb3f;
+    for (auto& reference : references) {
+      auto bin = (int)(sbvh_nbins * (center(reference.bbox)[axis] -
+                                        cbbox.min[axis]) /
+                       csize[axis]);
+      bin      = clamp(bin, 0, sbvh_nbins - 1);
+      bins_bbox[bin] = merge(bins_bbox[bin], reference.bbox);
+      bins_count[bin] += 1;
+    }
+    auto right_bbox  = array<bbox3f, sbvh_nbins>{};
+    auto right_count = array<int, sbvh_nbins>{};
+    auto accum_bbox  = invalidb3f;
+    auto accum_count = 0;
+    for (auto bin = sbvh_nbins - 1; bin > 0; bin--) {
+      accum_bbox       = merge(accum_bbox, bins_bbox[bin]);
+      accum_count      = accum_count + bins_count[bin];
+      right_bbox[bin]  = accum_bbox;
+      right_count[bin] = accum_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < sbvh_nbins; bin++) {
+      left_bbox = merge(left_bbox, bins_bbox[bin - 1]);
+      left_count += bins_count[bin - 1];
+      if (left_count == 0 || right_count[bin] == 0) continue;
+      auto cost = 1 + (left_count * sbvh_area(left_bbox) +
+                          right_count[bin] * sbvh_area(right_bbox[bin])) /
+                          sbvh_area(bbox);
+      if (cost < split.cost) {
+        auto overlap = bbox3f{max(left_bbox.min, right_bbox[bin].min),
+            min(left_bbox.max, right_bbox[bin].max)};
+        split.cost     = cost;
+        split.axis     = axis;
+        split.position = cbbox.min[axis] + bin * csize[axis] / sbvh_nbins;
+        split.overlap  = (overlap.min.x <= overlap.max.x &&
+                            overlap.min.y <= overlap.max.y &&
+                            overlap.min.z <= overlap.max.z)
+                             ? sbvh_area(overlap)
+                             : 0;
+      }
+    }
+  }
+  return split;
+}
+
+// Finds the best spatial split by clipping the references to the bins of
+// the node bounds, counting them once in the bins they enter and exit.
+static sbvh_split split_sbvh_spatial(const shape_data& shape,
+    const vector<sbvh_reference>& references, const bbox3f& bbox) {
+  auto size  = bbox.max - bbox.min;
+  auto split = sbvh_split{};
+  for (auto axis = 0; axis < 3; axis++) {
+    if (size[axis] == 0) continue;
+    auto bin_size   = size[axis] / sbvh_nbins;
+    auto bins_bbox  = array<bbox3f, sbvh_nbins>{};
+    auto bins_enter = array<int, sbvh_nbins>{};
+    auto bins_exit  = array<int, sbvh_nbins>{};
+    for (auto& bin_bbox : bins_bbox) bin_bbox = invalidb3f;
+    auto get_bin = [&](float value) {
+      return clamp((int)((value - bbox.min[axis]) / bin_size), 0,
+          sbvh_nbins - 1);
+    };
+    for (auto& reference : references) {
+      auto first = get_bin(reference.bbox.min[axis]);
+      auto last  = get_bin(reference.bbox.max[axis]);
+      bins_enter[first] += 1;
+      bins_exit[last] += 1;
+      auto piece = reference;
+      for (auto bin = first; bin < last; bin++) {
+        auto [left, right] = split_reference(
+            shape, piece, axis, bbox.min[axis] + (bin + 1) * bin_size);
+        bins_bbox[bin] = merge(bins_bbox[bin], left);
+        piece.bbox     = right;
+      }
+      bins_bbox[last] = merge(bins_bbox[last], piece.bbox);
+    }
+    auto right_bbox  = array<bbox3f, sbvh_nbins>{};
+    auto right_count = array<int, sbvh_nbins>{};
+    auto accum_bbox  = invalidb3f;
+    auto accum_count = 0;
+    for (auto bin = sbvh_nbins - 1; bin > 0; bin--) {
+      accum_bbox       = merge(accum_bbox, bins_bbox[bin]);
+      accum_count      = accum_count + bins_exit[bin];
+      right_bbox[bin]  = accum_bbox;
+      right_count[bin] = accum_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < sbvh_nbins; bin++) {
+      left_bbox = merge(left_bbox, bins_bbox[bin - 1]);
+      left_count += bins_enter[bin - 1];
+      if (left_count == 0 || right_count[bin] == 0) continue;
+      auto cost = 1 + (left_count * sbvh_area(left_bbox) +
+                          right_count[bin] * sbvh_area(right_bbox[bin])) /
+                          sbvh_area(bbox);
+      if (cost < split.cost) {
+        split.cost     = cost;
+        split.axis     = axis;
+        split.position = bbox.min[axis] + bin * bin_size;
+        split.spatial  = true;
+      }
+    }
+  }
+  return split;
+}
+
+// Maximum depth of spatial splits, that may not reduce the references.
+const int sbvh_max_depth = 48;
+
+// Build spatial split BVH nodes. Spatial splits are only evaluated when the
+// children of the best object split overlap by more than a small fraction
+// of the root area, and only taken while the duplicated references fit in
+// the budget.
+static void build_sbvh(bvh_data& bvh, const shape_data& shape,
+    vector<sbvh_reference>&& references, int budget) {
+  // prepare to build nodes
+  bvh.nodes.clear();
+  bvh.primitives.clear();
+  bvh.nodes.reserve(references.size() * 2);
+  bvh.primitives.reserve(references.size() + budget);
+
+  // spatial splits are considered only above this overlap
+  auto root_bbox = invalidb3f;
+  for (auto& reference : references)
+    root_bbox = merge(root_bbox, reference.bbox);
+  auto min_overlap = 1e-5f * sbvh_area(root_bbox);
+
+  // push first node onto the stack
+  auto stack = vector<tuple<int, int, vector<sbvh_reference>>>{};
+  stack.push_back({0, 0, std::move(references)});
+  bvh.nodes.emplace_back();
+
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, depth, refs] = std::move(stack.back());
+    stack.pop_back();
+
+    // compute bounds
+    auto bbox = invalidb3f;
+    for (auto& reference : refs) bbox = merge(bbox, reference.bbox);
+    bvh.nodes[nodeid].bbox = bbox;
+
+    // make a leaf node
+    if ((int)refs.size() <= bvh_max_prims) {
+      auto& node    = bvh.nodes[nodeid];
+      node.internal = false;
+      node.num      = (int16_t)refs.size();
+      node.start    = (int)bvh.primitives.size();
+      for (auto& reference : refs)
+        bvh.primitives.push_back(reference.primitive);
+      continue;
+    }
+
+    // get split, considering spatial splits only if object splits overlap
+    auto split = split_sbvh_object(refs, bbox);
+    if (budget > 0 && depth < sbvh_max_depth && split.overlap > min_overlap) {
+      auto spatial = split_sbvh_spatial(shape, refs, bbox);
+      if (spatial.cost < split.cost) split = spatial;
+    }
+
+    // partition references
+    auto left = vector<sbvh_reference>{}, right = vector<sbvh_reference>{};
+    if (split.cost == flt_max) {
+      // all centers coincide, just break the references in half
+      auto middle = refs.begin() + refs.size() / 2;
+      left.assign(refs.begin(), middle);
+      right.assign(middle, refs.end());
+    } else if (!split.spatial) {
+      for (auto& reference : refs) {
+        auto& side = center(reference.bbox)[split.axis] < split.position
+                         ? left
+                         : right;
+        side.push_back(reference);
+      }
+    } else {
+      auto duplicates = 0;
+      for (auto& reference : refs) {
+        if (reference.bbox.max[split.axis] <= split.position) {
+          left.push_back(reference);
+        } else if (reference.bbox.min[split.axis] >= split.position) {
+          right.push_back(reference);
+        } else {
+          auto [lbbox, rbbox] = split_reference(
+              shape, reference, split.axis, split.position);
+          if (lbbox.min.x <= lbbox.max.x)
+            left.push_back({reference.primitive, lbbox});
+          if (rbbox.min.x <= rbbox.max.x)
+            right.push_back({reference.primitive, rbbox});
+          duplicates += 1;
+        }
+      }
+      budget -= duplicates;
+    }
+    if (left.empty() || right.empty()) {
+      left.clear();
+      right.clear();
+      auto middle = refs.begin() + refs.size() / 2;
+      left.assign(refs.begin(), middle);
+      right.assign(middle, refs.end());
+    }
+
+    // make an internal node
+    auto  start   = (int)bvh.nodes.size();
+    auto& node    = bvh.nodes[nodeid];
+    node.internal = true;
+    node.axis     = (uint8_t)split.axis;
+    node.num      = 2;
+    node.start    = start;
+    bvh.nodes.emplace_back();
+    bvh.nodes.emplace_back();
+    stack.push_back({start + 0, depth + 1, std::move(left)});
+    stack.push_back({start + 1, depth + 1, std::move(right)});
+  }
+
+  // cleanup
+  bvh.nodes.shrink_to_fit();
+  bvh.primitives.shrink_to_fit();
+
+  // cache friendly layout
+  reorder_bvh(bvh);
+}
+
+// Number of lanes of bvh packets, that fit the largest leaves.
+const int bvh_packet_size = 4;
+
+// Build the packets of the leaves of triangle and quad bvhs. Leaf primitives
+// are padded so that leaves start at multiples of the packet size, and the
+// packets of a leaf are found from its start.
+static void build_packets(bvh_data& bvh, const shape_data& shape) {
+  bvh.packets.clear();
+  if (shape.triangles.empty() && shape.quads.empty()) return;
+
+  // pad leaf primitives
+  auto primitives = vector<int>{};
+  primitives.reserve(bvh.primitives.size() * 2);
+  for (auto& node : bvh.nodes) {
+    if (node.internal) continue;
+    auto start = (int)primitives.size();
+    primitives.insert(primitives.end(), bvh.primitives.begin() + node.start,
+        bvh.primitives.begin() + node.start + node.num);
+    primitives.resize(start + bvh_packet_size, -1);
+    node.start = start;
+  }
+  bvh.primitives = std::move(primitives);
+
+  // set a lane to a triangle
+  auto set_lane = [](bvh_packet& packet, int lane, int element,
+                      const vec3f& p0, const vec3f& p1, const vec3f& p2) {
+    auto edge1            = p1 - p0;
+    auto edge2            = p2 - p0;
+    packet.px[lane]       = p0.x;
+    packet.py[lane]       = p0.y;
+    packet.pz[lane]       = p0.z;
+    packet.e1x[lane]      = edge1.x;
+    packet.e1y[lane]      = edge1.y;
+    packet.e1z[lane]      = edge1.z;
+    packet.e2x[lane]      = edge2.x;
+    packet.e2y[lane]      = edge2.y;
+    packet.e2z[lane]      = edge2.z;
+    packet.elements[lane] = element;
+  };
+
+  // fill packets, with the triangles of quads split as in intersect_quad()
+  auto npackets = shape.quads.empty() ? 1 : 2;
+  bvh.packets.assign(
+      bvh.primitives.size() / bvh_packet_size * npackets, bvh_packet{});
+  for (auto& node : bvh.nodes) {
+    if (node.internal) continue;
+    auto packet = node.start / bvh_packet_size * npackets;
+    for (auto lane = 0; lane < node.num; lane++) {
+      auto element = bvh.primitives[node.start + lane];
+      if (!shape.triangles.empty()) {
+        auto& t = shape.triangles[element];
+        set_lane(bvh.packets[packet], lane, element, get_position(shape, t.x),
+            get_position(shape, t.y), get_position(shape, t.z));
+      } else {
+        auto& q = shape.quads[element];
+        set_lane(bvh.packets[packet], lane, element, get_position(shape, q.x),
+            get_position(shape, q.y), get_position(shape, q.w));
+        if (get_position(shape, q.z) == get_position(shape, q.w)) continue;
+        set_lane(bvh.packets[packet + 1], lane, element,
+            get_position(shape, q.z), get_position(shape, q.w),
+            get_position(shape, q.y));
+      }
+    }
+  }
+}
+
+bvh_data make_bvh(const shape_data& shape, bool highquality,
+    [[maybe_unused]] bool embree) {
+  auto zone = trace_zone{"make_bvh_shape"};
+
   // embree
 #ifdef YOCTO_EMBREE
   if (embree) return make_embree_bvh(shape, highquality);
@@ -538,76 +960,326 @@ bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
     bboxes = vector<bbox3f>(shape.points.size());
     for (auto idx = 0; idx < shape.points.size(); idx++) {
       auto& point = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[point], shape.radius[point]);
+      bboxes[idx] = point_bounds(
+          get_position(shape, point), shape.radius[point]);
     }
   } else if (!shape.lines.empty()) {
     bboxes = vector<bbox3f>(shape.lines.size());
     for (auto idx = 0; idx < shape.lines.size(); idx++) {
       auto& line  = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[line.x],
-          shape.positions[line.y], shape.radius[line.x], shape.radius[line.y]);
+      bboxes[idx] = line_bounds(get_position(shape, line.x),
+          get_position(shape, line.y), shape.radius[line.x],
+          shape.radius[line.y]);
     }
   } else if (!shape.triangles.empty()) {
     bboxes = vector<bbox3f>(shape.triangles.size());
     for (auto idx = 0; idx < shape.triangles.size(); idx++) {
       auto& triangle = shape.triangles[idx];
-      bboxes[idx]    = triangle_bounds(shape.positions[triangle.x],
-          shape.positions[triangle.y], shape.positions[triangle.z]);
+      bboxes[idx]    = triangle_bounds(get_position(shape, triangle.x),
+          get_position(shape, triangle.y), get_position(shape, triangle.z));
     }
   } else if (!shape.quads.empty()) {
     bboxes = vector<bbox3f>(shape.quads.size());
     for (auto idx = 0; idx < shape.quads.size(); idx++) {
       auto& quad  = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[quad.x],
-          shape.positions[quad.y], shape.positions[quad.z],
-          shape.positions[quad.w]);
+      bboxes[idx] = quad_bounds(get_position(shape, quad.x),
+          get_position(shape, quad.y), get_position(shape, quad.z),
+          get_position(shape, quad.w));
     }
   }
 
   // build nodes
   build_bvh(bvh, bboxes, highquality);
 
+  // build leaf packets
+  build_packets(bvh, shape);
+
   // done
   return bvh;
 }
 
-bvh_data make_bvh(
-    const scene_data& scene, bool highquality, bool embree, bool noparallel) {
-  // embree
+bvh_data make_sbvh(const shape_data& shape, float budget) {
+  auto zone = trace_zone{"make_sbvh_shape"};
+
+  // spatial splits clip triangles and quads only
+  if (shape.triangles.empty() && shape.quads.empty())
+    return make_bvh(shape, true);
+
+  // build references
+  auto references = vector<sbvh_reference>{};
+  if (!shape.triangles.empty()) {
+    references.reserve(shape.triangles.size());
+    for (auto idx = 0; idx < (int)shape.triangles.size(); idx++) {
+      auto& triangle = shape.triangles[idx];
+      references.push_back(
+          {idx, triangle_bounds(get_position(shape, triangle.x),
+                    get_position(shape, triangle.y),
+                    get_position(shape, triangle.z))});
+    }
+  } else {
+    references.reserve(shape.quads.size());
+    for (auto idx = 0; idx < (int)shape.quads.size(); idx++) {
+      auto& quad = shape.quads[idx];
+      references.push_back(
+          {idx, quad_bounds(get_position(shape, quad.x),
+                    get_position(shape, quad.y), get_position(shape, quad.z),
+                    get_position(shape, quad.w))});
+    }
+  }
+
+  // build nodes
+  auto bvh        = bvh_data{};
+  auto duplicates = (int)(budget * references.size());
+  build_sbvh(bvh, shape, std::move(references), duplicates);
+
+  // build leaf packets
+  build_packets(bvh, shape);
+
+  // done
+  return bvh;
+}
+
+// Bounds of an instance from the bvh of its shape
+static bbox3f instance_bounds(
+    const bvh_data& bvh, const frame3f& frame, int shape) {
+  if (bvh.lazy) {
+    auto& bbox = bvh.lazy->bounds[shape];
+    return bbox.min.x > bbox.max.x ? invalidb3f : transform_bbox(frame, bbox);
+  }
+  auto& sbvh = bvh.shapes[shape];
+  return sbvh.nodes.empty() ? invalidb3f
+                            : transform_bbox(frame, sbvh.nodes[0].bbox);
+}
+
+// Bounds of an instance group placement from the bvh of the group
+static bbox3f group_bounds(
+    const bvh_data& bvh, const frame3f& frame, int group) {
+  auto& gbvh = bvh.groups[group];
+  return gbvh.nodes.empty() ? invalidb3f
+                            : transform_bbox(frame, gbvh.nodes[0].bbox);
+}
+
+// Build the bvh of an instance group after the ones of its nested groups.
+// Primitives are the group instances followed by the nested groups. Groups
+// already visited are skipped, so that invalid cycles do not recurse.
+static void build_group_bvh(bvh_data& bvh, const scene_data& scene,
+    int group, vector<bool>& visited, bool highquality) {
+  if (visited[group]) return;
+  visited[group] = true;
+  auto& group_   = scene.instance_groups[group];
+  for (auto& nested : group_.groups) {
+    build_group_bvh(bvh, scene, nested.group, visited, highquality);
+  }
+  auto bboxes = vector<bbox3f>{};
+  bboxes.reserve(group_.instances.size() + group_.groups.size());
+  for (auto& instance : group_.instances) {
+    bboxes.push_back(instance_bounds(bvh, instance.frame, instance.shape));
+  }
+  for (auto& nested : group_.groups) {
+    bboxes.push_back(group_bounds(bvh, nested.frame, nested.group));
+  }
+  build_bvh(bvh.groups[group], bboxes, highquality);
+}
+
+// Build the bvhs of all instance groups
+static void build_group_bvhs(
+    bvh_data& bvh, const scene_data& scene, bool highquality) {
+  bvh.groups   = vector<bvh_data>(scene.instance_groups.size());
+  auto visited = vector<bool>(scene.instance_groups.size(), false);
+  for (auto group = 0; group < (int)scene.instance_groups.size(); group++) {
+    build_group_bvh(bvh, scene, group, visited, highquality);
+  }
+}
+
+// Bounds of a shape element
+static bbox3f element_bounds(const shape_data& shape, int element) {
+  if (!shape.points.empty()) {
+    auto& point = shape.points[element];
+    return point_bounds(get_position(shape, point), shape.radius[point]);
+  } else if (!shape.lines.empty()) {
+    auto& line = shape.lines[element];
+    return line_bounds(get_position(shape, line.x),
+        get_position(shape, line.y), shape.radius[line.x],
+        shape.radius[line.y]);
+  } else if (!shape.triangles.empty()) {
+    auto& triangle = shape.triangles[element];
+    return triangle_bounds(get_position(shape, triangle.x),
+        get_position(shape, triangle.y), get_position(shape, triangle.z));
+  } else if (!shape.quads.empty()) {
+    auto& quad = shape.quads[element];
+    return quad_bounds(get_position(shape, quad.x),
+        get_position(shape, quad.y), get_position(shape, quad.z),
+        get_position(shape, quad.w));
+  } else {
+    return invalidb3f;
+  }
+}
+
+// Bounds of a shape, as the ones of its bvh, without building it
+static bbox3f shape_bounds(const shape_data& shape) {
+  auto elements = shape.points.size() + shape.lines.size() +
+                  shape.triangles.size() + shape.quads.size();
+  auto bbox = invalidb3f;
+  for (auto element = 0; element < (int)elements; element++) {
+    bbox = merge(bbox, element_bounds(shape, element));
+  }
+  return bbox;
+}
+
+// Flatten the instances that are the only use of their shape and have an
+// identity frame, storing their elements in the scene bvh
+static void flatten_instances(bvh_data& bvh, const scene_data& scene) {
+  // count shape uses, with instance arrays and groups never flattened
+  auto uses = vector<int>(scene.shapes.size(), 0);
+  for (auto& instance : scene.instances) uses[instance.shape] += 1;
+  for (auto& array : scene.instance_arrays) uses[array.shape] += 2;
+  for (auto& group : scene.instance_groups) {
+    for (auto& instance : group.instances) uses[instance.shape] += 2;
+  }
+
+  // elements
+  bvh.elements.clear();
+  for (auto idx = 0; idx < (int)scene.instances.size(); idx++) {
+    auto& instance = scene.instances[idx];
+    if (uses[instance.shape] != 1 || instance.frame != identity3x4f) continue;
+    auto& shape    = scene.shapes[instance.shape];
+    auto  elements = shape.points.size() + shape.lines.size() +
+                    shape.triangles.size() + shape.quads.size();
+    for (auto element = 0; element < (int)elements; element++) {
+      bvh.elements.push_back({idx, element});
+    }
+  }
+}
+
+// Whether instances are flattened in the scene bvh
+static vector<bool> flattened_instances(
+    const bvh_data& bvh, const scene_data& scene) {
+  auto flattened = vector<bool>(scene.instances.size(), false);
+  for (auto& element : bvh.elements) flattened[element.x] = true;
+  return flattened;
+}
+
+// Bounds of the scene bvh primitives: instances, instances of instance
+// arrays, read directly from their frames, instance group placements and
+// elements of flattened instances. Flattened instances have invalid bounds.
+static vector<bbox3f> scene_bounds(
+    const bvh_data& bvh, const scene_data& scene) {
+  auto flattened = flattened_instances(bvh, scene);
+  auto bboxes    = vector<bbox3f>{};
+  bboxes.reserve(num_instances(scene) + scene.group_instances.size() +
+                 bvh.elements.size());
+  for (auto idx = 0; idx < (int)scene.instances.size(); idx++) {
+    auto& instance = scene.instances[idx];
+    bboxes.push_back(flattened[idx] ? invalidb3f
+                                    : instance_bounds(bvh, instance.frame,
+                                          instance.shape));
+  }
+  for (auto& array : scene.instance_arrays) {
+    for (auto& frame : array.frames) {
+      bboxes.push_back(instance_bounds(bvh, frame, array.shape));
+    }
+  }
+  for (auto& instance : scene.group_instances) {
+    bboxes.push_back(group_bounds(bvh, instance.frame, instance.group));
+  }
+  for (auto& [instance, element] : bvh.elements) {
+    bboxes.push_back(
+        element_bounds(scene.shapes[scene.instances[instance].shape], element));
+  }
+  return bboxes;
+}
+
+// Build the nodes of the scene bvh, leaving out flattened instances
+static void build_scene_bvh(
+    bvh_data& bvh, const scene_data& scene, bool highquality) {
+  auto bboxes = scene_bounds(bvh, scene);
+  if (bvh.elements.empty()) return build_bvh(bvh, bboxes, highquality);
+
+  // build over the primitives that are not flattened, then remap them
+  auto flattened  = flattened_instances(bvh, scene);
+  auto primitives = vector<int>{};
+  auto pbboxes    = vector<bbox3f>{};
+  primitives.reserve(bboxes.size());
+  pbboxes.reserve(bboxes.size());
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+    if (idx < (int)flattened.size() && flattened[idx]) continue;
+    primitives.push_back(idx);
+    pbboxes.push_back(bboxes[idx]);
+  }
+  build_bvh(bvh, pbboxes, highquality);
+  for (auto& primitive : bvh.primitives) primitive = primitives[primitive];
+}
+
+bvh_data make_bvh(const scene_data& scene, bool highquality,
+    [[maybe_unused]] bool embree, bool noparallel, bool flatten) {
+  auto zone = trace_zone{"make_bvh"};
+
+  // embree, that does not support instance groups
 #ifdef YOCTO_EMBREE
-  if (embree) return make_embree_bvh(scene, highquality, noparallel);
+  if (embree && scene.group_instances.empty())
+    return make_embree_bvh(scene, highquality, noparallel);
 #endif
 
   // bvh
   auto bvh = bvh_data{};
+  complete_bvh(bvh, scene, highquality, noparallel, flatten);
+
+  // done
+  return bvh;
+}
+
+void complete_bvh(bvh_data& bvh, const scene_data& scene, bool highquality,
+    bool noparallel, bool flatten,
+    const function<bvh_data(const shape_data&)>& lazy) {
+  auto zone = trace_zone{"complete_bvh"};
 
-  // build shape bvh
+  // build missing shape bvh, or only their bounds if built on demand
   bvh.shapes.resize(scene.shapes.size());
-  if (noparallel) {
-    for (auto idx = (size_t)0; idx < scene.shapes.size(); idx++) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
+  auto missing = vector<int>{};
+  for (auto idx = 0; idx < (int)scene.shapes.size(); idx++) {
+    if (bvh.shapes[idx].nodes.empty()) missing.push_back(idx);
+  }
+  if (!lazy) {
+    bvh.lazy         = nullptr;
+    auto build_shape = [&](int idx) {
+      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality);
+    };
+    if (noparallel) {
+      for (auto idx : missing) build_shape(idx);
+    } else {
+      parallel_foreach(missing, build_shape);
     }
   } else {
-    parallel_for(scene.shapes.size(), [&](size_t idx) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
-    });
+    bvh.lazy         = std::make_unique<bvh_lazy_shapes>();
+    bvh.lazy->build  = lazy;
+    bvh.lazy->built  = vector<std::once_flag>(scene.shapes.size());
+    bvh.lazy->bounds = vector<bbox3f>(scene.shapes.size(), invalidb3f);
+    for (auto idx = 0; idx < (int)scene.shapes.size(); idx++) {
+      if (bvh.shapes[idx].nodes.empty()) continue;
+      bvh.lazy->bounds[idx] = bvh.shapes[idx].nodes[0].bbox;
+    }
+    auto shape_bounds_ = [&](int idx) {
+      bvh.lazy->bounds[idx] = shape_bounds(scene.shapes[idx]);
+    };
+    if (noparallel) {
+      for (auto idx : missing) shape_bounds_(idx);
+    } else {
+      parallel_foreach(missing, shape_bounds_);
+    }
   }
 
-  // instance bboxes
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = sbvh.nodes.empty()
-                         ? invalidb3f
-                         : transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+  // build instance group bvhs, nested groups first
+  build_group_bvhs(bvh, scene, highquality);
+
+  // flatten single identity instances
+  if (flatten) {
+    flatten_instances(bvh, scene);
+  } else {
+    bvh.elements.clear();
   }
 
   // build nodes
-  build_bvh(bvh, bboxes, highquality);
-
-  // done
-  return bvh;
+  build_scene_bvh(bvh, scene, highquality);
 }
 
 static void refit_bvh(bvh_data& bvh, const shape_data& shape) {
@@ -623,33 +1295,35 @@ static void refit_bvh(bvh_data& bvh, const shape_data& shape) {
     bboxes = vector<bbox3f>(shape.points.size());
     for (auto idx = 0; idx < bboxes.size(); idx++) {
       auto& p     = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
+      bboxes[idx] = point_bounds(get_position(shape, p), shape.radius[p]);
     }
   } else if (!shape.lines.empty()) {
     bboxes = vector<bbox3f>(shape.lines.size());
     for (auto idx = 0; idx < bboxes.size(); idx++) {
       auto& l     = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
-          shape.radius[l.x], shape.radius[l.y]);
+      bboxes[idx] = line_bounds(get_position(shape, l.x),
+          get_position(shape, l.y), shape.radius[l.x], shape.radius[l.y]);
     }
   } else if (!shape.triangles.empty()) {
     bboxes = vector<bbox3f>(shape.triangles.size());
     for (auto idx = 0; idx < bboxes.size(); idx++) {
       auto& t     = shape.triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+      bboxes[idx] = triangle_bounds(get_position(shape, t.x),
+          get_position(shape, t.y), get_position(shape, t.z));
     }
   } else if (!shape.quads.empty()) {
     bboxes = vector<bbox3f>(shape.quads.size());
     for (auto idx = 0; idx < bboxes.size(); idx++) {
       auto& q     = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
-          shape.positions[q.z], shape.positions[q.w]);
+      bboxes[idx] = quad_bounds(get_position(shape, q.x),
+          get_position(shape, q.y), get_position(shape, q.z),
+          get_position(shape, q.w));
     }
   }
 
-  // update nodes
+  // update nodes and leaf packets
   refit_bvh(bvh, bboxes);
+  build_packets(bvh, shape);
 }
 
 void refit_bvh(bvh_data& bvh, const scene_data& scene,
@@ -660,16 +1334,8 @@ void refit_bvh(bvh_data& bvh, const scene_data& scene,
   }
 #endif
 
-  // build primitives
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = transform_bbox(instance.frame, sbvh.nodes[0].bbox);
-  }
-
   // update nodes
-  refit_bvh(bvh, bboxes);
+  refit_bvh(bvh, scene_bounds(bvh, scene));
 }
 
 void update_bvh(bvh_data& bvh, const shape_data& shape) {
@@ -682,6 +1348,22 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
   // update shapes
   for (auto shape : updated_shapes) {
     refit_bvh(bvh.shapes[shape], scene.shapes[shape]);
+    if (bvh.lazy) bvh.lazy->bounds[shape] = shape_bounds(scene.shapes[shape]);
+  }
+
+  // rebuild groups, that are small compared to shapes, if their shapes changed
+  if (!updated_shapes.empty() && !scene.instance_groups.empty()) {
+    build_group_bvhs(bvh, scene, false);
+  }
+
+  // rebuild the scene bvh if flattened instances changed
+  if (!bvh.elements.empty()) {
+    auto flattened = flattened_instances(bvh, scene);
+    for (auto instance : updated_instances) {
+      if (instance >= (int)flattened.size() || !flattened[instance]) continue;
+      flatten_instances(bvh, scene);
+      return build_scene_bvh(bvh, scene, false);
+    }
   }
 
   // handle instances
@@ -690,20 +1372,137 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH STATISTICS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+#ifdef YOCTO_STATS
+static auto bvh_thread_stats = thread_stats<bvh_stats>{};
+#endif
+
+// Update the statistics of the calling thread
+static inline void update_bvh_stats(
+    uint64_t rays, uint64_t nodes, uint64_t primitives, uint64_t instances) {
+#ifdef YOCTO_STATS
+  auto& stats = bvh_thread_stats.local();
+  stats.rays += rays;
+  stats.nodes += nodes;
+  stats.primitives += primitives;
+  stats.instances += instances;
+#endif
+}
+
+// Sum the statistics of all threads
+bvh_stats get_bvh_stats() {
+#ifdef YOCTO_STATS
+  return bvh_thread_stats.sum();
+#else
+  return {};
+#endif
+}
+void reset_bvh_stats() {
+#ifdef YOCTO_STATS
+  bvh_thread_stats.reset();
+#endif
+}
+bvh_stats get_bvh_thread_stats() {
+#ifdef YOCTO_STATS
+  return bvh_thread_stats.local();
+#else
+  return {};
+#endif
+}
+bvh_stats& operator+=(bvh_stats& a, const bvh_stats& b) {
+  a.rays += b.rays;
+  a.nodes += b.nodes;
+  a.primitives += b.primitives;
+  a.instances += b.instances;
+  return a;
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR BVH INTERSECTION
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Intersect ray with a bvh.
+// Hits of the lanes of a bvh packet
+struct bvh_packet_hits {
+  array<int, 4>   hit      = {};
+  array<float, 4> u        = {};
+  array<float, 4> v        = {};
+  array<float, 4> distance = {};
+};
+
+// Intersect ray with the triangles of a packet, with the same test as
+// intersect_triangle() evaluated on all lanes without branches, so that it
+// is vectorized. Unused lanes have null edges and are never hit.
+static void intersect_packet(
+    const bvh_packet& packet, const ray3f& ray, bvh_packet_hits& hits) {
+  for (auto lane = 0; lane < 4; lane++) {
+    // compute determinant to solve a linear system
+    auto pvec_x = ray.d.y * packet.e2z[lane] - ray.d.z * packet.e2y[lane];
+    auto pvec_y = ray.d.z * packet.e2x[lane] - ray.d.x * packet.e2z[lane];
+    auto pvec_z = ray.d.x * packet.e2y[lane] - ray.d.y * packet.e2x[lane];
+    auto det    = packet.e1x[lane] * pvec_x + packet.e1y[lane] * pvec_y +
+               packet.e1z[lane] * pvec_z;
+    auto inv_det = 1.0f / det;
+
+    // compute barycentric coordinates and ray parameter
+    auto tvec_x = ray.o.x - packet.px[lane];
+    auto tvec_y = ray.o.y - packet.py[lane];
+    auto tvec_z = ray.o.z - packet.pz[lane];
+    auto u = (tvec_x * pvec_x + tvec_y * pvec_y + tvec_z * pvec_z) * inv_det;
+    auto qvec_x = tvec_y * packet.e1z[lane] - tvec_z * packet.e1y[lane];
+    auto qvec_y = tvec_z * packet.e1x[lane] - tvec_x * packet.e1z[lane];
+    auto qvec_z = tvec_x * packet.e1y[lane] - tvec_y * packet.e1x[lane];
+    auto v = (ray.d.x * qvec_x + ray.d.y * qvec_y + ray.d.z * qvec_z) *
+             inv_det;
+    auto t = (packet.e2x[lane] * qvec_x + packet.e2y[lane] * qvec_y +
+                 packet.e2z[lane] * qvec_z) *
+             inv_det;
+
+    // check all conditions at once
+    hits.hit[lane]      = (det != 0) & !(u < 0) & !(u > 1) & !(v < 0) &
+                     !(u + v > 1) & !(t < ray.tmin) & !(t > ray.tmax);
+    hits.u[lane]        = u;
+    hits.v[lane]        = v;
+    hits.distance[lane] = t;
+  }
+}
+
+// Check a candidate hit with the filter of the query, if any.
+static bool filter_hit(const bvh_filter& filter, int instance, int group,
+    int element, const vec2f& uv, float distance) {
+  if (!filter) return true;
+  return filter({instance, element, uv, distance, true, group});
+}
+
+// Intersect ray with a bvh. Candidate hits are filtered as hits of the
+// given instance and group.
 static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
     const ray3f& ray_, int& element, vec2f& uv, float& distance,
-    bool find_any) {
+    bool find_any, const bvh_filter& filter, int instance, int group) {
 #ifdef YOCTO_EMBREE
-  // call Embree if needed
+  // call Embree if needed, restarting the ray behind skipped hits
   if (bvh.embree_bvh) {
-    return intersect_embree_bvh(
-        bvh, shape, ray_, element, uv, distance, find_any);
+    auto ray       = ray_;
+    auto element_  = 0;
+    auto uv_       = vec2f{0, 0};
+    auto distance_ = 0.0f;
+    while (intersect_embree_bvh(
+        bvh, shape, ray, element_, uv_, distance_, find_any)) {
+      if (filter_hit(filter, instance, group, element_, uv_, distance_)) {
+        element  = element_;
+        uv       = uv_;
+        distance = distance_;
+        return true;
+      }
+      ray.tmin = std::nextafter(distance_, flt_max);
+    }
+    return false;
   }
 #endif
 
@@ -726,10 +1525,14 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
       (ray_dinv.z < 0) ? 1 : 0};
 
+  // statistics
+  auto num_nodes = (uint64_t)0, num_primitives = (uint64_t)0;
+
   // walking stack
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    num_nodes += 1;
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -737,6 +1540,7 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
 
     // intersect node, switching based on node type
     // for each type, iterate over the the primitive list
+    if (!node.internal) num_primitives += node.num;
     if (node.internal) {
       // for internal nodes, attempts to proceed along the
       // split axis from smallest to largest nodes
@@ -747,64 +1551,267 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
+    } else if (!bvh.packets.empty()) {
+      // test all leaf triangles, then take the hits in the same order as
+      // the loops over elements, and quads as in intersect_quad()
+      auto halves = shape.quads.empty() ? 1 : 2;
+      auto packet = node.start / bvh_packet_size * halves;
+      auto hits   = array<bvh_packet_hits, 2>{};
+      for (auto half = 0; half < halves; half++) {
+        intersect_packet(bvh.packets[packet + half], ray, hits[half]);
+      }
+      for (auto lane = 0; lane < node.num; lane++) {
+        for (auto half = 0; half < halves; half++) {
+          auto& lhits = hits[half];
+          if (!lhits.hit[lane] || lhits.distance[lane] > ray.tmax) continue;
+          auto lelement = bvh.packets[packet].elements[lane];
+          auto luv      = half == 0
+                              ? vec2f{lhits.u[lane], lhits.v[lane]}
+                              : vec2f{1 - lhits.u[lane], 1 - lhits.v[lane]};
+          if (!filter_hit(filter, instance, group, lelement, luv,
+                  lhits.distance[lane]))
+            continue;
+          hit      = true;
+          element  = lelement;
+          uv       = luv;
+          distance = lhits.distance[lane];
+          ray.tmax = distance;
+        }
+      }
     } else if (!shape.points.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape.points[bvh.primitives[idx]];
+        auto& p    = shape.points[bvh.primitives[idx]];
+        auto  puv  = vec2f{0, 0};
+        auto  pdst = 0.0f;
         if (intersect_point(
-                ray, shape.positions[p], shape.radius[p], uv, distance)) {
+                ray, get_position(shape, p), shape.radius[p], puv, pdst) &&
+            filter_hit(
+                filter, instance, group, bvh.primitives[idx], puv, pdst)) {
           hit      = true;
           element  = bvh.primitives[idx];
+          uv       = puv;
+          distance = pdst;
           ray.tmax = distance;
         }
       }
     } else if (!shape.lines.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape.lines[bvh.primitives[idx]];
-        if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
-                shape.radius[l.x], shape.radius[l.y], uv, distance)) {
+        auto& l    = shape.lines[bvh.primitives[idx]];
+        auto  luv  = vec2f{0, 0};
+        auto  ldst = 0.0f;
+        if (intersect_line(ray, get_position(shape, l.x),
+                get_position(shape, l.y), shape.radius[l.x], shape.radius[l.y],
+                luv, ldst) &&
+            filter_hit(
+                filter, instance, group, bvh.primitives[idx], luv, ldst)) {
           hit      = true;
           element  = bvh.primitives[idx];
+          uv       = luv;
+          distance = ldst;
           ray.tmax = distance;
         }
       }
     } else if (!shape.triangles.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape.triangles[bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
-                shape.positions[t.z], uv, distance)) {
+        auto& t    = shape.triangles[bvh.primitives[idx]];
+        auto  tuv  = vec2f{0, 0};
+        auto  tdst = 0.0f;
+        if (intersect_triangle(ray, get_position(shape, t.x),
+                get_position(shape, t.y), get_position(shape, t.z), tuv,
+                tdst) &&
+            filter_hit(
+                filter, instance, group, bvh.primitives[idx], tuv, tdst)) {
           hit      = true;
           element  = bvh.primitives[idx];
+          uv       = tuv;
+          distance = tdst;
           ray.tmax = distance;
         }
       }
     } else if (!shape.quads.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape.quads[bvh.primitives[idx]];
-        if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
-                shape.positions[q.z], shape.positions[q.w], uv, distance)) {
+        auto& q    = shape.quads[bvh.primitives[idx]];
+        auto  quv  = vec2f{0, 0};
+        auto  qdst = 0.0f;
+        if (intersect_quad(ray, get_position(shape, q.x),
+                get_position(shape, q.y), get_position(shape, q.z),
+                get_position(shape, q.w), quv, qdst) &&
+            filter_hit(
+                filter, instance, group, bvh.primitives[idx], quv, qdst)) {
           hit      = true;
           element  = bvh.primitives[idx];
+          uv       = quv;
+          distance = qdst;
           ray.tmax = distance;
         }
       }
     }
 
     // check for early exit
-    if (find_any && hit) return hit;
+    if (find_any && hit) break;
+  }
+
+  // update statistics
+  update_bvh_stats(0, num_nodes, num_primitives, 0);
+
+  return hit;
+}
+
+// Get the bvh of a shape, building it the first time if built on demand.
+// The build writes the shape bvh, that other queries read only after their
+// own call_once() returns, so that they see it completed.
+static const bvh_data& get_shape_bvh(
+    const bvh_data& bvh, const scene_data& scene, int shape) {
+  if (!bvh.lazy) return bvh.shapes[shape];
+  std::call_once(bvh.lazy->built[shape], [&bvh, &scene, shape]() {
+    auto& sbvh = const_cast<bvh_data&>(bvh.shapes[shape]);
+    if (sbvh.nodes.empty()) sbvh = bvh.lazy->build(scene.shapes[shape]);
+  });
+  return bvh.shapes[shape];
+}
+
+// Intersect ray with the bvh of a placed instance group, descending into
+// nested groups. On hits, sets the instance id within its group and the
+// instance frame composed with the group placements.
+static bool intersect_group_bvh(const bvh_data& bvh, const scene_data& scene,
+    const group_instance_data& placement, const ray3f& ray_, int& instance,
+    int& group, frame3f& frame, int& element, vec2f& uv, float& distance,
+    bool find_any, bool non_rigid_frames, const bvh_filter& filter) {
+  // check empty
+  auto& gbvh   = bvh.groups[placement.group];
+  auto& group_ = scene.instance_groups[placement.group];
+  if (gbvh.nodes.empty()) return false;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // transform ray to the group space
+  auto ray = transform_ray(inverse(placement.frame, non_rigid_frames), ray_);
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // statistics
+  auto num_nodes = (uint64_t)0, num_instances = (uint64_t)0;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = gbvh.nodes[node_stack[--node_cur]];
+    num_nodes += 1;
+
+    // intersect bbox
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      num_instances += node.num;
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto primitive = gbvh.primitives[idx];
+        if (primitive >= (int)group_.instances.size()) {
+          auto& nested = group_.groups[primitive - group_.instances.size()];
+          if (intersect_group_bvh(bvh, scene, nested, ray, instance, group,
+                  frame, element, uv, distance, find_any, non_rigid_frames,
+                  filter)) {
+            hit      = true;
+            ray.tmax = distance;
+          }
+          continue;
+        }
+        auto& instance_ = group_.instances[primitive];
+        auto  inv_ray   = transform_ray(
+            inverse(instance_.frame, non_rigid_frames), ray);
+        if (intersect_bvh(get_shape_bvh(bvh, scene, instance_.shape),
+                scene.shapes[instance_.shape], inv_ray, element, uv, distance,
+                find_any, filter, primitive, placement.group)) {
+          hit      = true;
+          instance = primitive;
+          group    = placement.group;
+          frame    = instance_.frame;
+          ray.tmax = distance;
+        }
+      }
+    }
+
+    // check for early exit
+    if (find_any && hit) break;
   }
 
+  // update statistics
+  update_bvh_stats(0, num_nodes, 0, num_instances);
+
+  // compose the frame of the hit with the placement
+  if (hit) frame = placement.frame * frame;
   return hit;
 }
 
+// Intersect ray with a shape element.
+static bool intersect_element(const shape_data& shape, int element,
+    const ray3f& ray, vec2f& uv, float& distance) {
+  if (!shape.points.empty()) {
+    auto& p = shape.points[element];
+    return intersect_point(
+        ray, get_position(shape, p), shape.radius[p], uv, distance);
+  } else if (!shape.lines.empty()) {
+    auto& l = shape.lines[element];
+    return intersect_line(ray, get_position(shape, l.x),
+        get_position(shape, l.y), shape.radius[l.x], shape.radius[l.y], uv,
+        distance);
+  } else if (!shape.triangles.empty()) {
+    auto& t = shape.triangles[element];
+    return intersect_triangle(ray, get_position(shape, t.x),
+        get_position(shape, t.y), get_position(shape, t.z), uv, distance);
+  } else if (!shape.quads.empty()) {
+    auto& q = shape.quads[element];
+    return intersect_quad(ray, get_position(shape, q.x),
+        get_position(shape, q.y), get_position(shape, q.z),
+        get_position(shape, q.w), uv, distance);
+  } else {
+    return false;
+  }
+}
+
 // Intersect ray with a bvh.
 static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
-    const ray3f& ray_, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
+    const ray3f& ray_, int& instance, int& group, frame3f& frame, int& element,
+    vec2f& uv, float& distance, bool find_any, bool non_rigid_frames,
+    const bvh_filter& filter) {
 #ifdef YOCTO_EMBREE
-  // call Embree if needed
+  // call Embree if needed, restarting the ray behind skipped hits
   if (bvh.embree_bvh) {
-    return intersect_embree_bvh(
-        bvh, scene, ray_, instance, element, uv, distance, find_any);
+    auto ray       = ray_;
+    auto instance_ = 0, element_ = 0;
+    auto uv_       = vec2f{0, 0};
+    auto distance_ = 0.0f;
+    while (intersect_embree_bvh(bvh, scene, ray, instance_, element_, uv_,
+        distance_, find_any)) {
+      if (filter_hit(filter, instance_, -1, element_, uv_, distance_)) {
+        instance = instance_;
+        element  = element_;
+        uv       = uv_;
+        distance = distance_;
+        return true;
+      }
+      ray.tmin = std::nextafter(distance_, flt_max);
+    }
+    return false;
   }
 #endif
 
@@ -827,10 +1834,21 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
       (ray_dinv.z < 0) ? 1 : 0};
 
+  // statistics
+  auto num_nodes = (uint64_t)0, num_primitives = (uint64_t)0,
+       num_instances = (uint64_t)0;
+
+  // primitives after the instances are instance group placements, followed
+  // by the elements of flattened instances
+  auto num_scene_instances = yocto::num_instances(scene);
+  auto num_scene_groups    = num_scene_instances +
+                          (int)scene.group_instances.size();
+
   // walking stack
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    num_nodes += 1;
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -850,34 +1868,71 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
       }
     } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& instance_ = scene.instances[bvh.primitives[idx]];
-        auto  inv_ray   = transform_ray(
+        if (bvh.primitives[idx] >= num_scene_groups) {
+          num_primitives += 1;
+          auto [instance_, element_] =
+              bvh.elements[bvh.primitives[idx] - num_scene_groups];
+          auto euv  = vec2f{0, 0};
+          auto edst = 0.0f;
+          if (intersect_element(scene.shapes[scene.instances[instance_].shape],
+                  element_, ray, euv, edst) &&
+              filter_hit(filter, instance_, -1, element_, euv, edst)) {
+            hit      = true;
+            instance = instance_;
+            group    = -1;
+            element  = element_;
+            uv       = euv;
+            distance = edst;
+            ray.tmax = distance;
+          }
+          continue;
+        }
+        num_instances += 1;
+        if (bvh.primitives[idx] >= num_scene_instances) {
+          auto& placement =
+              scene.group_instances[bvh.primitives[idx] - num_scene_instances];
+          if (intersect_group_bvh(bvh, scene, placement, ray, instance, group,
+                  frame, element, uv, distance, find_any, non_rigid_frames,
+                  filter)) {
+            hit      = true;
+            ray.tmax = distance;
+          }
+          continue;
+        }
+        auto instance_ = get_instance(scene, bvh.primitives[idx]);
+        auto inv_ray   = transform_ray(
             inverse(instance_.frame, non_rigid_frames), ray);
-        if (intersect_bvh(bvh.shapes[instance_.shape],
+        if (intersect_bvh(get_shape_bvh(bvh, scene, instance_.shape),
                 scene.shapes[instance_.shape], inv_ray, element, uv, distance,
-                find_any)) {
+                find_any, filter, bvh.primitives[idx], -1)) {
           hit      = true;
           instance = bvh.primitives[idx];
+          group    = -1;
           ray.tmax = distance;
         }
       }
     }
 
     // check for early exit
-    if (find_any && hit) return hit;
+    if (find_any && hit) break;
   }
 
+  // update statistics
+  update_bvh_stats(0, num_nodes, num_primitives, num_instances);
+
   return hit;
 }
 
 // Intersect ray with a bvh.
 static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance_, const ray3f& ray, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
-  auto& instance = scene.instances[instance_];
-  auto  inv_ray = transform_ray(inverse(instance.frame, non_rigid_frames), ray);
-  return intersect_bvh(bvh.shapes[instance.shape], scene.shapes[instance.shape],
-      inv_ray, element, uv, distance, find_any);
+    bool find_any, bool non_rigid_frames, const bvh_filter& filter) {
+  auto instance = get_instance(scene, instance_);
+  auto inv_ray  = transform_ray(inverse(instance.frame, non_rigid_frames), ray);
+  update_bvh_stats(0, 0, 0, 1);
+  return intersect_bvh(get_shape_bvh(bvh, scene, instance.shape),
+      scene.shapes[instance.shape], inv_ray, element, uv, distance, find_any,
+      filter, instance_, -1);
 }
 
 }  // namespace yocto
@@ -920,7 +1975,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& p         = shape.points[primitive];
-        if (overlap_point(pos, max_distance, shape.positions[p],
+        if (overlap_point(pos, max_distance, get_position(shape, p),
                 shape.radius[p], uv, distance)) {
           hit          = true;
           element      = primitive;
@@ -931,9 +1986,9 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& l         = shape.lines[primitive];
-        if (overlap_line(pos, max_distance, shape.positions[l.x],
-                shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
-                distance)) {
+        if (overlap_line(pos, max_distance, get_position(shape, l.x),
+                get_position(shape, l.y), shape.radius[l.x], shape.radius[l.y],
+                uv, distance)) {
           hit          = true;
           element      = primitive;
           max_distance = distance;
@@ -943,9 +1998,10 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& t         = shape.triangles[primitive];
-        if (overlap_triangle(pos, max_distance, shape.positions[t.x],
-                shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
-                shape.radius[t.y], shape.radius[t.z], uv, distance)) {
+        if (overlap_triangle(pos, max_distance, get_position(shape, t.x),
+                get_position(shape, t.y), get_position(shape, t.z),
+                shape.radius[t.x], shape.radius[t.y], shape.radius[t.z], uv,
+                distance)) {
           hit          = true;
           element      = primitive;
           max_distance = distance;
@@ -955,9 +2011,9 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& q         = shape.quads[primitive];
-        if (overlap_quad(pos, max_distance, shape.positions[q.x],
-                shape.positions[q.y], shape.positions[q.z],
-                shape.positions[q.w], shape.radius[q.x], shape.radius[q.y],
+        if (overlap_quad(pos, max_distance, get_position(shape, q.x),
+                get_position(shape, q.y), get_position(shape, q.z),
+                get_position(shape, q.w), shape.radius[q.x], shape.radius[q.y],
                 shape.radius[q.z], shape.radius[q.w], uv, distance)) {
           hit          = true;
           element      = primitive;
@@ -973,6 +2029,34 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
   return hit;
 }
 
+// Find the overlap of a point with a shape element.
+static bool overlap_element(const shape_data& shape, int element,
+    const vec3f& pos, float max_distance, vec2f& uv, float& distance) {
+  if (!shape.points.empty()) {
+    auto& p = shape.points[element];
+    return overlap_point(pos, max_distance, get_position(shape, p),
+        shape.radius[p], uv, distance);
+  } else if (!shape.lines.empty()) {
+    auto& l = shape.lines[element];
+    return overlap_line(pos, max_distance, get_position(shape, l.x),
+        get_position(shape, l.y), shape.radius[l.x], shape.radius[l.y], uv,
+        distance);
+  } else if (!shape.triangles.empty()) {
+    auto& t = shape.triangles[element];
+    return overlap_triangle(pos, max_distance, get_position(shape, t.x),
+        get_position(shape, t.y), get_position(shape, t.z), shape.radius[t.x],
+        shape.radius[t.y], shape.radius[t.z], uv, distance);
+  } else if (!shape.quads.empty()) {
+    auto& q = shape.quads[element];
+    return overlap_quad(pos, max_distance, get_position(shape, q.x),
+        get_position(shape, q.y), get_position(shape, q.z),
+        get_position(shape, q.w), shape.radius[q.x], shape.radius[q.y],
+        shape.radius[q.z], shape.radius[q.w], uv, distance);
+  } else {
+    return false;
+  }
+}
+
 // Intersect ray with a bvh.
 static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, int& instance, int& element,
@@ -980,6 +2064,12 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
   // check if empty
   if (bvh.nodes.empty()) return false;
 
+  // primitives after the instances are instance group placements, that
+  // overlap queries skip, followed by the elements of flattened instances
+  auto num_scene_instances = num_instances(scene);
+  auto num_scene_groups    = num_scene_instances +
+                          (int)scene.group_instances.size();
+
   // node stack
   auto node_stack        = array<int, 64>{};
   auto node_cur          = 0;
@@ -1004,10 +2094,23 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
       node_stack[node_cur++] = node.start + 1;
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& instance_ = scene.instances[primitive];
+        auto primitive = bvh.primitives[node.start + idx];
+        if (primitive >= num_scene_groups) {
+          auto [instance_, element_] =
+              bvh.elements[primitive - num_scene_groups];
+          if (overlap_element(scene.shapes[scene.instances[instance_].shape],
+                  element_, pos, max_distance, uv, distance)) {
+            hit          = true;
+            instance     = instance_;
+            element      = element_;
+            max_distance = distance;
+          }
+          continue;
+        }
+        if (primitive >= num_scene_instances) continue;
+        auto  instance_ = get_instance(scene, primitive);
         auto& shape     = scene.shapes[instance_.shape];
-        auto& sbvh      = bvh.shapes[instance_.shape];
+        auto& sbvh      = get_shape_bvh(bvh, scene, instance_.shape);
         auto  inv_pos   = transform_point(
             inverse(instance_.frame, non_rigid_frames), pos);
         if (overlap_bvh(sbvh, shape, inv_pos, max_distance, element, uv,
@@ -1026,6 +2129,67 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
   return hit;
 }
 
+// Check that the bounds of an instance overlap none of the other scene bvh
+// primitives, or of the elements of other flattened instances.
+bool is_isolated_instance(
+    const bvh_data& bvh, const scene_data& scene, int instance) {
+  // embree bvhs do not expose their nodes, so we assume an overlap
+  if (bvh.nodes.empty()) return false;
+
+  // instance bounds
+  auto instance_ = get_instance(scene, instance);
+  auto bbox      = instance_bounds(bvh, instance_.frame, instance_.shape);
+  if (bbox.min.x > bbox.max.x) return true;
+
+  // primitives after the instances are instance group placements, followed
+  // by the elements of flattened instances
+  auto num_scene_instances = num_instances(scene);
+  auto num_scene_groups    = num_scene_instances +
+                          (int)scene.group_instances.size();
+
+  // node stack
+  auto node_stack        = array<int, 64>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    if (!overlap_bbox(bbox, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      node_stack[node_cur++] = node.start + 0;
+      node_stack[node_cur++] = node.start + 1;
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        auto primitive = bvh.primitives[node.start + idx];
+        if (primitive == instance) continue;
+        auto pbbox = invalidb3f;
+        if (primitive >= num_scene_groups) {
+          auto [owner, element] = bvh.elements[primitive - num_scene_groups];
+          if (owner == instance) continue;
+          pbbox = element_bounds(
+              scene.shapes[scene.instances[owner].shape], element);
+        } else if (primitive >= num_scene_instances) {
+          auto& placement =
+              scene.group_instances[primitive - num_scene_instances];
+          pbbox = group_bounds(bvh, placement.frame, placement.group);
+        } else {
+          auto other = get_instance(scene, primitive);
+          pbbox      = instance_bounds(bvh, other.frame, other.shape);
+        }
+        if (overlap_bbox(bbox, pbbox)) return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 #if 0
 // Finds the overlap between BVH leaf nodes.
 template <typename OverlapElem>
@@ -1088,30 +2252,51 @@ void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
 #endif
 
 bvh_intersection intersect_bvh(const bvh_data& bvh, const shape_data& shape,
-    const ray3f& ray, bool find_any) {
+    const ray3f& ray, bool find_any, const bvh_filter& filter) {
+  update_bvh_stats(1, 0, 0, 0);
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(bvh, shape, ray, intersection.element,
-      intersection.uv, intersection.distance, find_any);
+      intersection.uv, intersection.distance, find_any, filter, -1, -1);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
-    const ray3f& ray, bool find_any, bool non_rigid_frames) {
+    const ray3f& ray, bool find_any, bool non_rigid_frames,
+    const bvh_filter& filter) {
+  update_bvh_stats(1, 0, 0, 0);
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(bvh, scene, ray, intersection.instance,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      intersection.group, intersection.frame, intersection.element,
+      intersection.uv, intersection.distance, find_any, non_rigid_frames,
+      filter);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
-    int instance, const ray3f& ray, bool find_any, bool non_rigid_frames) {
+    int instance, const ray3f& ray, bool find_any, bool non_rigid_frames,
+    const bvh_filter& filter) {
+  update_bvh_stats(1, 0, 0, 0);
   auto intersection     = bvh_intersection{};
   intersection.hit      = intersect_bvh(bvh, scene, instance, ray,
       intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      non_rigid_frames, filter);
   intersection.instance = instance;
   return intersection;
 }
 
+// Get the instance of an intersection
+instance_data get_instance(
+    const scene_data& scene, const bvh_intersection& intersection) {
+  if (intersection.group < 0) return get_instance(scene, intersection.instance);
+  auto instance = scene.instance_groups[intersection.group]
+                      .instances[intersection.instance];
+  instance.frame = intersection.frame;
+  return instance;
+}
+vec4f get_instance_color(
+    const scene_data& scene, const bvh_intersection& intersection) {
+  if (intersection.group >= 0) return {1, 1, 1, 1};
+  return get_instance_color(scene, intersection.instance);
+}
+
 bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any,
     bool non_rigid_frames) {
@@ -40,7 +40,10 @@
 
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <vector>
 
@@ -55,6 +58,7 @@ namespace yocto {
 
 // using directives
 using std::array;
+using std::function;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -78,26 +82,119 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Allocator for BVH nodes that aligns them to cache lines. Nodes are laid
+// out so that siblings share a cache line, and are fetched together.
+template <typename T>
+struct bvh_allocator {
+  using value_type = T;
+  static const size_t alignment = 64;
+
+  bvh_allocator() = default;
+  template <typename U>
+  bvh_allocator(const bvh_allocator<U>&) {}
+
+  T* allocate(size_t size) {
+    return (T*)::operator new(size * sizeof(T), std::align_val_t{alignment});
+  }
+  void deallocate(T* ptr, size_t) {
+    ::operator delete(ptr, std::align_val_t{alignment});
+  }
+
+  template <typename U>
+  bool operator==(const bvh_allocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const bvh_allocator<U>&) const {
+    return false;
+  }
+};
+
+// Vector of cache aligned BVH data.
+template <typename T>
+using bvh_vector = vector<T, bvh_allocator<T>>;
+
+// Triangles of a BVH leaf stored as a packet of four lanes, in structure of
+// arrays layout, so that the whole leaf is intersected at once. Lanes store
+// the first vertex and the two edges of a triangle, and the element id, that
+// is -1 for unused lanes. Quad leaves use two packets, one for each of the
+// triangles of the quads.
+struct bvh_packet {
+  array<float, 4> px       = {};  // first vertex
+  array<float, 4> py       = {};
+  array<float, 4> pz       = {};
+  array<float, 4> e1x      = {};  // first edge
+  array<float, 4> e1y      = {};
+  array<float, 4> e1z      = {};
+  array<float, 4> e2x      = {};  // second edge
+  array<float, 4> e2y      = {};
+  array<float, 4> e2z      = {};
+  array<int, 4>   elements = {-1, -1, -1, -1};
+};
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// For instance BVHs, we also store the BVH of the contained shapes.
+// For instance BVHs, we also store the BVH of the contained shapes and
+// of the instance groups, so that the scene BVH has as many levels as the
+// group nesting. Flattened instances have their elements, as pairs of
+// instance and element ids, stored directly in the scene BVH. Shape BVHs of
+// triangles and quads also store the leaf packets, and pad the primitives so
+// that leaves start at multiples of four, to find their packets.
+// Shape BVHs may be built on demand, as described in bvh_lazy_shapes.
 // Application data is not stored explicitly.
 // Additionally, we support the use of Intel Embree.
+struct bvh_lazy_shapes;
 struct bvh_data {
-  vector<bvh_node>                  nodes      = {};
+  bvh_vector<bvh_node>              nodes      = {};
   vector<int>                       primitives = {};
+  bvh_vector<bvh_packet>            packets    = {};                  // leaves
   vector<bvh_data>                  shapes     = {};                  // shapes
+  vector<bvh_data>                  groups     = {};                  // groups
+  vector<vec2i>                     elements   = {};                  // flat
+  unique_ptr<bvh_lazy_shapes>       lazy       = {};                  // lazy
   unique_ptr<void, void (*)(void*)> embree_bvh = {nullptr, nullptr};  // embree
 };
 
-// Build the bvh acceleration structure.
+// Shape BVHs built on demand, each the first time a scene query reaches one
+// of the instances of its shape. Each shape has its own flag, so that
+// concurrent queries wait only for the shapes they need. Shape bounds are
+// computed up front, to build the scene BVH.
+struct bvh_lazy_shapes {
+  function<bvh_data(const shape_data&)> build  = {};
+  vector<bbox3f>                        bounds = {};
+  vector<std::once_flag>                built  = {};
+};
+
+// Build the bvh acceleration structure. With `flatten`, the instances that
+// are the only use of their shape and have an identity frame, as in scenes
+// converted from OBJ or PLY, are flattened: their elements are placed in the
+// scene bvh, so that rays hit them without a second bvh descent or a ray
+// transform. Flattening is not supported by Embree.
 bvh_data make_bvh(
     const shape_data& shape, bool highquality = false, bool embree = false);
 bvh_data make_bvh(const scene_data& scene, bool highquality = false,
-    bool embree = false, bool noparallel = false);
+    bool embree = false, bool noparallel = false, bool flatten = false);
 
-// Refit bvh data
+// Build a shape bvh with spatial splits (SBVH). Triangles and quads that
+// straddle a split plane are clipped and referenced by both children when
+// this lowers the SAH cost, which helps meshes with long thin elements whose
+// bounds overlap. Duplicated references are limited to `budget` times the
+// number of elements. Other shapes get a high quality bvh. Spatial bvhs can
+// be chosen per shape by building them before complete_bvh().
+bvh_data make_sbvh(const shape_data& shape, float budget = 0.5f);
+
+// Build the bvh of the scene shapes that do not have one yet, then the bvh
+// of the instance groups and of the scene instances. Lets shape bvhs be built
+// as soon as shapes are ready. With a `lazy` builder, the missing shape bvhs
+// are instead built on demand by it, so that shapes that are never reached
+// are never built. Lazy builds are not supported by Embree.
+void complete_bvh(bvh_data& bvh, const scene_data& scene,
+    bool highquality = false, bool noparallel = false, bool flatten = false,
+    const function<bvh_data(const shape_data&)>& lazy = {});
+
+// Refit bvh data. Updating flattened instances rebuilds the scene bvh, since
+// their frames may not be the identity anymore.
 void update_bvh(bvh_data& bvh, const shape_data& shape);
 void update_bvh(bvh_data& bvh, const scene_data& scene,
     const vector<int>& updated_instances, const vector<int>& updated_shapes);
@@ -107,24 +204,64 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
 // The values are all set for scene intersection. Shape intersection does not
 // set the instance id and element intersections do not set shape element id
 // and the instance id. Results values are set only if hit is true.
+// For hits inside instance groups, the instance id refers to the instances
+// of `group`, and `frame` is the instance frame composed with the frames of
+// the group placements. Use get_instance() to handle both cases.
 struct bvh_intersection {
-  int   instance = -1;
-  int   element  = -1;
-  vec2f uv       = {0, 0};
-  float distance = 0;
-  bool  hit      = false;
+  int     instance = -1;
+  int     element  = -1;
+  vec2f   uv       = {0, 0};
+  float   distance = 0;
+  bool    hit      = false;
+  int     group    = -1;
+  frame3f frame    = identity3x4f;
 };
 
+// Get the instance of an intersection, with its frame in world space also
+// for hits inside instance groups.
+instance_data get_instance(
+    const scene_data& scene, const bvh_intersection& intersection);
+// Get the instance color of an intersection, white inside instance groups.
+vec4f get_instance_color(
+    const scene_data& scene, const bvh_intersection& intersection);
+
+// Filter of the candidate hits of intersect_bvh(), that returns false to
+// skip a hit, for example on transparent surfaces. Skipped hits do not
+// shorten the ray, so the same traversal goes on behind them. Candidates set
+// all intersection values but the frame, and the same hit may be filtered
+// more than once, so filters should give the same answer for the same hit.
+using bvh_filter = function<bool(const bvh_intersection& candidate)>;
+
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
+// Instance groups are traversed by scene intersection only, not by the
+// single instance queries, that take instance ids, or by overlap queries.
+// If given, `filter` is called on candidate hits, also for any hit queries.
 bvh_intersection intersect_bvh(const bvh_data& bvh, const shape_data& shape,
-    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
+    const ray3f& ray, bool find_any = false, const bvh_filter& filter = {});
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
-    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
+    const ray3f& ray, bool find_any = false, bool non_rigid_frames = true,
+    const bvh_filter& filter = {});
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance, const ray3f& ray, bool find_any = false,
-    bool non_rigid_frames = true);
+    bool non_rigid_frames = true, const bvh_filter& filter = {});
+
+// BVH traversal statistics. Counters are kept per thread and are only
+// collected when compiling with YOCTO_STATS, otherwise they stay zero.
+struct bvh_stats {
+  uint64_t rays       = 0;  // ray queries
+  uint64_t nodes      = 0;  // nodes visited
+  uint64_t primitives = 0;  // primitive intersection tests
+  uint64_t instances  = 0;  // instance transforms and shape traversals
+};
+
+// Sum the statistics of all threads.
+bvh_stats get_bvh_stats();
+void      reset_bvh_stats();
+// Statistics of the calling thread, used to measure single queries.
+bvh_stats get_bvh_thread_stats();
+bvh_stats& operator+=(bvh_stats& a, const bvh_stats& b);
 
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
@@ -136,6 +273,15 @@ bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any = false,
     bool non_rigid_frames = true);
 
+// Check that the bounds of an instance overlap none of the bounds of other
+// instances, instance group placements or elements of flattened instances.
+// If so, rays that start inside a closed instance leave it before hitting
+// anything else, so they can be intersected with the instance alone. The
+// query traverses the scene bvh, so callers should compute it once per
+// instance. Instances in Embree bvhs are never reported as isolated.
+bool is_isolated_instance(
+    const bvh_data& bvh, const scene_data& scene, int instance);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
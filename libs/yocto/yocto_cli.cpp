@@ -33,10 +33,13 @@
 #include "yocto_cli.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
 
 // -----------------------------------------------------------------------------
 // PRINT/FORMATTING UTILITIES
@@ -80,7 +83,10 @@ string format_duration(int64_t duration) {
 string format_num(uint64_t num) {
   auto rem = num % 1000;
   auto div = num / 1000;
-  if (div > 0) return format_num(div) + "," + std::to_string(rem);
+  if (div > 0) {
+    auto digits = std::to_string(rem);
+    return format_num(div) + "," + string(3 - digits.size(), '0') + digits;
+  }
   return std::to_string(rem);
 }
 
@@ -182,6 +188,138 @@ string elapsed_formatted(simple_timer& timer) {
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// TRACING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Recorded zone
+struct trace_event {
+  const char* name     = nullptr;
+  string      detail   = "";
+  int64_t     start    = 0;
+  int64_t     duration = 0;
+};
+
+// Ring buffer of the zones of a thread. Buffers are handed back when their
+// thread exits and reused by new threads, so that the short-lived workers of
+// `parallel_for` share a few timeline rows.
+struct trace_buffer {
+  int                 thread = 0;
+  size_t              count  = 0;
+  vector<trace_event> events = {};
+};
+
+static std::atomic<bool>                     trace_enabled  = false;
+static size_t                                trace_capacity = 1 << 16;
+static int64_t                               trace_start    = 0;
+static std::mutex                            trace_mutex;
+static vector<std::unique_ptr<trace_buffer>> trace_buffers  = {};
+static vector<trace_buffer*>                 trace_free     = {};
+
+// Buffer of the calling thread
+static trace_buffer* get_trace_buffer() {
+  struct trace_holder {
+    trace_buffer* buffer = nullptr;
+    ~trace_holder() {
+      if (!buffer) return;
+      auto lock = std::lock_guard{trace_mutex};
+      trace_free.push_back(buffer);
+    }
+  };
+  thread_local auto holder = trace_holder{};
+  if (!holder.buffer) {
+    auto lock = std::lock_guard{trace_mutex};
+    if (!trace_free.empty()) {
+      auto first = std::min_element(trace_free.begin(), trace_free.end(),
+          [](auto a, auto b) { return a->thread < b->thread; });
+      holder.buffer = *first;
+      trace_free.erase(first);
+    } else {
+      auto& buffer   = trace_buffers.emplace_back(new trace_buffer{});
+      buffer->thread = (int)trace_buffers.size() - 1;
+      holder.buffer  = buffer.get();
+    }
+  }
+  return holder.buffer;
+}
+
+// Start and stop tracing
+void start_tracing(size_t capacity) {
+  auto lock      = std::lock_guard{trace_mutex};
+  trace_capacity = std::max(capacity, (size_t)1);
+  trace_start    = get_time_();
+  for (auto& buffer : trace_buffers) {
+    buffer->count = 0;
+    buffer->events.clear();
+  }
+  trace_enabled = true;
+}
+void stop_tracing() { trace_enabled = false; }
+bool is_tracing() { return trace_enabled.load(std::memory_order_relaxed); }
+
+// Scoped zones
+trace_zone::trace_zone(const char* name_) : name{name_} {
+  if (!is_tracing()) return;
+  start = get_time_();
+}
+trace_zone::trace_zone(const char* name_, const string& detail_)
+    : name{name_} {
+  if (!is_tracing()) return;
+  detail = detail_;
+  start  = get_time_();
+}
+trace_zone::~trace_zone() {
+  if (start < 0 || !is_tracing()) return;
+  auto  duration = get_time_() - start;
+  auto  buffer   = get_trace_buffer();
+  auto& event    = buffer->events.size() < trace_capacity
+                       ? buffer->events.emplace_back()
+                       : buffer->events[buffer->count % trace_capacity];
+  event.name     = name;
+  event.detail   = std::move(detail);
+  event.start    = start;
+  event.duration = duration;
+  buffer->count += 1;
+}
+
+// Save trace as Chrome trace json
+bool save_trace(const string& filename, string& error) {
+  auto lock   = std::lock_guard{trace_mutex};
+  auto json   = nlohmann::json::object();
+  auto events = nlohmann::json::array();
+  for (auto& buffer : trace_buffers) {
+    if (buffer->events.empty()) continue;
+    events.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", 0},
+        {"tid", buffer->thread},
+        {"args", {{"name", "thread " + std::to_string(buffer->thread)}}}});
+    for (auto& event : buffer->events) {
+      auto jevent = nlohmann::json{{"name", event.name}, {"cat", "yocto"},
+          {"ph", "X"}, {"pid", 0}, {"tid", buffer->thread},
+          {"ts", (event.start - trace_start) / 1000.0},
+          {"dur", event.duration / 1000.0}};
+      if (!event.detail.empty())
+        jevent["args"] = {{"detail", event.detail}};
+      events.push_back(jevent);
+    }
+  }
+  json["traceEvents"]     = events;
+  json["displayTimeUnit"] = "ms";
+  auto stream = std::ofstream(std::filesystem::u8path(filename));
+  if (!stream) {
+    error = filename + ": file not found";
+    return false;
+  }
+  stream << json.dump();
+  if (!stream) {
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION OF COMMAND-LINE PARSING
 // -----------------------------------------------------------------------------
@@ -122,6 +122,39 @@ string  elapsed_formatted(simple_timer& timer);
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// TRACING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Start and stop recording trace zones. Zones are kept in per-thread ring
+// buffers holding the last `capacity` zones of each thread, so recording
+// takes no lock once a thread has its buffer.
+void start_tracing(size_t capacity = 1 << 16);
+void stop_tracing();
+bool is_tracing();
+
+// Scoped trace zone, recorded when the scope ends. Names must outlive the
+// trace, i.e. they should be string literals. Details are copied only
+// when tracing.
+struct trace_zone {
+  const char* name   = nullptr;
+  string      detail = "";
+  int64_t     start  = -1;
+
+  trace_zone(const char* name);
+  trace_zone(const char* name, const string& detail);
+  trace_zone(const trace_zone&) = delete;
+  trace_zone& operator=(const trace_zone&) = delete;
+  ~trace_zone();
+};
+
+// Save the recorded zones as Chrome trace json, viewable in chrome://tracing
+// and Perfetto. Call only when no other thread is recording.
+bool save_trace(const string& filename, string& error);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // ERROR HANDLING VIA EXCEPTIONS
 // -----------------------------------------------------------------------------
@@ -37,6 +37,7 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <atomic>
 #include <deque>
 #include <future>
@@ -81,6 +82,27 @@ struct concurrent_queue {
   deque<T>   queue;
 };
 
+// Per-thread statistics. Each thread updates its own copy of `T` returned by
+// `local()` without synchronization, while `sum()` adds up the copies of all
+// threads, including the ones that already exited. `T` must support `+=`.
+// Sums and resets are exact only when no other thread is updating its copy.
+// Only one `thread_stats` per type `T` should exist.
+template <typename T>
+struct thread_stats {
+  thread_stats()                          = default;
+  thread_stats(const thread_stats& other) = delete;
+  thread_stats& operator=(const thread_stats& other) = delete;
+
+  T&   local();
+  T    sum();
+  void reset();
+
+ private:
+  std::mutex mutex;
+  vector<T*> threads = {};
+  T          retired = {};
+};
+
 // Run a task asynchronously
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args);
@@ -166,6 +188,43 @@ bool concurrent_queue<T>::try_pop(T& value) {
   return true;
 }
 
+// Per-thread statistics
+template <typename T>
+inline T& thread_stats<T>::local() {
+  // per-thread copy that folds itself into the retired stats at thread exit
+  struct local_stats {
+    thread_stats* owner = nullptr;
+    T             stats = {};
+    ~local_stats() {
+      if (owner == nullptr) return;
+      auto lock = std::lock_guard{owner->mutex};
+      owner->retired += stats;
+      owner->threads.erase(std::find(
+          owner->threads.begin(), owner->threads.end(), &stats));
+    }
+  };
+  static thread_local auto local = local_stats{};
+  if (local.owner == nullptr) {
+    auto lock   = std::lock_guard{mutex};
+    local.owner = this;
+    threads.push_back(&local.stats);
+  }
+  return local.stats;
+}
+template <typename T>
+inline T thread_stats<T>::sum() {
+  auto lock  = std::lock_guard{mutex};
+  auto total = retired;
+  for (auto stats : threads) total += *stats;
+  return total;
+}
+template <typename T>
+inline void thread_stats<T>::reset() {
+  auto lock = std::lock_guard{mutex};
+  retired   = {};
+  for (auto stats : threads) *stats = {};
+}
+
 // Run a task asynchronously
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args) {
@@ -275,27 +275,40 @@ bool has_volume(const material_point& material) {
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Update the first instance id of each instance array and the number of
+// instances
+void update_instance_arrays(scene_data& scene) {
+  scene.instance_array_starts.resize(scene.instance_arrays.size());
+  auto start = (int)scene.instances.size();
+  for (auto array = 0; array < (int)scene.instance_arrays.size(); array++) {
+    scene.instance_array_starts[array] = start;
+    start += (int)scene.instance_arrays[array].frames.size();
+  }
+  scene.instance_array_end = start;
+}
+
 // Eval position
 vec3f eval_position(const scene_data& scene, const instance_data& instance,
     int element, const vec2f& uv) {
   auto& shape = scene.shapes[instance.shape];
   if (!shape.triangles.empty()) {
     auto t = shape.triangles[element];
-    return transform_point(
-        instance.frame, interpolate_triangle(shape.positions[t.x],
-                            shape.positions[t.y], shape.positions[t.z], uv));
+    return transform_point(instance.frame,
+        interpolate_triangle(get_position(shape, t.x),
+            get_position(shape, t.y), get_position(shape, t.z), uv));
   } else if (!shape.quads.empty()) {
     auto q = shape.quads[element];
     return transform_point(instance.frame,
-        interpolate_quad(shape.positions[q.x], shape.positions[q.y],
-            shape.positions[q.z], shape.positions[q.w], uv));
+        interpolate_quad(get_position(shape, q.x), get_position(shape, q.y),
+            get_position(shape, q.z), get_position(shape, q.w), uv));
   } else if (!shape.lines.empty()) {
     auto l = shape.lines[element];
     return transform_point(instance.frame,
-        interpolate_line(shape.positions[l.x], shape.positions[l.y], uv.x));
+        interpolate_line(
+            get_position(shape, l.x), get_position(shape, l.y), uv.x));
   } else if (!shape.points.empty()) {
     return transform_point(
-        instance.frame, shape.positions[shape.points[element]]);
+        instance.frame, get_position(shape, shape.points[element]));
   } else {
     return {0, 0, 0};
   }
@@ -307,18 +320,18 @@ vec3f eval_element_normal(
   auto& shape = scene.shapes[instance.shape];
   if (!shape.triangles.empty()) {
     auto t = shape.triangles[element];
-    return transform_normal(
-        instance.frame, triangle_normal(shape.positions[t.x],
-                            shape.positions[t.y], shape.positions[t.z]));
+    return transform_normal(instance.frame,
+        triangle_normal(get_position(shape, t.x), get_position(shape, t.y),
+            get_position(shape, t.z)));
   } else if (!shape.quads.empty()) {
     auto q = shape.quads[element];
-    return transform_normal(
-        instance.frame, quad_normal(shape.positions[q.x], shape.positions[q.y],
-                            shape.positions[q.z], shape.positions[q.w]));
+    return transform_normal(instance.frame,
+        quad_normal(get_position(shape, q.x), get_position(shape, q.y),
+            get_position(shape, q.z), get_position(shape, q.w)));
   } else if (!shape.lines.empty()) {
     auto l = shape.lines[element];
     return transform_normal(instance.frame,
-        line_tangent(shape.positions[l.x], shape.positions[l.y]));
+        line_tangent(get_position(shape, l.x), get_position(shape, l.y)));
   } else if (!shape.points.empty()) {
     return {0, 0, 1};
   } else {
@@ -330,26 +343,26 @@ vec3f eval_element_normal(
 vec3f eval_normal(const scene_data& scene, const instance_data& instance,
     int element, const vec2f& uv) {
   auto& shape = scene.shapes[instance.shape];
-  if (shape.normals.empty())
-    return eval_element_normal(scene, instance, element);
+  if (!has_normals(shape)) return eval_element_normal(scene, instance, element);
   if (!shape.triangles.empty()) {
     auto t = shape.triangles[element];
-    return transform_normal(
-        instance.frame, normalize(interpolate_triangle(shape.normals[t.x],
-                            shape.normals[t.y], shape.normals[t.z], uv)));
+    return transform_normal(instance.frame,
+        normalize(interpolate_triangle(get_normal(shape, t.x),
+            get_normal(shape, t.y), get_normal(shape, t.z), uv)));
   } else if (!shape.quads.empty()) {
     auto q = shape.quads[element];
     return transform_normal(instance.frame,
-        normalize(interpolate_quad(shape.normals[q.x], shape.normals[q.y],
-            shape.normals[q.z], shape.normals[q.w], uv)));
+        normalize(interpolate_quad(get_normal(shape, q.x),
+            get_normal(shape, q.y), get_normal(shape, q.z),
+            get_normal(shape, q.w), uv)));
   } else if (!shape.lines.empty()) {
     auto l = shape.lines[element];
     return transform_normal(instance.frame,
-        normalize(
-            interpolate_line(shape.normals[l.x], shape.normals[l.y], uv.x)));
+        normalize(interpolate_line(
+            get_normal(shape, l.x), get_normal(shape, l.y), uv.x)));
   } else if (!shape.points.empty()) {
     return transform_normal(
-        instance.frame, normalize(shape.normals[shape.points[element]]));
+        instance.frame, normalize(get_normal(shape, shape.points[element])));
   } else {
     return {0, 0, 0};
   }
@@ -359,20 +372,21 @@ vec3f eval_normal(const scene_data& scene, const instance_data& instance,
 vec2f eval_texcoord(const scene_data& scene, const instance_data& instance,
     int element, const vec2f& uv) {
   auto& shape = scene.shapes[instance.shape];
-  if (shape.texcoords.empty()) return uv;
+  if (!has_texcoords(shape)) return uv;
   if (!shape.triangles.empty()) {
     auto t = shape.triangles[element];
-    return interpolate_triangle(
-        shape.texcoords[t.x], shape.texcoords[t.y], shape.texcoords[t.z], uv);
+    return interpolate_triangle(get_texcoord(shape, t.x),
+        get_texcoord(shape, t.y), get_texcoord(shape, t.z), uv);
   } else if (!shape.quads.empty()) {
     auto q = shape.quads[element];
-    return interpolate_quad(shape.texcoords[q.x], shape.texcoords[q.y],
-        shape.texcoords[q.z], shape.texcoords[q.w], uv);
+    return interpolate_quad(get_texcoord(shape, q.x), get_texcoord(shape, q.y),
+        get_texcoord(shape, q.z), get_texcoord(shape, q.w), uv);
   } else if (!shape.lines.empty()) {
     auto l = shape.lines[element];
-    return interpolate_line(shape.texcoords[l.x], shape.texcoords[l.y], uv.x);
+    return interpolate_line(
+        get_texcoord(shape, l.x), get_texcoord(shape, l.y), uv.x);
   } else if (!shape.points.empty()) {
-    return shape.texcoords[shape.points[element]];
+    return get_texcoord(shape, shape.points[element]);
   } else {
     return zero2f;
   }
@@ -414,19 +428,21 @@ static pair<vec3f, vec3f> eval_tangents(
 pair<vec3f, vec3f> eval_element_tangents(
     const scene_data& scene, const instance_data& instance, int element) {
   auto& shape = scene.shapes[instance.shape];
-  if (!shape.triangles.empty() && !shape.texcoords.empty()) {
+  if (!shape.triangles.empty() && has_texcoords(shape)) {
     auto t        = shape.triangles[element];
-    auto [tu, tv] = triangle_tangents_fromuv(shape.positions[t.x],
-        shape.positions[t.y], shape.positions[t.z], shape.texcoords[t.x],
-        shape.texcoords[t.y], shape.texcoords[t.z]);
+    auto [tu, tv] = triangle_tangents_fromuv(get_position(shape, t.x),
+        get_position(shape, t.y), get_position(shape, t.z),
+        get_texcoord(shape, t.x), get_texcoord(shape, t.y),
+        get_texcoord(shape, t.z));
     return {transform_direction(instance.frame, tu),
         transform_direction(instance.frame, tv)};
-  } else if (!shape.quads.empty() && !shape.texcoords.empty()) {
+  } else if (!shape.quads.empty() && has_texcoords(shape)) {
     auto q        = shape.quads[element];
-    auto [tu, tv] = quad_tangents_fromuv(shape.positions[q.x],
-        shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
-        shape.texcoords[q.x], shape.texcoords[q.y], shape.texcoords[q.z],
-        shape.texcoords[q.w], {0, 0});
+    auto [tu, tv] = quad_tangents_fromuv(get_position(shape, q.x),
+        get_position(shape, q.y), get_position(shape, q.z),
+        get_position(shape, q.w), get_texcoord(shape, q.x),
+        get_texcoord(shape, q.y), get_texcoord(shape, q.z),
+        get_texcoord(shape, q.w), {0, 0});
     return {transform_direction(instance.frame, tu),
         transform_direction(instance.frame, tv)};
   } else {
@@ -525,16 +541,13 @@ vec4f eval_color(const scene_data& scene, const instance_data& instance,
   }
 }
 
-// Evaluate material
-material_point eval_material(const scene_data& scene,
-    const instance_data& instance, int element, const vec2f& uv) {
-  auto& material = scene.materials[instance.material];
-  auto  texcoord = eval_texcoord(scene, instance, element, uv);
-
+// Evaluate material at a texcoord, modulated by the shape color
+static material_point eval_material_point(const scene_data& scene,
+    const material_data& material, const vec2f& texcoord,
+    const vec4f& color_shp) {
   // evaluate textures
   auto emission_tex = eval_texture(
       scene, material.emission_tex, texcoord, true);
-  auto color_shp     = eval_color(scene, instance, element, uv);
   auto color_tex     = eval_texture(scene, material.color_tex, texcoord, true);
   auto roughness_tex = eval_texture(
       scene, material.roughness_tex, texcoord, false);
@@ -578,6 +591,15 @@ material_point eval_material(const scene_data& scene,
   return point;
 }
 
+// Evaluate material
+material_point eval_material(const scene_data& scene,
+    const instance_data& instance, int element, const vec2f& uv) {
+  auto& material = scene.materials[instance.material];
+  auto  texcoord = eval_texcoord(scene, instance, element, uv);
+  auto  color    = eval_color(scene, instance, element, uv);
+  return eval_material_point(scene, material, texcoord, color);
+}
+
 material_point eval_material(const scene_data& scene, int mat) {
   auto& material = scene.materials[mat];
 
@@ -618,6 +640,109 @@ material_point eval_material(const scene_data& scene, int mat) {
   return point;
 }
 
+// Eval shading point
+shading_point eval_shading_point(const scene_data& scene,
+    const instance_data& instance, int element, const vec2f& uv,
+    const vec3f& outgoing) {
+  auto& shape    = scene.shapes[instance.shape];
+  auto& material = scene.materials[instance.material];
+  auto  point    = shading_point{};
+
+  // lines and points are rare, so they use the single property functions
+  if (shape.triangles.empty() && shape.quads.empty()) {
+    point.position = eval_shading_position(
+        scene, instance, element, uv, outgoing);
+    point.normal = eval_shading_normal(
+        scene, instance, element, uv, outgoing);
+    point.texcoord = eval_texcoord(scene, instance, element, uv);
+    point.color    = eval_color(scene, instance, element, uv);
+    point.material = eval_material(scene, instance, element, uv);
+    return point;
+  }
+
+  // element vertices, with triangles stored as degenerate quads
+  auto triangle = !shape.triangles.empty();
+  auto vertices = triangle ? vec4i{shape.triangles[element].x,
+                                 shape.triangles[element].y,
+                                 shape.triangles[element].z,
+                                 shape.triangles[element].z}
+                           : shape.quads[element];
+  auto interpolate = [&](const auto& values) {
+    return triangle ? interpolate_triangle(values[0], values[1], values[2], uv)
+                    : interpolate_quad(
+                          values[0], values[1], values[2], values[3], uv);
+  };
+
+  // position
+  auto positions = array<vec3f, 4>{get_position(shape, vertices.x),
+      get_position(shape, vertices.y), get_position(shape, vertices.z),
+      get_position(shape, vertices.w)};
+  point.position = transform_point(instance.frame, interpolate(positions));
+
+  // normal
+  if (!has_normals(shape)) {
+    point.normal = transform_normal(instance.frame,
+        triangle ? triangle_normal(positions[0], positions[1], positions[2])
+                 : quad_normal(
+                       positions[0], positions[1], positions[2], positions[3]));
+  } else {
+    auto normals = array<vec3f, 4>{get_normal(shape, vertices.x),
+        get_normal(shape, vertices.y), get_normal(shape, vertices.z),
+        get_normal(shape, vertices.w)};
+    point.normal = transform_normal(
+        instance.frame, normalize(interpolate(normals)));
+  }
+
+  // texcoord and color
+  auto texcoords = array<vec2f, 4>{};
+  if (has_texcoords(shape)) {
+    texcoords      = {get_texcoord(shape, vertices.x),
+        get_texcoord(shape, vertices.y), get_texcoord(shape, vertices.z),
+        get_texcoord(shape, vertices.w)};
+    point.texcoord = interpolate(texcoords);
+  } else {
+    point.texcoord = uv;
+  }
+  if (!shape.colors.empty()) {
+    point.color = interpolate(array<vec4f, 4>{shape.colors[vertices.x],
+        shape.colors[vertices.y], shape.colors[vertices.z],
+        shape.colors[vertices.w]});
+  }
+
+  // normal mapping
+  if (material.normal_tex != invalidid) {
+    auto& normal_tex = scene.textures[material.normal_tex];
+    auto  normalmap  = -1 +
+                     2 * xyz(eval_texture(normal_tex, point.texcoord, false));
+    auto tu = vec3f{0, 0, 0}, tv = vec3f{0, 0, 0};
+    if (has_texcoords(shape)) {
+      std::tie(tu, tv) =
+          triangle ? triangle_tangents_fromuv(positions[0], positions[1],
+                         positions[2], texcoords[0], texcoords[1],
+                         texcoords[2])
+                   : quad_tangents_fromuv(positions[0], positions[1],
+                         positions[2], positions[3], texcoords[0],
+                         texcoords[1], texcoords[2], texcoords[3], {0, 0});
+      tu = transform_direction(instance.frame, tu);
+      tv = transform_direction(instance.frame, tv);
+    }
+    auto frame  = frame3f{tu, tv, point.normal, {0, 0, 0}};
+    frame.x     = orthonormalize(frame.x, frame.z);
+    frame.y     = normalize(cross(frame.z, frame.x));
+    auto flip_v = dot(frame.y, tv) < 0;
+    normalmap.y *= flip_v ? 1 : -1;  // flip vertical axis
+    point.normal = transform_normal(frame, normalmap);
+  }
+  if (material.type != material_type::refractive &&
+      dot(point.normal, outgoing) < 0)
+    point.normal = -point.normal;
+
+  // material
+  point.material = eval_material_point(
+      scene, material, point.texcoord, point.color);
+  return point;
+}
+
 // check if an instance is volumetric
 bool is_volumetric(const scene_data& scene, const instance_data& instance) {
   return is_volumetric(scene.materials[instance.material]);
@@ -738,18 +863,52 @@ scene_data make_shape_scene(const shape_data& shape, bool addsky) {
   return scene;
 }
 
+// Bounds of an instance group, computing the ones of its nested groups first
+static bbox3f compute_group_bounds(const scene_data& scene,
+    const vector<bbox3f>& shape_bbox, vector<bbox3f>& group_bbox,
+    vector<bool>& computed, int group) {
+  if (computed[group]) return group_bbox[group];
+  computed[group] = true;
+  auto  bbox      = invalidb3f;
+  auto& group_    = scene.instance_groups[group];
+  for (auto& instance : group_.instances) {
+    bbox = merge(
+        bbox, transform_bbox(instance.frame, shape_bbox[instance.shape]));
+  }
+  for (auto& nested : group_.groups) {
+    bbox = merge(bbox, transform_bbox(nested.frame,
+                           compute_group_bounds(scene, shape_bbox, group_bbox,
+                               computed, nested.group)));
+  }
+  group_bbox[group] = bbox;
+  return bbox;
+}
+
 // Updates the scene and scene's instances bounding boxes
 bbox3f compute_bounds(const scene_data& scene) {
   auto shape_bbox = vector<bbox3f>{};
   auto bbox       = invalidb3f;
   for (auto& shape : scene.shapes) {
     auto& sbvh = shape_bbox.emplace_back();
-    for (auto p : shape.positions) sbvh = merge(sbvh, p);
+    for (auto idx = 0; idx < num_vertices(shape); idx++)
+      sbvh = merge(sbvh, get_position(shape, idx));
   }
   for (auto& instance : scene.instances) {
     auto& sbvh = shape_bbox[instance.shape];
     bbox       = merge(bbox, transform_bbox(instance.frame, sbvh));
   }
+  for (auto& array : scene.instance_arrays) {
+    auto& sbvh = shape_bbox[array.shape];
+    for (auto& frame : array.frames)
+      bbox = merge(bbox, transform_bbox(frame, sbvh));
+  }
+  auto group_bbox = vector<bbox3f>(scene.instance_groups.size(), invalidb3f);
+  auto computed   = vector<bool>(scene.instance_groups.size(), false);
+  for (auto& instance : scene.group_instances) {
+    bbox = merge(bbox, transform_bbox(instance.frame,
+                           compute_group_bounds(scene, shape_bbox, group_bbox,
+                               computed, instance.group)));
+  }
   return bbox;
 }
 
@@ -836,6 +995,12 @@ void tesselate_subdivs(scene_data& scene) {
   }
 }
 
+void compress_shapes(scene_data& scene) {
+  parallel_foreach(scene.shapes, [](shape_data& shape) {
+    compress_shape(shape);
+  });
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -862,6 +1027,20 @@ size_t compute_memory(const scene_data& scene) {
   memory += vector_memory(scene.shape_names);
   memory += vector_memory(scene.texture_names);
   memory += vector_memory(scene.environment_names);
+  memory += vector_memory(scene.instance_arrays);
+  memory += vector_memory(scene.instance_array_names);
+  for (auto& array : scene.instance_arrays) {
+    memory += vector_memory(array.frames);
+    memory += vector_memory(array.colors);
+  }
+  memory += vector_memory(scene.instance_groups);
+  memory += vector_memory(scene.group_instances);
+  memory += vector_memory(scene.instance_group_names);
+  memory += vector_memory(scene.group_instance_names);
+  for (auto& group : scene.instance_groups) {
+    memory += vector_memory(group.instances);
+    memory += vector_memory(group.groups);
+  }
   for (auto& shape : scene.shapes) {
     memory += vector_memory(shape.points);
     memory += vector_memory(shape.lines);
@@ -871,7 +1050,11 @@ size_t compute_memory(const scene_data& scene) {
     memory += vector_memory(shape.normals);
     memory += vector_memory(shape.texcoords);
     memory += vector_memory(shape.colors);
-    memory += vector_memory(shape.triangles);
+    memory += vector_memory(shape.radius);
+    memory += vector_memory(shape.tangents);
+    memory += vector_memory(shape.qpositions);
+    memory += vector_memory(shape.qnormals);
+    memory += vector_memory(shape.qtexcoords);
   }
   for (auto& subdiv : scene.subdivs) {
     memory += vector_memory(subdiv.quadspos);
@@ -916,6 +1099,11 @@ vector<string> scene_stats(const scene_data& scene, bool verbose) {
   auto stats = vector<string>{};
   stats.push_back("cameras:      " + format(scene.cameras.size()));
   stats.push_back("instances:    " + format(scene.instances.size()));
+  stats.push_back("instarrays:   " + format(scene.instance_arrays.size()));
+  stats.push_back("arrayinsts:   " + format(num_instances(scene) -
+                                            scene.instances.size()));
+  stats.push_back("instgroups:   " + format(scene.instance_groups.size()));
+  stats.push_back("groupinsts:   " + format(scene.group_instances.size()));
   stats.push_back("materials:    " + format(scene.materials.size()));
   stats.push_back("shapes:       " + format(scene.shapes.size()));
   stats.push_back("subdivs:      " + format(scene.subdivs.size()));
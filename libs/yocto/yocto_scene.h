@@ -37,6 +37,7 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <string>
@@ -148,6 +149,33 @@ struct instance_data {
   int     material = invalidid;
 };
 
+// Instance array. Copies of a shape with a shared material, whose frames,
+// and optional colors, are stored in flat buffers instead of instances.
+// Instance ids, as used by get_instance() and the scene bvh, number the
+// instances of the arrays after the scene instances.
+struct instance_array_data {
+  int             shape    = invalidid;
+  int             material = invalidid;
+  vector<frame3f> frames   = {};
+  vector<vec4f>   colors   = {};  // optional per-instance colors
+};
+
+// Placement of an instance group, either in the scene or in another group.
+struct group_instance_data {
+  frame3f frame = identity3x4f;
+  int     group = invalidid;
+};
+
+// Instance group. A set of instances, and of placements of other groups,
+// with frames relative to the group. A group is stored, and has its bvh
+// built, once however many times it is placed, so repeated structures made
+// of repeated parts cost memory only for their unique parts. Groups cannot
+// contain themselves, directly or indirectly.
+struct instance_group_data {
+  vector<instance_data>       instances = {};
+  vector<group_instance_data> groups    = {};
+};
+
 // Environment map.
 struct environment_data {
   // environment data
@@ -220,29 +248,40 @@ struct volume_instance {
 
 struct scene_data {
   // scene elements
-  vector<camera_data>                         cameras        = {};
-  vector<instance_data>                       instances      = {};
-  vector<environment_data>                    environments   = {};
-  vector<shape_data>                          shapes         = {};
-  vector<texture_data>                        textures       = {};
-  vector<material_data>                       materials      = {};
-  vector<subdiv_data>                         subdivs        = {};
-  vector<volume<float>>                       volumes        = {};
-  vector<volume_instance>                     vol_instances  = {};
-  vector<sdf_data>                            sdfs           = {};
-  // vector<int>                                 sdfs_materials = {};
-  
+  vector<camera_data>         cameras         = {};
+  vector<instance_data>       instances       = {};
+  vector<environment_data>    environments    = {};
+  vector<shape_data>          shapes          = {};
+  vector<texture_data>        textures        = {};
+  vector<material_data>       materials       = {};
+  vector<subdiv_data>         subdivs         = {};
+  vector<volume<float>>       volumes         = {};
+  vector<volume_instance>     vol_instances   = {};
+  vector<sdf_data>            sdfs            = {};
+  vector<instance_array_data> instance_arrays = {};
+  vector<instance_group_data> instance_groups = {};
+  vector<group_instance_data> group_instances = {};
+  // vector<int>                 sdfs_materials  = {};
+
+  // first instance id of each instance array and number of instances, see
+  // update_instance_arrays()
+  vector<int> instance_array_starts = {};
+  int         instance_array_end    = 0;
+
   // names (this will be cleanup significantly later)
-  vector<string> camera_names        = {};
-  vector<string> texture_names       = {};
-  vector<string> material_names      = {};
-  vector<string> shape_names         = {};
-  vector<string> instance_names      = {};
-  vector<string> environment_names   = {};
-  vector<string> subdiv_names        = {};
-  vector<string> volume_names        = {};
-  vector<string> vol_instances_names = {};
-  vector<string> sdfs_names          = {};
+  vector<string> camera_names         = {};
+  vector<string> texture_names        = {};
+  vector<string> material_names       = {};
+  vector<string> shape_names          = {};
+  vector<string> instance_names       = {};
+  vector<string> environment_names    = {};
+  vector<string> subdiv_names         = {};
+  vector<string> volume_names         = {};
+  vector<string> vol_instances_names  = {};
+  vector<string> sdfs_names           = {};
+  vector<string> instance_array_names = {};
+  vector<string> instance_group_names = {};
+  vector<string> group_instance_names = {};
 
   // copyright info preserve in IO
   string copyright = "";
@@ -324,6 +363,20 @@ bool is_volumetric(const scene_data& scene, const instance_data& instance);
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Number of instances, including the ones in instance arrays.
+inline int num_instances(const scene_data& scene);
+// Update the first instance id of each instance array and the number of
+// instances, so that array instances are found by binary search. Call it
+// after adding instances or arrays, or changing their sizes. Loaders call it.
+// Until then, arrays are scanned if the cache does not match the number of
+// instances, arrays and frames of the last array.
+void update_instance_arrays(scene_data& scene);
+// Get an instance by id, with the instances of instance arrays following the
+// scene instances. Returns a copy since array instances are not stored.
+inline instance_data get_instance(const scene_data& scene, int instance);
+// Get the color of an instance, white unless set in its instance array.
+inline vec4f get_instance_color(const scene_data& scene, int instance);
+
 // Evaluate instance properties
 vec3f eval_position(const scene_data& scene, const instance_data& instance,
     int element, const vec2f& uv);
@@ -350,6 +403,24 @@ vec4f eval_color(const scene_data& scene, const instance_data& instance,
 material_point eval_material(const scene_data& scene,
     const instance_data& instance, int element, const vec2f& uv);
 material_point eval_material(const scene_data& scene, int material);
+
+// Shading point of a hit, with shading position and normal, texcoord, shape
+// color and material.
+struct shading_point {
+  vec3f          position = {0, 0, 0};
+  vec3f          normal   = {0, 0, 0};
+  vec2f          texcoord = {0, 0};
+  vec4f          color    = {1, 1, 1, 1};
+  material_point material = {};
+};
+
+// Eval all shading properties of a hit at once. Equivalent to calling
+// eval_shading_position(), eval_shading_normal(), eval_texcoord(),
+// eval_color() and eval_material(), but resolves the instance, shape and
+// element vertices only once.
+shading_point eval_shading_point(const scene_data& scene,
+    const instance_data& instance, int element, const vec2f& uv,
+    const vec3f& outgoing);
 // check if a material has a volume
 bool is_volumetric(const scene_data& scene, const instance_data& instance);
 
@@ -385,6 +456,9 @@ int find_camera(const scene_data& scene, const string& name);
 // create a scene from a shape
 scene_data make_shape_scene(const shape_data& shape, bool add_sky = false);
 
+// Return the memory used by the scene data, in bytes.
+size_t compute_memory(const scene_data& scene);
+
 // Return scene statistics as list of strings.
 vector<string> scene_stats(const scene_data& scene, bool verbose = false);
 // Return validation errors as list of strings.
@@ -401,6 +475,9 @@ namespace yocto {
 // Apply subdivision and displacement rules.
 void tesselate_subdivs(scene_data& scene);
 
+// Compress the vertex data of all shapes. See compress_shape().
+void compress_shapes(scene_data& scene);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -438,4 +515,82 @@ using scene_subdiv [[deprecated]]        = subdiv_data;
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+//
+//
+// IMPLEMENTATION
+//
+//
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// INSTANCE PROPERTIES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Check whether the instance array cache matches the scene, in constant time.
+// The sizes of arrays other than the last are not checked.
+inline bool has_instance_arrays(const scene_data& scene) {
+  auto& starts = scene.instance_array_starts;
+  auto& arrays = scene.instance_arrays;
+  if (starts.size() != arrays.size()) return false;
+  if (starts.empty())
+    return scene.instance_array_end == (int)scene.instances.size();
+  return starts.front() == (int)scene.instances.size() &&
+         scene.instance_array_end ==
+             starts.back() + (int)arrays.back().frames.size();
+}
+
+// Number of instances, including the ones in instance arrays.
+inline int num_instances(const scene_data& scene) {
+  if (has_instance_arrays(scene)) return scene.instance_array_end;
+  auto count = (int)scene.instances.size();
+  for (auto& array : scene.instance_arrays) count += (int)array.frames.size();
+  return count;
+}
+
+// Find the instance array of an array instance id, returning the array and
+// the index in it, or invalid ids if out of range.
+inline pair<int, int> find_instance_array(
+    const scene_data& scene, int instance) {
+  auto& starts = scene.instance_array_starts;
+  if (has_instance_arrays(scene)) {
+    auto array = (int)(std::upper_bound(starts.begin(), starts.end(),
+                           instance) - starts.begin()) - 1;
+    if (array < 0) return {invalidid, invalidid};
+    auto index = instance - starts[array];
+    if (index >= (int)scene.instance_arrays[array].frames.size())
+      return {invalidid, invalidid};
+    return {array, index};
+  }
+  auto index = instance - (int)scene.instances.size();
+  for (auto array = 0; array < (int)scene.instance_arrays.size(); array++) {
+    auto size = (int)scene.instance_arrays[array].frames.size();
+    if (index < size) return {array, index};
+    index -= size;
+  }
+  return {invalidid, invalidid};
+}
+
+// Get an instance by id, with the instances of instance arrays following the
+// scene instances.
+inline instance_data get_instance(const scene_data& scene, int instance) {
+  if (instance < (int)scene.instances.size()) return scene.instances[instance];
+  auto [array_id, index] = find_instance_array(scene, instance);
+  if (array_id == invalidid) return {};
+  auto& array = scene.instance_arrays[array_id];
+  return {array.frames[index], array.shape, invalidid, array.material};
+}
+
+// Get the color of an instance, white unless set in its instance array.
+inline vec4f get_instance_color(const scene_data& scene, int instance) {
+  if (instance < (int)scene.instances.size()) return {1, 1, 1, 1};
+  auto [array_id, index] = find_instance_array(scene, instance);
+  if (array_id == invalidid) return {1, 1, 1, 1};
+  auto& array = scene.instance_arrays[array_id];
+  return array.colors.empty() ? vec4f{1, 1, 1, 1} : array.colors[index];
+}
+
+}  // namespace yocto
+
 #endif
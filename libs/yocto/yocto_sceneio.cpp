@@ -46,6 +46,7 @@
 #include "ext/stb_image_resize.h"
 #include "ext/stb_image_write.h"
 #include "ext/tinyexr.h"
+#include "yocto_cli.h"
 #include "yocto_color.h"
 #include "yocto_geometry.h"
 #include "yocto_image.h"
@@ -132,6 +133,13 @@ bool path_isfile(const string& filename) {
 // Get the current directory
 string path_current() { return std::filesystem::current_path().u8string(); }
 
+// Get the size of a file in bytes, or 0 if it cannot be read
+static size_t path_size(const string& filename) {
+  auto ec   = std::error_code{};
+  auto size = std::filesystem::file_size(make_path(filename), ec);
+  return ec ? 0 : (size_t)size;
+}
+
 // Create a directory and all missing parent directories if needed
 bool make_directory(const string& dirname, string& error) {
   if (path_exists(dirname)) return true;
@@ -409,6 +417,7 @@ bool is_ldr_filename(const string& filename) {
 
 // Loads/saves an image. Chooses hdr or ldr based on file name.
 bool load_image(const string& filename, image_data& image, string& error) {
+  auto zone = trace_zone{"load_image", filename};
   auto read_error = [&]() {
     error = filename + ": read error";
     return false;
@@ -853,6 +862,7 @@ static bool save_yvol(const string& filename, int width, int height, int depth,
 
 // Loads volume data from binary format.
 bool load_volume(const string& filename, volume<float>& vol, string& error) {
+  auto zone = trace_zone{"load_volume", filename};
   auto read_error = [filename, &error]() {
     error = filename + ": read error";
     return false;
@@ -883,6 +893,7 @@ bool save_volume(
 namespace yocto {
 
 bool load_volume(const string& filename, volume<float>& vol, bool binary, string& error) {
+  auto zone = trace_zone{"load_volume", filename};
   auto read_error = [filename, &error]() {
     error = filename + ": read error";
     return false;
@@ -966,10 +977,208 @@ bool load_volume(const string& filename, volume<float>& vol, bool binary, string
   return true;
 }
 
+// Binary shape format. The file starts with a fixed size header, followed by
+// the shape arrays, each aligned to yshape_alignment bytes, so that loading
+// is a single read per array. The hash covers the array contents. Bvhs are
+// not stored, since renderers build them with options, like spatial splits
+// or compression, that are not known when converting shapes.
+static const auto yshape_magic     = array<char, 8>{
+    'Y', 'S', 'H', 'A', 'P', 'E', '\n', '\0'};
+static const auto yshape_version   = (uint32_t)1;
+static const auto yshape_alignment = (uint64_t)64;
+static const auto yshape_narrays   = 13;
+
+// Binary shape array location
+struct yshape_array {
+  uint64_t offset = 0;  // byte offset in the file
+  uint64_t count  = 0;  // number of elements
+  uint32_t stride = 0;  // element size, used for validation
+  uint32_t unused = 0;
+};
+
+// Binary shape header
+struct yshape_header {
+  array<char, 8> magic           = yshape_magic;
+  uint32_t       version         = yshape_version;
+  uint32_t       narrays         = yshape_narrays;
+  uint64_t       hash            = 0;
+  vec3f          qposition_min   = {0, 0, 0};
+  vec3f          qposition_scale = {0, 0, 0};
+  vec2f          qtexcoord_min   = {0, 0};
+  vec2f          qtexcoord_scale = {0, 0};
+  array<yshape_array, yshape_narrays> arrays = {};
+};
+
+// Apply a function to each array of a shape, in file order
+template <typename Shape, typename Func>
+static void visit_yshape_arrays(Shape& shape, Func&& func) {
+  func(shape.points);
+  func(shape.lines);
+  func(shape.triangles);
+  func(shape.quads);
+  func(shape.positions);
+  func(shape.normals);
+  func(shape.texcoords);
+  func(shape.colors);
+  func(shape.radius);
+  func(shape.tangents);
+  func(shape.qpositions);
+  func(shape.qnormals);
+  func(shape.qtexcoords);
+}
+
+// Hash array data with a 64-bit FNV-1a over words
+static uint64_t hash_yshape_values(
+    uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const byte*)data;
+  auto words = size / 8;
+  for (auto idx = (size_t)0; idx < words; idx++) {
+    auto word = (uint64_t)0;
+    memcpy(&word, bytes + idx * 8, 8);
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  for (auto idx = words * 8; idx < size; idx++) {
+    hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+static uint64_t hash_yshape(const shape_data& shape) {
+  auto hash = (uint64_t)0xcbf29ce484222325ull;
+  visit_yshape_arrays(shape, [&hash](auto& values) {
+    hash = hash_yshape_values(
+        hash, values.data(), values.size() * sizeof(values.front()));
+  });
+  return hash;
+}
+
+// Load binary shape
+static bool load_yshape(
+    const string& filename, shape_data& shape, string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  auto fs       = fopen_utf8(filename.c_str(), "rb");
+  auto fs_guard = unique_ptr<FILE, int (*)(FILE*)>(fs, &fclose);
+  if (!fs) return open_error();
+  auto size_error = std::error_code{};
+  auto size       = (uint64_t)std::filesystem::file_size(
+      make_path(filename), size_error);
+  if (size_error) return read_error();
+
+  // header
+  auto header = yshape_header{};
+  if (fread(&header, sizeof(header), 1, fs) != 1) return read_error();
+  if (header.magic != yshape_magic) return parse_error();
+  if (header.version != yshape_version) return parse_error();
+  if (header.narrays != yshape_narrays) return parse_error();
+  shape.qposition_min   = header.qposition_min;
+  shape.qposition_scale = header.qposition_scale;
+  shape.qtexcoord_min   = header.qtexcoord_min;
+  shape.qtexcoord_scale = header.qtexcoord_scale;
+
+  // arrays, read in place and in order, skipping the padding, after checking
+  // that they lie within the file, so that corrupted counts are not allocated;
+  // empty arrays are cleared, so that no data is left from a previous shape
+  auto index    = 0;
+  auto position = (uint64_t)sizeof(header);
+  auto padding  = array<byte, yshape_alignment>{};
+  auto ok = true, valid = true;
+  visit_yshape_arrays(shape, [&](auto& values) {
+    auto& info = header.arrays[index++];
+    if (!ok || !valid) return;
+    if (info.count == 0) {
+      values.clear();
+      return;
+    }
+    if (info.stride != sizeof(values.front()) || info.offset < position ||
+        info.offset - position >= yshape_alignment || info.offset > size ||
+        info.count > (size - info.offset) / info.stride) {
+      valid = false;
+      return;
+    }
+    values.resize(info.count);
+    ok = fread(padding.data(), 1, info.offset - position, fs) ==
+             info.offset - position &&
+         fread(values.data(), info.stride, info.count, fs) == info.count;
+    position = info.offset + info.count * info.stride;
+  });
+  if (!valid) return parse_error();
+  if (!ok) return read_error();
+  if (hash_yshape(shape) != header.hash) return parse_error();
+  return true;
+}
+
+// Save binary shape
+static bool save_yshape(
+    const string& filename, const shape_data& shape, string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  // header
+  auto header            = yshape_header{};
+  header.hash            = hash_yshape(shape);
+  header.qposition_min   = shape.qposition_min;
+  header.qposition_scale = shape.qposition_scale;
+  header.qtexcoord_min   = shape.qtexcoord_min;
+  header.qtexcoord_scale = shape.qtexcoord_scale;
+  auto align = [](uint64_t offset) {
+    return (offset + yshape_alignment - 1) / yshape_alignment *
+           yshape_alignment;
+  };
+  auto offset = align(sizeof(header));
+  auto index  = 0;
+  visit_yshape_arrays(shape, [&](auto& values) {
+    auto& info  = header.arrays[index++];
+    info.count  = values.size();
+    info.stride = (uint32_t)sizeof(values.front());
+    info.offset = values.empty() ? 0 : offset;
+    offset      = align(offset + info.count * info.stride);
+  });
+
+  auto fs       = fopen_utf8(filename.c_str(), "wb");
+  auto fs_guard = unique_ptr<FILE, int (*)(FILE*)>(fs, &fclose);
+  if (!fs) return open_error();
+
+  // write header and arrays, padding to the array offsets
+  if (fwrite(&header, sizeof(header), 1, fs) != 1) return write_error();
+  auto written = (uint64_t)sizeof(header);
+  auto padding = array<byte, yshape_alignment>{};
+  auto ok      = true;
+  index        = 0;
+  visit_yshape_arrays(shape, [&](auto& values) {
+    auto& info = header.arrays[index++];
+    if (!ok || info.count == 0) return;
+    ok = fwrite(padding.data(), 1, info.offset - written, fs) ==
+             info.offset - written &&
+         fwrite(values.data(), info.stride, info.count, fs) == info.count;
+    written = info.offset + info.count * info.stride;
+  });
+  if (!ok) return write_error();
+  return true;
+}
 
 // Load mesh
 bool load_shape(const string& filename, shape_data& shape, string& error,
     bool flip_texcoord) {
+  auto zone = trace_zone{"load_shape", filename};
   auto shape_error = [&]() {
     error = filename + ": empty shape";
     return false;
@@ -1015,6 +1224,12 @@ bool load_shape(const string& filename, shape_data& shape, string& error,
     if (!get_triangles(stl, 0, shape.triangles, shape.positions, fnormals))
       return shape_error();
     return true;
+  } else if (ext == ".yshape" || ext == ".YSHAPE") {
+    if (!load_yshape(filename, shape, error)) return false;
+    if (shape.points.empty() && shape.lines.empty() &&
+        shape.triangles.empty() && shape.quads.empty())
+      return shape_error();
+    return true;
   } else if (ext == ".ypreset" || ext == ".YPRESET") {
     if (!make_shape_preset(filename, shape, error)) return false;
     return true;
@@ -1073,6 +1288,9 @@ bool save_shape(const string& filename, const shape_data& shape, string& error,
     }
     if (!save_stl(filename, stl, error)) return false;
     return true;
+  } else if (ext == ".yshape" || ext == ".YSHAPE") {
+    if (!save_yshape(filename, shape, error)) return false;
+    return true;
   } else if (ext == ".cpp" || ext == ".CPP") {
     auto to_cpp = [](const string& name, const string& vname,
                       const auto& values) -> string {
@@ -1736,6 +1954,7 @@ namespace yocto {
 // Loads/saves an image. Chooses hdr or ldr based on file name.
 bool load_texture(
     const string& filename, texture_data& texture, string& error) {
+  auto zone = trace_zone{"load_texture", filename};
   auto read_error = [&]() {
     error = filename + ": rad error";
     return false;
@@ -2068,12 +2287,13 @@ void add_missing_camera(scene_data& scene) {
 }
 
 // Add missing radius.
+static void add_missing_radius(shape_data& shape, float radius = 0.001f) {
+  if (shape.points.empty() && shape.lines.empty()) return;
+  if (!shape.radius.empty()) return;
+  shape.radius.assign(shape.positions.size(), radius);
+}
 static void add_missing_radius(scene_data& scene, float radius = 0.001f) {
-  for (auto& shape : scene.shapes) {
-    if (shape.points.empty() && shape.lines.empty()) continue;
-    if (!shape.radius.empty()) continue;
-    shape.radius.assign(shape.positions.size(), radius);
-  }
+  for (auto& shape : scene.shapes) add_missing_radius(shape, radius);
 }
 
 // Add missing cameras.
@@ -2632,8 +2852,9 @@ bool make_scene_preset(
 namespace yocto {
 
 // Load/save a scene in the builtin JSON format.
-static bool load_json_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel);
+static bool load_json_scene(const string& filename, scene_data& scene,
+    string& error, const function<void(int shape)>& shape_loaded,
+    bool noparallel);
 static bool save_json_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
@@ -2669,28 +2890,55 @@ static bool load_pbrt_scene(
 static bool save_pbrt_scene(const string& filename, const scene_data& scene,
     string& error, bool noparallel);
 
+// Notify all shapes at once for formats that load them together
+static void notify_shapes(const scene_data& scene,
+    const function<void(int shape)>& shape_loaded, bool noparallel) {
+  if (!shape_loaded) return;
+  if (noparallel) {
+    for (auto idx : range((int)scene.shapes.size())) shape_loaded(idx);
+  } else {
+    parallel_for((int)scene.shapes.size(), shape_loaded);
+  }
+}
+
 // Load a scene
 bool load_scene(
     const string& filename, scene_data& scene, string& error, bool noparallel) {
-  auto ext = path_extension(filename);
+  return load_scene(filename, scene, error, {}, noparallel);
+}
+
+// Load a scene notifying loaded shapes
+bool load_scene(const string& filename, scene_data& scene, string& error,
+    const function<void(int shape)>& shape_loaded, bool noparallel) {
+  auto zone = trace_zone{"load_scene", filename};
+  auto ext  = path_extension(filename);
+  auto ok   = false;
   if (ext == ".json" || ext == ".JSON") {
-    return load_json_scene(filename, scene, error, noparallel);
+    // shapes are notified by the loading threads
+    if (!load_json_scene(filename, scene, error, shape_loaded, noparallel))
+      return false;
+    update_instance_arrays(scene);
+    return true;
   } else if (ext == ".obj" || ext == ".OBJ") {
-    return load_obj_scene(filename, scene, error, noparallel);
+    ok = load_obj_scene(filename, scene, error, noparallel);
   } else if (ext == ".gltf" || ext == ".GLTF") {
-    return load_gltf_scene(filename, scene, error, noparallel);
+    ok = load_gltf_scene(filename, scene, error, noparallel);
   } else if (ext == ".pbrt" || ext == ".PBRT") {
-    return load_pbrt_scene(filename, scene, error, noparallel);
+    ok = load_pbrt_scene(filename, scene, error, noparallel);
   } else if (ext == ".ply" || ext == ".PLY") {
-    return load_ply_scene(filename, scene, error, noparallel);
+    ok = load_ply_scene(filename, scene, error, noparallel);
   } else if (ext == ".stl" || ext == ".STL") {
-    return load_stl_scene(filename, scene, error, noparallel);
+    ok = load_stl_scene(filename, scene, error, noparallel);
   } else if (ext == ".ypreset" || ext == ".YPRESET") {
-    return make_scene_preset(filename, scene, error);
+    ok = make_scene_preset(filename, scene, error);
   } else {
     error = filename + ": unknown format";
     return false;
   }
+  if (!ok) return false;
+  update_instance_arrays(scene);
+  notify_shapes(scene, shape_loaded, noparallel);
+  return true;
 }
 
 // Save a scene
@@ -2751,6 +2999,10 @@ bool make_scene_directories(
   if (!scene.subdivs.empty())
     if (!make_directory(path_join(path_dirname(filename), "subdivs"), error))
       return false;
+  if (!scene.instance_arrays.empty())
+    if (!make_directory(
+            path_join(path_dirname(filename), "instance_arrays"), error))
+      return false;
   return true;
 }
 
@@ -2825,6 +3077,165 @@ static bool load_instance(
   }
 }
 
+// Binary instance array format. The file starts with a fixed size header,
+// followed by the frames and then the optional colors, so that loading is a
+// single read per array straight into the instance array buffers.
+static const auto yinst_magic   = array<char, 8>{
+    'Y', 'I', 'N', 'S', 'T', '\n', '\0', '\0'};
+static const auto yinst_version = (uint32_t)1;
+
+// Binary instance array header
+struct yinst_header {
+  array<char, 8> magic   = yinst_magic;
+  uint32_t       version = yinst_version;
+  uint32_t       unused  = 0;
+  uint64_t       nframes = 0;
+  uint64_t       ncolors = 0;
+};
+
+// Load binary instance array
+static bool load_yinst(
+    const string& filename, instance_array_data& array, string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto parse_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto read_error = [filename, &error]() {
+    error = filename + ": read error";
+    return false;
+  };
+
+  auto fs       = fopen_utf8(filename.c_str(), "rb");
+  auto fs_guard = unique_ptr<FILE, int (*)(FILE*)>(fs, &fclose);
+  if (!fs) return open_error();
+  auto size_error = std::error_code{};
+  auto size       = (uint64_t)std::filesystem::file_size(
+      make_path(filename), size_error);
+  if (size_error) return read_error();
+
+  // header
+  auto header = yinst_header{};
+  if (fread(&header, sizeof(header), 1, fs) != 1) return read_error();
+  if (header.magic != yinst_magic) return parse_error();
+  if (header.version != yinst_version) return parse_error();
+  if (header.ncolors != 0 && header.ncolors != header.nframes)
+    return parse_error();
+
+  // check that the arrays lie within the file, so that corrupted counts are
+  // not allocated
+  if (size < sizeof(header)) return read_error();
+  auto remaining = size - sizeof(header);
+  if (header.nframes > remaining / sizeof(frame3f)) return parse_error();
+  remaining -= header.nframes * sizeof(frame3f);
+  if (header.ncolors > remaining / sizeof(vec4f)) return parse_error();
+
+  // arrays, read in place
+  array.frames.resize(header.nframes);
+  array.colors.resize(header.ncolors);
+  if (fread(array.frames.data(), sizeof(frame3f), header.nframes, fs) !=
+      header.nframes)
+    return read_error();
+  if (fread(array.colors.data(), sizeof(vec4f), header.ncolors, fs) !=
+      header.ncolors)
+    return read_error();
+  return true;
+}
+
+// Save binary instance array
+static bool save_yinst(
+    const string& filename, const instance_array_data& array, string& error) {
+  // error helpers
+  auto open_error = [filename, &error]() {
+    error = filename + ": file not found";
+    return false;
+  };
+  auto write_error = [filename, &error]() {
+    error = filename + ": write error";
+    return false;
+  };
+
+  auto fs       = fopen_utf8(filename.c_str(), "wb");
+  auto fs_guard = unique_ptr<FILE, int (*)(FILE*)>(fs, &fclose);
+  if (!fs) return open_error();
+
+  // header and arrays
+  auto header    = yinst_header{};
+  header.nframes = array.frames.size();
+  header.ncolors = array.colors.size();
+  if (fwrite(&header, sizeof(header), 1, fs) != 1) return write_error();
+  if (fwrite(array.frames.data(), sizeof(frame3f), header.nframes, fs) !=
+      header.nframes)
+    return write_error();
+  if (fwrite(array.colors.data(), sizeof(vec4f), header.ncolors, fs) !=
+      header.ncolors)
+    return write_error();
+  return true;
+}
+
+// load instance array
+bool load_instance_array(
+    const string& filename, instance_array_data& array, string& error) {
+  auto zone = trace_zone{"load_instance_array", filename};
+  array.frames.clear();
+  array.colors.clear();
+  auto ext = path_extension(filename);
+  if (ext == ".yinst" || ext == ".YINST") {
+    return load_yinst(filename, array, error);
+  } else if (ext == ".ply" || ext == ".PLY") {
+    auto ply = ply_model{};
+    if (!load_ply(filename, ply, error)) return false;
+    if (!get_values(ply, "instance",
+            {"xx", "xy", "xz", "yx", "yy", "yz", "zx", "zy", "zz", "ox", "oy",
+                "oz"},
+            array.frames)) {
+      error = filename + ": parse error";
+      return false;
+    }
+    if (has_property(ply, "instance", "red") &&
+        !get_values(ply, "instance", {"red", "green", "blue", "alpha"},
+            array.colors)) {
+      error = filename + ": parse error";
+      return false;
+    }
+    return true;
+  } else {
+    error = filename + ": unknown format";
+    return false;
+  }
+}
+
+// save instance array
+bool save_instance_array(const string& filename,
+    const instance_array_data& array, string& error) {
+  if (!array.colors.empty() && array.colors.size() != array.frames.size()) {
+    error = filename + ": invalid colors";
+    return false;
+  }
+  auto ext = path_extension(filename);
+  if (ext == ".yinst" || ext == ".YINST") {
+    return save_yinst(filename, array, error);
+  } else if (ext == ".ply" || ext == ".PLY") {
+    auto ply = ply_model{};
+    add_values(ply, "instance",
+        {"xx", "xy", "xz", "yx", "yy", "yz", "zx", "zy", "zz", "ox", "oy",
+            "oz"},
+        array.frames);
+    if (!array.colors.empty())
+      add_values(
+          ply, "instance", {"red", "green", "blue", "alpha"}, array.colors);
+    if (!save_ply(filename, ply, error)) return false;
+    return true;
+  } else {
+    error = filename + ": unknown format";
+    return false;
+  }
+}
+
 // load subdiv
 bool load_subdiv(const string& filename, subdiv_data& subdiv, string& error) {
   auto lsubdiv = fvshape_data{};
@@ -3540,30 +3951,603 @@ static bool load_json_scene_version41(const string& filename, json_value& json,
   return false;
 }
 
-// Load a scene in the builtin JSON format.
-static bool load_json_scene(
-    const string& filename, scene_data& scene, string& error, bool noparallel) {
-  // open file
-  auto json = json_value{};
-  if (!load_json(filename, json, error)) return false;
+// Count the elements of the arrays at the top level of a json object by
+// scanning the text, without parsing values. Used to reserve scene arrays
+// before streaming their elements.
+static unordered_map<string, size_t> count_json_arrays(const string& text) {
+  auto counts = unordered_map<string, size_t>{};
+  auto key    = string{};
+  auto depth  = 0;
+  auto array  = false;  // whether the current level 2 value is an array
+  auto next   = false;  // whether the next level 2 value starts an element
+  for (auto pos = (size_t)0; pos < text.size(); pos++) {
+    auto c = text[pos];
+    if (c == ' ' || c == '\n' || c == '\r' || c == '\t') continue;
+    if (depth == 2 && array && next && c != ']') {
+      counts[key] += 1;
+      next = false;
+    }
+    if (c == '"') {
+      auto start = ++pos;
+      while (pos < text.size() && text[pos] != '"')
+        pos += text[pos] == '\\' ? 2 : 1;
+      if (depth == 1) key = text.substr(start, pos - start);
+    } else if (c == '{' || c == '[') {
+      depth += 1;
+      if (depth == 2) {
+        array = c == '[';
+        next  = true;
+        if (array) counts[key] = 0;
+      }
+    } else if (c == '}' || c == ']') {
+      depth -= 1;
+    } else if (c == ',' && depth == 2) {
+      next = true;
+    }
+  }
+  return counts;
+}
+
+// Streaming parser for the current JSON scene format. Elements are written
+// into the scene while the text is parsed, instead of building a json value
+// that takes several times the size of the text for scenes with many
+// instances and materials. Values are converted as json_value::value() does.
+struct json_scene_parser : nlohmann::json_sax<json_value> {
+  // scene and the element data not stored in it
+  scene_data&          scene;
+  vector<std::string>& shape_filenames;
+  vector<std::string>& volume_filenames;
+  vector<std::string>& texture_filenames;
+  vector<std::string>& subdiv_filenames;
+  vector<std::string>& array_filenames;
+  vector<bool>&        binary_vol;
+  std::string          version      = "";
+  bool                 syntax_error = false;
+
+  json_scene_parser(scene_data& scene, vector<std::string>& shape_filenames,
+      vector<std::string>& volume_filenames,
+      vector<std::string>& texture_filenames,
+      vector<std::string>& subdiv_filenames,
+      vector<std::string>& array_filenames, vector<bool>& binary_vol,
+      const unordered_map<std::string, size_t>& counts)
+      : scene{scene}
+      , shape_filenames{shape_filenames}
+      , volume_filenames{volume_filenames}
+      , texture_filenames{texture_filenames}
+      , subdiv_filenames{subdiv_filenames}
+      , array_filenames{array_filenames}
+      , binary_vol{binary_vol}
+      , counts{counts} {}
+
+  // values
+  bool null() override { return scalar(nullptr); }
+  bool boolean(bool value) override { return scalar(value); }
+  bool number_integer(number_integer_t value) override {
+    return scalar(value);
+  }
+  bool number_unsigned(number_unsigned_t value) override {
+    return scalar(value);
+  }
+  bool number_float(number_float_t value, const string_t&) override {
+    return scalar(value);
+  }
+  bool string(string_t& value) override { return scalar(value); }
+  bool binary(binary_t&) override { return false; }
+
+  // objects
+  bool start_object(size_t) override {
+    if (skip > 0 || skip_composite()) return start_skip();
+    if (depth == 0 || (depth == 1 && group == group_type::asset)) {
+      depth += 1;
+      return true;
+    }
+    if (depth == 2 && in_group) {
+      depth += 1;
+      return start_element();
+    }
+    return false;
+  }
+  bool key(string_t& key) override {
+    if (skip > 0) return true;
+    if (depth == 1) return start_group(key);
+    if (depth == 2 && group == group_type::asset) {
+      if (key == "copyright") return bind(scene.copyright);
+      if (key == "version") return bind(version);
+      return bind_none();
+    }
+    if (depth == 3) return bind_field(key);
+    return false;
+  }
+  bool end_object() override {
+    if (skip > 0) return end_skip();
+    depth -= 1;
+    field = field_type::none;
+    if (depth == 2) return end_element();
+    if (depth == 1) group = group_type::none;
+    return true;
+  }
 
-  // check version
-  if (!json.contains("asset") || !json.at("asset").contains("version"))
-    return load_json_scene_version40(filename, json, scene, error, noparallel);
-  if (json.contains("asset") && json.at("asset").contains("version") &&
-      json.at("asset").at("version") == "4.1")
-    return load_json_scene_version41(filename, json, scene, error, noparallel);
+  // arrays
+  bool start_array(size_t) override {
+    if (skip > 0 || skip_composite()) return start_skip();
+    if (depth == 1 && group != group_type::asset) {
+      depth += 1;
+      in_group = true;
+      return reserve_group();
+    }
+    if (at_field() && field == field_type::reals && !in_reals) {
+      in_reals = true;
+      return true;
+    }
+    return false;
+  }
+  bool end_array() override {
+    if (skip > 0) return end_skip();
+    if (in_reals) {
+      in_reals = false;
+      field    = field_type::none;
+      return field_read == field_count;
+    }
+    depth -= 1;
+    in_group = false;
+    group    = group_type::none;
+    return true;
+  }
 
-  // parse json value
-  auto get_opt = [](const json_value& json, const string& key, auto& value) {
-    value = json.value(key, value);
+  // errors
+  bool parse_error(size_t, const std::string&,
+      const nlohmann::detail::exception&) override {
+    syntax_error = true;
+    return false;
+  }
+
+ private:
+  // scene groups
+  enum struct group_type {
+    // clang-format off
+    none, asset, cameras, textures, materials, shapes, volumes, sdfunctions,
+    subdivs, instances, instance_arrays, vol_instances, environments
+    // clang-format on
+  };
+  // types of the field being parsed
+  enum struct field_type {
+    none, boolean, integer, real, reals, text, material, sdf
   };
 
+  // parser state
+  const unordered_map<std::string, size_t>& counts;
+  int                                       depth    = 0;
+  int                                       skip     = 0;
+  group_type                                group    = group_type::none;
+  bool                                      in_group = false;
+  bool                                      in_reals = false;
+
+  // field being parsed
+  field_type field       = field_type::none;
+  void*      field_value = nullptr;
+  int        field_count = 0;
+  int        field_read  = 0;
+
+  // element values that are not stored directly
+  bool     volume_binary = false;
+  bool     sdf_typed     = false;
+  sdf_type sdf_kind      = sdf_type::bbox;
+  float    sdf_thickness = 0;
+  float    sdf_height    = 0;
+  float    sdf_radius    = 0;
+  float    sdf_r1        = 0;
+  float    sdf_r2        = 0;
+  vec3f    sdf_whd       = {0, 0, 0};
+
+  // whether the next value belongs to a field of the asset or an element
+  bool at_field() const { return (depth == 2 && !in_group) || depth == 3; }
+
+  // skip unknown groups and fields, together with their values
+  bool skip_composite() const {
+    return (depth == 1 && group == group_type::none) ||
+           (at_field() && field == field_type::none);
+  }
+  bool start_skip() {
+    skip += 1;
+    return true;
+  }
+  bool end_skip() {
+    skip -= 1;
+    return true;
+  }
+
+  // store a scalar in the bound field
+  template <typename T>
+  bool scalar(const T& value) {
+    if (skip > 0) return true;
+    if (!at_field()) return depth == 1 && group == group_type::none;
+    if (field == field_type::none) return true;
+    if (!store(value)) return false;
+    if (field != field_type::reals) field = field_type::none;
+    return true;
+  }
+  bool store(std::nullptr_t) { return false; }
+  bool store(bool value) {
+    if (field != field_type::boolean) return store_number(value);
+    *(bool*)field_value = value;
+    return true;
+  }
+  bool store(const std::string& value) {
+    switch (field) {
+      case field_type::text: *(std::string*)field_value = value; return true;
+      case field_type::material:
+        *(material_type*)field_value = json_value(value).get<material_type>();
+        return true;
+      case field_type::sdf:
+        *(sdf_type*)field_value = json_value(value).get<sdf_type>();
+        return true;
+      default: return false;
+    }
+  }
+  template <typename T>
+  bool store(T value) {
+    return store_number(value);
+  }
+
+  // numbers are converted with a cast, like json_value::get() does
+  template <typename T>
+  bool store_number(T value) {
+    switch (field) {
+      case field_type::integer: *(int*)field_value = (int)value; return true;
+      case field_type::real: *(float*)field_value = (float)value; return true;
+      case field_type::reals:
+        if (!in_reals || field_read >= field_count) return false;
+        ((float*)field_value)[field_read++] = (float)value;
+        return true;
+      default: return false;
+    }
+  }
+
+  // bind the value of the next key
+  bool bind_none() {
+    field = field_type::none;
+    return true;
+  }
+  bool bind(field_type type, void* value, int count = 1) {
+    field       = type;
+    field_value = value;
+    field_count = count;
+    field_read  = 0;
+    return true;
+  }
+  bool bind(bool& value) { return bind(field_type::boolean, &value); }
+  bool bind(int& value) { return bind(field_type::integer, &value); }
+  bool bind(float& value) { return bind(field_type::real, &value); }
+  bool bind(vec3f& value) { return bind(field_type::reals, &value, 3); }
+  bool bind(frame3f& value) { return bind(field_type::reals, &value, 12); }
+  bool bind(std::string& value) { return bind(field_type::text, &value); }
+  bool bind(material_type& value) {
+    return bind(field_type::material, &value);
+  }
+  bool bind(sdf_type& value) { return bind(field_type::sdf, &value); }
+
+  // start a group, skipping unknown ones
+  bool start_group(const std::string& key) {
+    static const auto groups = unordered_map<std::string, group_type>{
+        {"asset", group_type::asset}, {"cameras", group_type::cameras},
+        {"textures", group_type::textures},
+        {"materials", group_type::materials}, {"shapes", group_type::shapes},
+        {"volumes", group_type::volumes},
+        {"sdfunctions", group_type::sdfunctions},
+        {"subdivs", group_type::subdivs}, {"instances", group_type::instances},
+        {"instance_arrays", group_type::instance_arrays},
+        {"vol_instances", group_type::vol_instances},
+        {"environments", group_type::environments}};
+    auto it = groups.find(key);
+    group   = it != groups.end() ? it->second : group_type::none;
+    return bind_none();
+  }
+
+  // reserve the arrays of a group
+  bool reserve_group() {
+    auto it = counts.find(group_name());
+    if (it == counts.end()) return true;
+    auto size = it->second;
+    switch (group) {
+      case group_type::cameras:
+        scene.cameras.reserve(size);
+        scene.camera_names.reserve(size);
+        break;
+      case group_type::textures:
+        scene.textures.reserve(size);
+        scene.texture_names.reserve(size);
+        texture_filenames.reserve(size);
+        break;
+      case group_type::materials:
+        scene.materials.reserve(size);
+        scene.material_names.reserve(size);
+        break;
+      case group_type::shapes:
+        scene.shapes.reserve(size);
+        scene.shape_names.reserve(size);
+        shape_filenames.reserve(size);
+        break;
+      case group_type::volumes:
+        scene.volumes.reserve(size);
+        scene.volume_names.reserve(size);
+        volume_filenames.reserve(size);
+        binary_vol.reserve(size);
+        break;
+      case group_type::sdfunctions:
+        scene.sdfs.reserve(size);
+        scene.sdfs_names.reserve(size);
+        break;
+      case group_type::subdivs:
+        scene.subdivs.reserve(size);
+        scene.subdiv_names.reserve(size);
+        subdiv_filenames.reserve(size);
+        break;
+      case group_type::instances:
+        scene.instances.reserve(size);
+        scene.instance_names.reserve(size);
+        break;
+      case group_type::instance_arrays:
+        scene.instance_arrays.reserve(size);
+        scene.instance_array_names.reserve(size);
+        array_filenames.reserve(size);
+        break;
+      case group_type::vol_instances:
+        scene.vol_instances.reserve(size);
+        scene.vol_instances_names.reserve(size);
+        break;
+      case group_type::environments:
+        scene.environments.reserve(size);
+        scene.environment_names.reserve(size);
+        break;
+      default: break;
+    }
+    return true;
+  }
+  const char* group_name() const {
+    switch (group) {
+      case group_type::cameras: return "cameras";
+      case group_type::textures: return "textures";
+      case group_type::materials: return "materials";
+      case group_type::shapes: return "shapes";
+      case group_type::volumes: return "volumes";
+      case group_type::sdfunctions: return "sdfunctions";
+      case group_type::subdivs: return "subdivs";
+      case group_type::instances: return "instances";
+      case group_type::instance_arrays: return "instance_arrays";
+      case group_type::vol_instances: return "vol_instances";
+      case group_type::environments: return "environments";
+      default: return "";
+    }
+  }
+
+  // add an element to the current group
+  bool start_element() {
+    switch (group) {
+      case group_type::cameras:
+        scene.cameras.emplace_back();
+        scene.camera_names.emplace_back();
+        break;
+      case group_type::textures:
+        scene.textures.emplace_back();
+        scene.texture_names.emplace_back();
+        texture_filenames.emplace_back();
+        break;
+      case group_type::materials:
+        scene.materials.emplace_back();
+        scene.material_names.emplace_back();
+        break;
+      case group_type::shapes:
+        scene.shapes.emplace_back();
+        scene.shape_names.emplace_back();
+        shape_filenames.emplace_back();
+        break;
+      case group_type::volumes:
+        scene.volumes.emplace_back();
+        scene.volume_names.emplace_back();
+        volume_filenames.emplace_back();
+        volume_binary = false;
+        break;
+      case group_type::sdfunctions:
+        scene.sdfs.emplace_back();
+        scene.sdfs_names.emplace_back();
+        sdf_typed     = false;
+        sdf_thickness = 0;
+        sdf_height    = 0;
+        sdf_radius    = 0;
+        sdf_r1        = 0;
+        sdf_r2        = 0;
+        sdf_whd       = {0, 0, 0};
+        break;
+      case group_type::subdivs:
+        scene.subdivs.emplace_back();
+        scene.subdiv_names.emplace_back();
+        subdiv_filenames.emplace_back();
+        break;
+      case group_type::instances:
+        scene.instances.emplace_back();
+        scene.instance_names.emplace_back();
+        break;
+      case group_type::instance_arrays:
+        scene.instance_arrays.emplace_back();
+        scene.instance_array_names.emplace_back();
+        array_filenames.emplace_back();
+        break;
+      case group_type::vol_instances:
+        scene.vol_instances.emplace_back();
+        scene.vol_instances_names.emplace_back();
+        break;
+      case group_type::environments:
+        scene.environments.emplace_back();
+        scene.environment_names.emplace_back();
+        break;
+      default: return false;
+    }
+    return true;
+  }
+
+  // bind a field of the current element, skipping unknown ones
+  bool bind_field(const std::string& key) {
+    switch (group) {
+      case group_type::cameras: {
+        auto& camera = scene.cameras.back();
+        if (key == "name") return bind(scene.camera_names.back());
+        if (key == "frame") return bind(camera.frame);
+        if (key == "orthographic") return bind(camera.orthographic);
+        if (key == "lens") return bind(camera.lens);
+        if (key == "aspect") return bind(camera.aspect);
+        if (key == "film") return bind(camera.film);
+        if (key == "focus") return bind(camera.focus);
+        if (key == "aperture") return bind(camera.aperture);
+      } break;
+      case group_type::textures: {
+        if (key == "name") return bind(scene.texture_names.back());
+        if (key == "uri") return bind(texture_filenames.back());
+      } break;
+      case group_type::materials: {
+        auto& material = scene.materials.back();
+        if (key == "name") return bind(scene.material_names.back());
+        if (key == "type") return bind(material.type);
+        if (key == "emission") return bind(material.emission);
+        if (key == "color") return bind(material.color);
+        if (key == "metallic") return bind(material.metallic);
+        if (key == "roughness") return bind(material.roughness);
+        if (key == "ior") return bind(material.ior);
+        if (key == "trdepth") return bind(material.trdepth);
+        if (key == "scattering") return bind(material.scattering);
+        if (key == "scanisotropy") return bind(material.scanisotropy);
+        if (key == "opacity") return bind(material.opacity);
+        if (key == "emission_tex") return bind(material.emission_tex);
+        if (key == "color_tex") return bind(material.color_tex);
+        if (key == "roughness_tex") return bind(material.roughness_tex);
+        if (key == "scattering_tex") return bind(material.scattering_tex);
+        if (key == "normal_tex") return bind(material.normal_tex);
+      } break;
+      case group_type::shapes: {
+        if (key == "name") return bind(scene.shape_names.back());
+        if (key == "uri") return bind(shape_filenames.back());
+      } break;
+      case group_type::volumes: {
+        if (key == "name") return bind(scene.volume_names.back());
+        if (key == "binary") return bind(volume_binary);
+        if (key == "uri") return bind(volume_filenames.back());
+      } break;
+      case group_type::sdfunctions: {
+        auto& sdf = scene.sdfs.back();
+        if (key == "name") return bind(scene.sdfs_names.back());
+        if (key == "type") {
+          sdf_typed = true;
+          return bind(sdf_kind);
+        }
+        if (key == "frame") return bind(sdf.frame);
+        if (key == "material") return bind(sdf.material);
+        if (key == "thickness") return bind(sdf_thickness);
+        if (key == "whd") return bind(sdf_whd);
+        if (key == "height") return bind(sdf_height);
+        if (key == "r1") return bind(sdf_r1);
+        if (key == "r2") return bind(sdf_r2);
+        if (key == "radius") return bind(sdf_radius);
+      } break;
+      case group_type::subdivs: {
+        auto& subdiv = scene.subdivs.back();
+        if (key == "name") return bind(scene.subdiv_names.back());
+        if (key == "uri") return bind(subdiv_filenames.back());
+        if (key == "shape") return bind(subdiv.shape);
+        if (key == "subdivisions") return bind(subdiv.subdivisions);
+        if (key == "catmullclark") return bind(subdiv.catmullclark);
+        if (key == "smooth") return bind(subdiv.smooth);
+        if (key == "displacement") return bind(subdiv.displacement);
+        if (key == "displacement_tex") return bind(subdiv.displacement_tex);
+      } break;
+      case group_type::instances: {
+        auto& instance = scene.instances.back();
+        if (key == "name") return bind(scene.instance_names.back());
+        if (key == "frame") return bind(instance.frame);
+        if (key == "shape") return bind(instance.shape);
+        if (key == "material") return bind(instance.material);
+      } break;
+      case group_type::instance_arrays: {
+        auto& array = scene.instance_arrays.back();
+        if (key == "name") return bind(scene.instance_array_names.back());
+        if (key == "uri") return bind(array_filenames.back());
+        if (key == "shape") return bind(array.shape);
+        if (key == "material") return bind(array.material);
+      } break;
+      case group_type::vol_instances: {
+        auto& instance = scene.vol_instances.back();
+        if (key == "name") return bind(scene.vol_instances_names.back());
+        if (key == "frame") return bind(instance.frame);
+        if (key == "volume") return bind(instance.volume);
+        if (key == "scale") return bind(instance.scalef);
+        if (key == "material") return bind(instance.material);
+      } break;
+      case group_type::environments: {
+        auto& environment = scene.environments.back();
+        if (key == "name") return bind(scene.environment_names.back());
+        if (key == "frame") return bind(environment.frame);
+        if (key == "emission") return bind(environment.emission);
+        if (key == "emission_tex") return bind(environment.emission_tex);
+      } break;
+      default: break;
+    }
+    return bind_none();
+  }
+
+  // complete the current element with the values not stored directly
+  bool end_element() {
+    if (group == group_type::volumes) {
+      binary_vol.push_back(volume_binary);
+    } else if (group == group_type::sdfunctions) {
+      if (!sdf_typed) return false;
+      auto& sdf = scene.sdfs.back();
+      switch (sdf_kind) {
+        case sdf_type::bbox: {
+          auto thickness = sdf_thickness;
+          auto whd       = sdf_whd;
+          sdf.f          = [thickness, whd](const vec3f& p) {
+            return sd_bbox(p, whd, thickness);
+          };
+        } break;
+        case sdf_type::box: {
+          // sd_box is centered at the origin and takes half sizes
+          sdf.whd = sdf_whd;
+          sdf.f   = [whd = sdf.whd](const vec3f& p) {
+            return sd_box(p - (whd * 0.5f), whd * 0.5f);
+          };
+        } break;
+        case sdf_type::capped_cone: {
+          auto height = sdf_height, r1 = sdf_r1, r2 = sdf_r2;
+          sdf.f = [height, r1, r2](const vec3f& p) {
+            return sd_capped_cone(p, height, r1, r2);
+          };
+        } break;
+        case sdf_type::plane: {
+          sdf.f = [](const vec3f& p) { return sd_plane(p); };
+        } break;
+        case sdf_type::sphere: {
+          auto radius = sdf_radius;
+          sdf.f = [radius](const vec3f& p) { return sd_sphere(p, radius); };
+        } break;
+        case sdf_type::torus: {
+          auto r1 = sdf_r1, r2 = sdf_r2;
+          sdf.f = [r1, r2](const vec3f& p) { return sd_torus(p, r1, r2); };
+        } break;
+        default: return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Load a scene in the builtin JSON format.
+static bool load_json_scene(const string& filename, scene_data& scene,
+    string& error, const function<void(int shape)>& shape_loaded,
+    bool noparallel) {
   // filenames
   auto shape_filenames   = vector<string>{};
   auto volume_filenames  = vector<string>{};
   auto texture_filenames = vector<string>{};
   auto subdiv_filenames  = vector<string>{};
+  auto array_filenames   = vector<string>{};
 
   // bool binary volume file
   auto binary_vol = vector<bool>{};
@@ -3574,224 +4558,43 @@ static bool load_json_scene(
     return false;
   };
 
-  // parsing values
-  try {
-    if (json.contains("asset")) {
-      auto& element = json.at("asset");
-      get_opt(element, "copyright", scene.copyright);
-      auto version = string{};
-      get_opt(element, "version", version);
-      if (version != "4.2" && version != "5.0") return parse_error();
-    }
-    if (json.contains("cameras")) {
-      auto& group = json.at("cameras");
-      scene.cameras.reserve(group.size());
-      scene.camera_names.reserve(group.size());
-      for (auto& element : group) {
-        auto& camera = scene.cameras.emplace_back();
-        auto& name   = scene.camera_names.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "frame", camera.frame);
-        get_opt(element, "orthographic", camera.orthographic);
-        get_opt(element, "lens", camera.lens);
-        get_opt(element, "aspect", camera.aspect);
-        get_opt(element, "film", camera.film);
-        get_opt(element, "focus", camera.focus);
-        get_opt(element, "aperture", camera.aperture);
-      }
-    }
-    if (json.contains("textures")) {
-      auto& group = json.at("textures");
-      scene.textures.reserve(group.size());
-      scene.texture_names.reserve(group.size());
-      texture_filenames.reserve(group.size());
-      for (auto& element : group) {
-        [[maybe_unused]] auto& texture = scene.textures.emplace_back();
-        auto&                  name    = scene.texture_names.emplace_back();
-        auto&                  uri     = texture_filenames.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "uri", uri);
-      }
-    }
-    if (json.contains("materials")) {
-      auto& group = json.at("materials");
-      scene.materials.reserve(group.size());
-      scene.material_names.reserve(group.size());
-      for (auto& element : json.at("materials")) {
-        auto& material = scene.materials.emplace_back();
-        auto& name     = scene.material_names.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "type", material.type);
-        get_opt(element, "emission", material.emission);
-        get_opt(element, "color", material.color);
-        get_opt(element, "metallic", material.metallic);
-        get_opt(element, "roughness", material.roughness);
-        get_opt(element, "ior", material.ior);
-        get_opt(element, "trdepth", material.trdepth);
-        get_opt(element, "scattering", material.scattering);
-        get_opt(element, "scanisotropy", material.scanisotropy);
-        get_opt(element, "opacity", material.opacity);
-        get_opt(element, "emission_tex", material.emission_tex);
-        get_opt(element, "color_tex", material.color_tex);
-        get_opt(element, "roughness_tex", material.roughness_tex);
-        get_opt(element, "scattering_tex", material.scattering_tex);
-        get_opt(element, "normal_tex", material.normal_tex);
-      }
-    }
-    if (json.contains("shapes")) {
-      auto& group = json.at("shapes");
-      scene.shapes.reserve(group.size());
-      scene.shape_names.reserve(group.size());
-      shape_filenames.reserve(group.size());
-      for (auto& element : group) {
-        [[maybe_unused]] auto& shape = scene.shapes.emplace_back();
-        auto&                  name  = scene.shape_names.emplace_back();
-        auto&                  uri   = shape_filenames.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "uri", uri);
-      }
-    }
-    if (json.contains("volumes")) {
-      auto& group = json.at("volumes");
-      scene.volumes.reserve(group.size());
-      scene.volume_names.reserve(group.size());
-      volume_filenames.reserve(group.size());
-      binary_vol.reserve(group.size());
-      for (auto& element : group) {
-        [[maybe_unused]] auto& shape = scene.volumes.emplace_back();
-        auto&                  name  = scene.volume_names.emplace_back();
-        auto&                  uri   = volume_filenames.emplace_back();
-        bool                   binary;
-        get_opt(element, "name", name);
-        get_opt(element, "binary", binary);
-        binary_vol.push_back(binary);
-        get_opt(element, "uri", uri);
-      }
-    }
-    if (json.contains("sdfunctions")) {
-      auto& group = json.at("sdfunctions");
-      scene.sdfs.reserve(group.size());
-      scene.sdfs_names.reserve(group.size());
-      for(auto& element : group) {
-        auto&    sdf      = scene.sdfs.emplace_back();
-        auto&    name     = scene.sdfs_names.emplace_back();
-        sdf_type type;
-        get_opt(element, "name", name);
-        get_opt(element, "type", type);
-        get_opt(element, "frame", sdf.frame);
-        get_opt(element, "material", sdf.material);
-        // Initialize sdfunction
-        switch (type) {
-          case sdf_type::bbox: {
-            float thickness;
-            vec3f whd;
-            get_opt(element, "thickness", thickness);
-            get_opt(element, "whd", whd);
-            sdf.f = [thickness, whd](
-                        const vec3f& p) { return sd_bbox(p, whd, thickness); };
-            break;
-          }
-          case sdf_type::box: {
-            get_opt(element, "whd", sdf.whd);
-            sdf.f = [sdf](const vec3f& p) {
-                // Divide by two because sd_box is designed with origin at the center of the box, size is half width/height/depth
-                return sd_box(p - (sdf.whd * 0.5f), sdf.whd * 0.5f);
-            };
-            break;
-          }
-          case sdf_type::capped_cone: {
-            float height, r1, r2;
-            get_opt(element, "height", height);
-            get_opt(element, "r1", r1);
-            get_opt(element, "r2", r2);
-            sdf.f = [height, r1, r2](const vec3f& p) {
-              return sd_capped_cone(p, height, r1, r2);
-            };
-            break;
-          }
-          case sdf_type::plane: {
-            sdf.f = [](const vec3f& p) { return sd_plane(p); };
-            break;
-          }
-          case sdf_type::sphere: {
-            float radius;
-            get_opt(element, "radius", radius);
-            sdf.f = [radius](const vec3f& p) { return sd_sphere(p, radius); };
-            break;
-          }
-          case sdf_type::torus: {
-            float r1, r2;
-            get_opt(element, "r1", r1);
-            get_opt(element, "r2", r2);
-            sdf.f = [r1, r2](const vec3f& p) { return sd_torus(p, r1, r2); };
-            break;
-          }
-          default: return parse_error();
-        }
-      }
-    }
-    if (json.contains("subdivs")) {
-      auto& group = json.at("subdivs");
-      scene.subdivs.reserve(group.size());
-      scene.subdiv_names.reserve(group.size());
-      subdiv_filenames.reserve(group.size());
-      for (auto& element : group) {
-        auto& subdiv = scene.subdivs.emplace_back();
-        auto& name   = scene.subdiv_names.emplace_back();
-        auto& uri    = subdiv_filenames.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "uri", uri);
-        get_opt(element, "shape", subdiv.shape);
-        get_opt(element, "subdivisions", subdiv.subdivisions);
-        get_opt(element, "catmullclark", subdiv.catmullclark);
-        get_opt(element, "smooth", subdiv.smooth);
-        get_opt(element, "displacement", subdiv.displacement);
-        get_opt(element, "displacement_tex", subdiv.displacement_tex);
-      }
-    }
-    if (json.contains("instances")) {
-      auto& group = json.at("instances");
-      scene.instances.reserve(group.size());
-      scene.instance_names.reserve(group.size());
-      for (auto& element : group) {
-        auto& instance = scene.instances.emplace_back();
-        auto& name     = scene.instance_names.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "frame", instance.frame);
-        get_opt(element, "shape", instance.shape);
-        get_opt(element, "material", instance.material);
-      }
-    }
-    if (json.contains("vol_instances")) {
-      auto& group = json.at("vol_instances");
-      scene.vol_instances.reserve(group.size());
-      scene.vol_instances_names.reserve(group.size());
-      for (auto& element : group) {
-        auto& instance = scene.vol_instances.emplace_back();
-        auto& name     = scene.vol_instances_names.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "frame", instance.frame);
-        get_opt(element, "volume", instance.volume);
-        get_opt(element, "scale", instance.scalef);
-        get_opt(element, "material", instance.material);
-      }
+  // parse the scene while streaming the json text
+  auto text = string{};
+  if (!load_text(filename, text, error)) return false;
+  auto parser = json_scene_parser{scene, shape_filenames, volume_filenames,
+      texture_filenames, subdiv_filenames, array_filenames, binary_vol,
+      count_json_arrays(text)};
+  auto parsed = json_value::sax_parse(text, &parser);
+
+  // older versions are converted from a json value
+  if (parser.version != "4.2" && parser.version != "5.0") {
+    scene     = scene_data{};
+    auto json = json_value{};
+    try {
+      json = json_value::parse(text);
+    } catch (...) {
+      error = filename + ": json parse error";
+      return false;
     }
-    if (json.contains("environments")) {
-      auto& group = json.at("environments");
-      scene.instances.reserve(group.size());
-      scene.instance_names.reserve(group.size());
-      for (auto& element : group) {
-        auto& environment = scene.environments.emplace_back();
-        auto& name        = scene.environment_names.emplace_back();
-        get_opt(element, "name", name);
-        get_opt(element, "frame", environment.frame);
-        get_opt(element, "emission", environment.emission);
-        get_opt(element, "emission_tex", environment.emission_tex);
-      }
+    text = {};
+    if (!json.contains("asset") || !json.at("asset").contains("version")) {
+      if (!load_json_scene_version40(filename, json, scene, error, noparallel))
+        return false;
+    } else if (json.at("asset").at("version") == "4.1") {
+      if (!load_json_scene_version41(filename, json, scene, error, noparallel))
+        return false;
+    } else {
+      return parse_error();
     }
-  } catch (...) {
-    return parse_error();
+    notify_shapes(scene, shape_loaded, noparallel);
+    return true;
   }
+  if (!parsed) {
+    error = filename +
+            (parser.syntax_error ? ": json parse error" : ": parse error");
+    return false;
+  }
+  text = {};
 
   // prepare data
   auto dirname         = path_dirname(filename);
@@ -3800,61 +4603,74 @@ static bool load_json_scene(
     return false;
   };
 
-  // load resources
-  if (noparallel) {
-    // load shapes
-    for (auto idx : range(scene.shapes.size())) {
-      if (!load_shape(path_join(dirname, shape_filenames[idx]),
-              scene.shapes[idx], error, true))
-        return dependent_error();
-    }
-    for(auto idx : range(scene.volumes.size())) {
-      if (!load_volume(path_join(dirname, volume_filenames[idx]),
-              scene.volumes[idx], binary_vol[idx], error))
-        return dependent_error();
+  // load resources as independent tasks, so that no resource type waits for
+  // the slowest file of another type, and largest files first, so that long
+  // loads do not end up alone at the tail
+  enum struct resource_type { shape, volume, subdiv, texture, array };
+  struct resource_task {
+    resource_type type     = resource_type::shape;
+    int           index    = 0;
+    string        filename = "";
+    size_t        size     = 0;
+  };
+  auto resources    = vector<resource_task>{};
+  auto add_resource = [&](resource_type type, int index,
+                          const string& filename) {
+    auto path = path_join(dirname, filename);
+    resources.push_back({type, index, path, path_size(path)});
+  };
+  for (auto idx : range((int)scene.shapes.size()))
+    add_resource(resource_type::shape, idx, shape_filenames[idx]);
+  for (auto idx : range((int)scene.volumes.size()))
+    add_resource(resource_type::volume, idx, volume_filenames[idx]);
+  for (auto idx : range((int)scene.subdivs.size()))
+    add_resource(resource_type::subdiv, idx, subdiv_filenames[idx]);
+  for (auto idx : range((int)scene.textures.size()))
+    add_resource(resource_type::texture, idx, texture_filenames[idx]);
+  for (auto idx : range((int)scene.instance_arrays.size()))
+    add_resource(resource_type::array, idx, array_filenames[idx]);
+  std::stable_sort(resources.begin(), resources.end(),
+      [](const resource_task& a, const resource_task& b) {
+        return a.size > b.size;
+      });
+
+  // load a resource, notifying shapes once they are complete
+  auto load_resource = [&](size_t task, string& error) {
+    auto& resource = resources[task];
+    switch (resource.type) {
+      case resource_type::shape: {
+        auto& shape = scene.shapes[resource.index];
+        if (!load_shape(resource.filename, shape, error, true)) return false;
+        add_missing_radius(shape);
+        if (shape_loaded) shape_loaded(resource.index);
+        return true;
+      }
+      case resource_type::volume:
+        return load_volume(resource.filename, scene.volumes[resource.index],
+            binary_vol[resource.index], error);
+      case resource_type::subdiv:
+        return load_subdiv(
+            resource.filename, scene.subdivs[resource.index], error);
+      case resource_type::texture:
+        return load_texture(
+            resource.filename, scene.textures[resource.index], error);
+      case resource_type::array:
+        return load_instance_array(
+            resource.filename, scene.instance_arrays[resource.index], error);
     }
+    return false;
+  };
 
-    // load subdivs
-    for (auto idx : range(scene.subdivs.size())) {
-      if (!load_subdiv(path_join(dirname, subdiv_filenames[idx]),
-              scene.subdivs[idx], error))
-        return dependent_error();
-    }
-    // load textures
-    for (auto idx : range(scene.textures.size())) {
-      if (!load_texture(path_join(dirname, texture_filenames[idx]),
-              scene.textures[idx], error))
-        return dependent_error();
+  // load resources
+  if (noparallel) {
+    for (auto task : range(resources.size())) {
+      if (!load_resource(task, error)) return dependent_error();
     }
   } else {
-    // load shapes
-    if (!parallel_for(
-            scene.shapes.size(), error, [&](size_t idx, string& error) {
-              return load_shape(path_join(dirname, shape_filenames[idx]),
-                  scene.shapes[idx], error, true);
-            }))
-      return dependent_error();
-    if (!parallel_for(
-            scene.volumes.size(), error, [&](size_t idx, string& error) {
-              return load_volume(path_join(dirname, volume_filenames[idx]),
-                  scene.volumes[idx], binary_vol[idx], error);
-            }))
-        return dependent_error();
-    // load subdivs
-    if (!parallel_for(
-            scene.subdivs.size(), error, [&](size_t idx, string& error) {
-              return load_subdiv(path_join(dirname, subdiv_filenames[idx]),
-                  scene.subdivs[idx], error);
-            }))
-      return dependent_error();
-    // load textures
-    if (!parallel_for(
-            scene.textures.size(), error, [&](size_t idx, string& error) {
-              return load_texture(path_join(dirname, texture_filenames[idx]),
-                  scene.textures[idx], error);
-            }))
+    if (!parallel_for(resources.size(), error, load_resource))
       return dependent_error();
   }
+
   // fix scene
   add_missing_camera(scene);
   add_missing_radius(scene);
@@ -3914,6 +4730,7 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
   auto shape_filenames   = vector<string>(scene.shapes.size());
   auto texture_filenames = vector<string>(scene.textures.size());
   auto subdiv_filenames  = vector<string>(scene.subdivs.size());
+  auto array_filenames   = vector<string>(scene.instance_arrays.size());
   for (auto idx : range(shape_filenames.size())) {
     shape_filenames[idx] = get_filename(
         scene.shape_names, idx, "shape", ".ply");
@@ -3926,6 +4743,10 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
     subdiv_filenames[idx] = get_filename(
         scene.subdiv_names, idx, "subdiv", ".obj");
   }
+  for (auto idx : range(array_filenames.size())) {
+    array_filenames[idx] = get_filename(
+        scene.instance_array_names, idx, "instance_array", ".yinst");
+  }
 
   // save json file
   auto json = json_value::object();
@@ -4040,6 +4861,19 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
     }
   }
 
+  if (!scene.instance_arrays.empty()) {
+    auto  default_ = instance_array_data{};
+    auto& group    = add_array(json, "instance_arrays");
+    reserve_values(group, scene.instance_arrays.size());
+    for (auto&& [idx, array] : enumerate(scene.instance_arrays)) {
+      auto& element = append_object(group);
+      set_val(element, "name", get_name(scene.instance_array_names, idx), "");
+      set_val(element, "shape", array.shape, default_.shape);
+      set_val(element, "material", array.material, default_.material);
+      set_val(element, "uri", array_filenames[idx], "");
+    }
+  }
+
   if (!scene.environments.empty()) {
     auto  default_ = environment_data{};
     auto& group    = add_array(json, "environments");
@@ -4084,6 +4918,12 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
               scene.textures[idx], error))
         return dependent_error();
     }
+    // save instance arrays
+    for (auto idx : range(scene.instance_arrays.size())) {
+      if (!save_instance_array(path_join(dirname, array_filenames[idx]),
+              scene.instance_arrays[idx], error))
+        return dependent_error();
+    }
   } else {
     // save shapes
     if (!parallel_for(scene.shapes.size(), error, [&](auto idx, string& error) {
@@ -4105,6 +4945,14 @@ static bool save_json_scene(const string& filename, const scene_data& scene,
                   scene.textures[idx], error);
             }))
       return dependent_error();
+    // save instance arrays
+    if (!parallel_for(scene.instance_arrays.size(), error,
+            [&](auto idx, string& error) {
+              return save_instance_array(
+                  path_join(dirname, array_filenames[idx]),
+                  scene.instance_arrays[idx], error);
+            }))
+      return dependent_error();
   }
 
   // done
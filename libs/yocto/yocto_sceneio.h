@@ -38,6 +38,7 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <functional>
 #include <string>
 
 #include "yocto_scene.h"
@@ -51,6 +52,7 @@
 namespace yocto {
 
 // using directives
+using std::function;
 using std::string;
 
 }  // namespace yocto
@@ -146,7 +148,9 @@ fvshape_data make_fvshape_preset(const string& type);
 
 bool load_volume(const string& filename, volume<float>& vol, bool binary, string& error);
 
-// Load/save a shape
+// Load/save a shape. Besides ply, obj and stl, shapes can be stored in the
+// binary .yshape format, that holds the shape arrays as they are in memory,
+// including compressed vertex data, and loads without parsing.
 bool load_shape(const string& filename, shape_data& shape, string& error,
     bool flip_texcoords = true);
 bool save_shape(const string& filename, const shape_data& shape, string& error,
@@ -182,6 +186,21 @@ bool save_subdiv(
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// INSTANCE ARRAY IO
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Load/save an instance array. Besides ply, instance arrays can be stored in
+// the binary .yinst format, that holds the frames and colors as they are in
+// memory and loads them with a single read each.
+bool load_instance_array(
+    const string& filename, instance_array_data& array, string& error);
+bool save_instance_array(const string& filename,
+    const instance_array_data& array, string& error);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // SCENE IO
 // -----------------------------------------------------------------------------
@@ -208,6 +227,12 @@ io_status add_environment(scene_data& scene, const string& filename);
 // Load/save a scene in the supported formats.
 bool load_scene(const string& filename, scene_data& scene, string& error,
     bool noparallel = false);
+
+// Load a scene calling `shape_loaded` with the index of each shape as soon as
+// it is loaded, so that per-shape work can overlap loading the rest of the
+// scene. The callback may be called concurrently from the loading threads.
+bool load_scene(const string& filename, scene_data& scene, string& error,
+    const function<void(int shape)>& shape_loaded, bool noparallel = false);
 bool save_scene(const string& filename, const scene_data& scene, string& error,
     bool noparallel = false);
 
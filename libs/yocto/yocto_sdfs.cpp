@@ -16,7 +16,7 @@ sdf_result eval_sdf_scene(const scene_data& scene, const vec3f& p, float t) {
   }
 
   // Evaluate sdf from function
-  for (auto& [idx, sdfunc] : enumerate(scene.sdfs)) {
+  for (const auto& [idx, sdfunc] : enumerate(scene.sdfs)) {
     auto sdf = sdfunc.f(transform_point(sdfunc.frame, p));
     // keep the sdf with min distance
     if (sdf < res.result) res = {sdf, invalidid, (int)idx};
@@ -936,6 +936,7 @@ inline float sample_refractive_pdf(const vec3f& color, float ior,
     return (1 - fresnel_dielectric(rel_ior, halfway, outgoing)) *
            sample_microfacet_pdf(roughness, up_normal, halfway) *
            //  sample_microfacet_pdf(roughness, up_normal, halfway, outgoing) /
+           rel_ior * rel_ior *
            abs(dot(halfway, incoming)) /  // here we use incoming as from pbrt
            pow(rel_ior * dot(halfway, incoming) + dot(halfway, outgoing), 2);
   }
@@ -63,42 +63,43 @@ namespace yocto {
 vec3f eval_position(const shape_data& shape, int element, const vec2f& uv) {
   if (!shape.points.empty()) {
     auto& point = shape.points[element];
-    return shape.positions[point];
+    return get_position(shape, point);
   } else if (!shape.lines.empty()) {
     auto& line = shape.lines[element];
     return interpolate_line(
-        shape.positions[line.x], shape.positions[line.y], uv.x);
+        get_position(shape, line.x), get_position(shape, line.y), uv.x);
   } else if (!shape.triangles.empty()) {
     auto& triangle = shape.triangles[element];
-    return interpolate_triangle(shape.positions[triangle.x],
-        shape.positions[triangle.y], shape.positions[triangle.z], uv);
+    return interpolate_triangle(get_position(shape, triangle.x),
+        get_position(shape, triangle.y), get_position(shape, triangle.z), uv);
   } else if (!shape.quads.empty()) {
     auto& quad = shape.quads[element];
-    return interpolate_quad(shape.positions[quad.x], shape.positions[quad.y],
-        shape.positions[quad.z], shape.positions[quad.w], uv);
+    return interpolate_quad(get_position(shape, quad.x),
+        get_position(shape, quad.y), get_position(shape, quad.z),
+        get_position(shape, quad.w), uv);
   } else {
     return {0, 0, 0};
   }
 }
 
 vec3f eval_normal(const shape_data& shape, int element, const vec2f& uv) {
-  if (shape.normals.empty()) return eval_element_normal(shape, element);
+  if (!has_normals(shape)) return eval_element_normal(shape, element);
   if (!shape.points.empty()) {
     auto& point = shape.points[element];
-    return normalize(shape.normals[point]);
+    return normalize(get_normal(shape, point));
   } else if (!shape.lines.empty()) {
     auto& line = shape.lines[element];
-    return normalize(
-        interpolate_line(shape.normals[line.x], shape.normals[line.y], uv.x));
+    return normalize(interpolate_line(
+        get_normal(shape, line.x), get_normal(shape, line.y), uv.x));
   } else if (!shape.triangles.empty()) {
     auto& triangle = shape.triangles[element];
-    return normalize(interpolate_triangle(shape.normals[triangle.x],
-        shape.normals[triangle.y], shape.normals[triangle.z], uv));
+    return normalize(interpolate_triangle(get_normal(shape, triangle.x),
+        get_normal(shape, triangle.y), get_normal(shape, triangle.z), uv));
   } else if (!shape.quads.empty()) {
     auto& quad = shape.quads[element];
     return normalize(
-        interpolate_quad(shape.normals[quad.x], shape.normals[quad.y],
-            shape.normals[quad.z], shape.normals[quad.w], uv));
+        interpolate_quad(get_normal(shape, quad.x), get_normal(shape, quad.y),
+            get_normal(shape, quad.z), get_normal(shape, quad.w), uv));
   } else {
     return {0, 0, 1};
   }
@@ -109,22 +110,23 @@ vec3f eval_tangent(const shape_data& shape, int element, const vec2f& uv) {
 }
 
 vec2f eval_texcoord(const shape_data& shape, int element, const vec2f& uv) {
-  if (shape.texcoords.empty()) return uv;
+  if (!has_texcoords(shape)) return uv;
   if (!shape.points.empty()) {
     auto& point = shape.points[element];
-    return shape.texcoords[point];
+    return get_texcoord(shape, point);
   } else if (!shape.lines.empty()) {
     auto& line = shape.lines[element];
     return interpolate_line(
-        shape.texcoords[line.x], shape.texcoords[line.y], uv.x);
+        get_texcoord(shape, line.x), get_texcoord(shape, line.y), uv.x);
   } else if (!shape.triangles.empty()) {
     auto& triangle = shape.triangles[element];
-    return interpolate_triangle(shape.texcoords[triangle.x],
-        shape.texcoords[triangle.y], shape.texcoords[triangle.z], uv);
+    return interpolate_triangle(get_texcoord(shape, triangle.x),
+        get_texcoord(shape, triangle.y), get_texcoord(shape, triangle.z), uv);
   } else if (!shape.quads.empty()) {
     auto& quad = shape.quads[element];
-    return interpolate_quad(shape.texcoords[quad.x], shape.texcoords[quad.y],
-        shape.texcoords[quad.z], shape.texcoords[quad.w], uv);
+    return interpolate_quad(get_texcoord(shape, quad.x),
+        get_texcoord(shape, quad.y), get_texcoord(shape, quad.z),
+        get_texcoord(shape, quad.w), uv);
   } else {
     return uv;
   }
@@ -178,15 +180,16 @@ vec3f eval_element_normal(const shape_data& shape, int element) {
     return {0, 0, 1};
   } else if (!shape.lines.empty()) {
     auto& line = shape.lines[element];
-    return line_tangent(shape.positions[line.x], shape.positions[line.y]);
+    return line_tangent(
+        get_position(shape, line.x), get_position(shape, line.y));
   } else if (!shape.triangles.empty()) {
     auto& triangle = shape.triangles[element];
-    return triangle_normal(shape.positions[triangle.x],
-        shape.positions[triangle.y], shape.positions[triangle.z]);
+    return triangle_normal(get_position(shape, triangle.x),
+        get_position(shape, triangle.y), get_position(shape, triangle.z));
   } else if (!shape.quads.empty()) {
     auto& quad = shape.quads[element];
-    return quad_normal(shape.positions[quad.x], shape.positions[quad.y],
-        shape.positions[quad.z], shape.positions[quad.w]);
+    return quad_normal(get_position(shape, quad.x), get_position(shape, quad.y),
+        get_position(shape, quad.z), get_position(shape, quad.w));
   } else {
     return {0, 0, 0};
   }
@@ -222,30 +225,30 @@ void compute_normals(vector<vec3f>& normals, const shape_data& shape) {
 
 // Shape sampling
 vector<float> sample_shape_cdf(const shape_data& shape) {
-  if (!shape.points.empty()) {
-    return sample_points_cdf((int)shape.points.size());
-  } else if (!shape.lines.empty()) {
-    return sample_lines_cdf(shape.lines, shape.positions);
-  } else if (!shape.triangles.empty()) {
-    return sample_triangles_cdf(shape.triangles, shape.positions);
-  } else if (!shape.quads.empty()) {
-    return sample_quads_cdf(shape.quads, shape.positions);
-  } else {
-    return sample_points_cdf((int)shape.positions.size());
-  }
+  auto cdf = vector<float>{};
+  sample_shape_cdf(cdf, shape);
+  return cdf;
 }
 
 void sample_shape_cdf(vector<float>& cdf, const shape_data& shape) {
+  // element areas of compressed shapes use decoded positions
+  auto decoded = vector<vec3f>{};
+  if (is_compressed(shape)) {
+    decoded.resize(num_vertices(shape));
+    for (auto idx = 0; idx < (int)decoded.size(); idx++)
+      decoded[idx] = get_position(shape, idx);
+  }
+  auto& positions = is_compressed(shape) ? decoded : shape.positions;
   if (!shape.points.empty()) {
     sample_points_cdf(cdf, (int)shape.points.size());
   } else if (!shape.lines.empty()) {
-    sample_lines_cdf(cdf, shape.lines, shape.positions);
+    sample_lines_cdf(cdf, shape.lines, positions);
   } else if (!shape.triangles.empty()) {
-    sample_triangles_cdf(cdf, shape.triangles, shape.positions);
+    sample_triangles_cdf(cdf, shape.triangles, positions);
   } else if (!shape.quads.empty()) {
-    sample_quads_cdf(cdf, shape.quads, shape.positions);
+    sample_quads_cdf(cdf, shape.quads, positions);
   } else {
-    sample_points_cdf(cdf, (int)shape.positions.size());
+    sample_points_cdf(cdf, (int)positions.size());
   }
 }
 
@@ -390,6 +393,106 @@ vector<string> shape_stats(const shape_data& shape, bool verbose) {
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF COMPRESSED SHAPE DATA
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Quantize a value to 16 bits in [min, min + 65535 * scale]
+static ushort quantize_unorm16(float value, float min, float scale) {
+  if (scale <= 0) return 0;
+  return (ushort)clamp((value - min) / scale + 0.5f, 0.0f, 65535.0f);
+}
+
+// Octahedral encoding of a direction
+static array<short, 2> encode_octahedral(const vec3f& normal) {
+  auto norm = abs(normal.x) + abs(normal.y) + abs(normal.z);
+  if (norm == 0) return {0, 0};
+  auto oct = vec2f{normal.x, normal.y} / norm;
+  if (normal.z < 0) {
+    oct = {(1 - abs(oct.y)) * (oct.x >= 0 ? 1 : -1),
+        (1 - abs(oct.x)) * (oct.y >= 0 ? 1 : -1)};
+  }
+  auto snorm16 = [](float value) -> short {
+    value = clamp(value, -1.0f, 1.0f) * 32767;
+    return (short)(value >= 0 ? value + 0.5f : value - 0.5f);
+  };
+  return {snorm16(oct.x), snorm16(oct.y)};
+}
+
+// Compress vertex data
+void compress_shape(shape_data& shape) {
+  if (is_compressed(shape) || shape.positions.empty()) return;
+
+  // positions
+  auto pbbox = invalidb3f;
+  for (auto& position : shape.positions) pbbox = merge(pbbox, position);
+  shape.qposition_min   = pbbox.min;
+  shape.qposition_scale = (pbbox.max - pbbox.min) / 65535;
+  shape.qpositions.resize(shape.positions.size());
+  for (auto idx = 0; idx < (int)shape.positions.size(); idx++) {
+    auto& position = shape.positions[idx];
+    auto& min      = shape.qposition_min;
+    auto& scale    = shape.qposition_scale;
+    shape.qpositions[idx] = {quantize_unorm16(position.x, min.x, scale.x),
+        quantize_unorm16(position.y, min.y, scale.y),
+        quantize_unorm16(position.z, min.z, scale.z)};
+  }
+  shape.positions = vector<vec3f>{};
+
+  // normals
+  shape.qnormals.resize(shape.normals.size());
+  for (auto idx = 0; idx < (int)shape.normals.size(); idx++) {
+    shape.qnormals[idx] = encode_octahedral(shape.normals[idx]);
+  }
+  shape.normals = vector<vec3f>{};
+
+  // texcoords
+  auto tmin = vec2f{flt_max, flt_max}, tmax = vec2f{-flt_max, -flt_max};
+  for (auto& texcoord : shape.texcoords) {
+    tmin = min(tmin, texcoord);
+    tmax = max(tmax, texcoord);
+  }
+  shape.qtexcoord_min   = shape.texcoords.empty() ? vec2f{0, 0} : tmin;
+  shape.qtexcoord_scale = shape.texcoords.empty() ? vec2f{0, 0}
+                                                  : (tmax - tmin) / 65535;
+  shape.qtexcoords.resize(shape.texcoords.size());
+  for (auto idx = 0; idx < (int)shape.texcoords.size(); idx++) {
+    auto& texcoord = shape.texcoords[idx];
+    auto& min      = shape.qtexcoord_min;
+    auto& scale    = shape.qtexcoord_scale;
+    shape.qtexcoords[idx] = {quantize_unorm16(texcoord.x, min.x, scale.x),
+        quantize_unorm16(texcoord.y, min.y, scale.y)};
+  }
+  shape.texcoords = vector<vec2f>{};
+}
+
+// Decompress vertex data
+void decompress_shape(shape_data& shape) {
+  if (!is_compressed(shape)) return;
+  shape.positions.resize(shape.qpositions.size());
+  for (auto idx = 0; idx < (int)shape.positions.size(); idx++) {
+    shape.positions[idx] = get_position(shape, idx);
+  }
+  shape.normals.resize(shape.qnormals.size());
+  for (auto idx = 0; idx < (int)shape.normals.size(); idx++) {
+    shape.normals[idx] = get_normal(shape, idx);
+  }
+  shape.texcoords.resize(shape.qtexcoords.size());
+  for (auto idx = 0; idx < (int)shape.texcoords.size(); idx++) {
+    shape.texcoords[idx] = get_texcoord(shape, idx);
+  }
+  shape.qpositions      = vector<array<ushort, 3>>{};
+  shape.qnormals        = vector<array<short, 2>>{};
+  shape.qtexcoords      = vector<array<ushort, 2>>{};
+  shape.qposition_min   = {0, 0, 0};
+  shape.qposition_scale = {0, 0, 0};
+  shape.qtexcoord_min   = {0, 0};
+  shape.qtexcoord_scale = {0, 0};
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR FVSHAPE PROPERTIES
 // -----------------------------------------------------------------------------
@@ -85,6 +85,16 @@ struct shape_data {
   vector<vec4f> colors    = {};
   vector<float> radius    = {};
   vector<vec4f> tangents  = {};
+
+  // compressed vertex data, replacing positions, normals and texcoords
+  // after compress_shape()
+  vector<array<ushort, 3>> qpositions      = {};
+  vector<array<short, 2>>  qnormals        = {};
+  vector<array<ushort, 2>> qtexcoords      = {};
+  vec3f                    qposition_min   = {0, 0, 0};
+  vec3f                    qposition_scale = {0, 0, 0};
+  vec2f                    qtexcoord_min   = {0, 0};
+  vec2f                    qtexcoord_scale = {0, 0};
 };
 
 // Interpolate vertex data
@@ -129,6 +139,33 @@ vector<string> shape_stats(const shape_data& shape, bool verbose = false);
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// COMPRESSED SHAPE DATA
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Compress positions, normals and texcoords, roughly halving vertex memory.
+// Positions and texcoords are quantized to 16 bits within their bounds and
+// normals are octahedral encoded in 32 bits. Each vertex is decoded the same
+// way by all elements that share it, so meshes stay watertight. Compressed
+// shapes can be evaluated, sampled and intersected, but need to be
+// decompressed before editing or saving them.
+void compress_shape(shape_data& shape);
+void decompress_shape(shape_data& shape);
+
+// Check for compressed or missing vertex data
+inline bool is_compressed(const shape_data& shape);
+inline bool has_normals(const shape_data& shape);
+inline bool has_texcoords(const shape_data& shape);
+
+// Vertex data of either plain or compressed shapes
+inline int   num_vertices(const shape_data& shape);
+inline vec3f get_position(const shape_data& shape, int vertex);
+inline vec3f get_normal(const shape_data& shape, int vertex);
+inline vec2f get_texcoord(const shape_data& shape, int vertex);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // FACE-VARYING SHAPE DATA AND UTILITIES
 // -----------------------------------------------------------------------------
@@ -965,6 +1002,53 @@ void make_heightfield(vector<vec4i>& quads, vector<vec3f>& positions,
 //
 // -----------------------------------------------------------------------------
 
+// -----------------------------------------------------------------------------
+// COMPRESSED SHAPE DATA
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Check for compressed or missing vertex data
+inline bool is_compressed(const shape_data& shape) {
+  return !shape.qpositions.empty();
+}
+inline bool has_normals(const shape_data& shape) {
+  return !shape.normals.empty() || !shape.qnormals.empty();
+}
+inline bool has_texcoords(const shape_data& shape) {
+  return !shape.texcoords.empty() || !shape.qtexcoords.empty();
+}
+
+// Vertex data of either plain or compressed shapes
+inline int num_vertices(const shape_data& shape) {
+  return is_compressed(shape) ? (int)shape.qpositions.size()
+                              : (int)shape.positions.size();
+}
+inline vec3f get_position(const shape_data& shape, int vertex) {
+  if (shape.qpositions.empty()) return shape.positions[vertex];
+  auto& q = shape.qpositions[vertex];
+  return shape.qposition_min +
+         shape.qposition_scale * vec3f{(float)q[0], (float)q[1], (float)q[2]};
+}
+inline vec3f get_normal(const shape_data& shape, int vertex) {
+  if (shape.qnormals.empty()) return shape.normals[vertex];
+  // octahedral decoding
+  auto& q      = shape.qnormals[vertex];
+  auto  normal = vec3f{q[0] / 32767.0f, q[1] / 32767.0f, 0};
+  normal.z     = 1 - abs(normal.x) - abs(normal.y);
+  auto fold    = max(-normal.z, 0.0f);
+  normal.x += normal.x >= 0 ? -fold : fold;
+  normal.y += normal.y >= 0 ? -fold : fold;
+  return normalize(normal);
+}
+inline vec2f get_texcoord(const shape_data& shape, int vertex) {
+  if (shape.qtexcoords.empty()) return shape.texcoords[vertex];
+  auto& q = shape.qtexcoords[vertex];
+  return shape.qtexcoord_min +
+         shape.qtexcoord_scale * vec2f{(float)q[0], (float)q[1]};
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // SHAPE SUBDIVISION
 // -----------------------------------------------------------------------------
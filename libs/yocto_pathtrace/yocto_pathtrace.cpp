@@ -29,13 +29,20 @@
 #include "yocto_pathtrace.h"
 
 #include <yocto/yocto_cli.h>
+#include <yocto/yocto_color.h>
 #include <yocto/yocto_geometry.h>
 #include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_sdfs.h>
 #include <yocto/yocto_shading.h>
 #include <yocto/yocto_shape.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR PATH TRACING
 // -----------------------------------------------------------------------------
@@ -44,42 +51,160 @@ namespace yocto {
 // Convenience functions
 [[maybe_unused]] static vec3f eval_position(
     const scene_data& scene, const bvh_intersection& intersection) {
-  return eval_position(scene, scene.instances[intersection.instance],
+  return eval_position(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static vec3f eval_normal(
     const scene_data& scene, const bvh_intersection& intersection) {
-  return eval_normal(scene, scene.instances[intersection.instance],
+  return eval_normal(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static vec3f eval_element_normal(
     const scene_data& scene, const bvh_intersection& intersection) {
   return eval_element_normal(
-      scene, scene.instances[intersection.instance], intersection.element);
+      scene, get_instance(scene, intersection), intersection.element);
 }
 [[maybe_unused]] static vec3f eval_shading_position(const scene_data& scene,
     const bvh_intersection& intersection, const vec3f& outgoing) {
-  return eval_shading_position(scene, scene.instances[intersection.instance],
+  return eval_shading_position(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv, outgoing);
 }
 [[maybe_unused]] static vec3f eval_shading_normal(const scene_data& scene,
     const bvh_intersection& intersection, const vec3f& outgoing) {
-  return eval_shading_normal(scene, scene.instances[intersection.instance],
+  return eval_shading_normal(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv, outgoing);
 }
 [[maybe_unused]] static vec2f eval_texcoord(
     const scene_data& scene, const bvh_intersection& intersection) {
-  return eval_texcoord(scene, scene.instances[intersection.instance],
+  return eval_texcoord(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static material_point eval_material(
     const scene_data& scene, const bvh_intersection& intersection) {
-  return eval_material(scene, scene.instances[intersection.instance],
+  auto material = eval_material(scene, get_instance(scene, intersection),
       intersection.element, intersection.uv);
+  auto color = get_instance_color(scene, intersection);
+  material.color *= xyz(color);
+  material.opacity *= color.w;
+  return material;
+}
+[[maybe_unused]] static shading_point eval_shading_point(
+    const scene_data& scene, const bvh_intersection& intersection,
+    const vec3f& outgoing) {
+  auto point = eval_shading_point(scene, get_instance(scene, intersection),
+      intersection.element, intersection.uv, outgoing);
+  auto color = get_instance_color(scene, intersection);
+  point.material.color *= xyz(color);
+  point.material.opacity *= color.w;
+  return point;
 }
 [[maybe_unused]] static bool is_volumetric(
     const scene_data& scene, const bvh_intersection& intersection) {
-  return is_volumetric(scene, scene.instances[intersection.instance]);
+  return is_volumetric(scene, get_instance(scene, intersection));
+}
+
+// Check if a hit is on an isolated instance
+static bool is_isolated(
+    const pathtrace_lights& lights, const bvh_intersection& intersection) {
+  return intersection.group < 0 &&
+         intersection.instance < (int)lights.isolated.size() &&
+         lights.isolated[intersection.instance];
+}
+
+// Opacity of a hit, as in eval_material(), but evaluating only the textures
+// and colors that modulate it, and skipping textures of opaque materials.
+static float eval_opacity(const scene_data& scene,
+    const pathtrace_lights& lights, const bvh_intersection& intersection) {
+  auto  instance = get_instance(scene, intersection);
+  auto& material = scene.materials[instance.material];
+  auto  opacity  = material.opacity;
+  if (material.color_tex != invalidid &&
+      lights.transparent[instance.material]) {
+    auto texcoord = eval_texcoord(
+        scene, instance, intersection.element, intersection.uv);
+    opacity *= eval_texture(scene, material.color_tex, texcoord, true).w;
+  }
+  if (!scene.shapes[instance.shape].colors.empty()) {
+    opacity *= eval_color(
+        scene, instance, intersection.element, intersection.uv)
+                   .w;
+  }
+  return opacity * get_instance_color(scene, intersection).w;
+}
+
+// Random number of a hit, hashing the hit with a seed, so that the same hit
+// always gets the same number.
+static float rand_hit(uint64_t seed, const bvh_intersection& intersection) {
+  auto hash = [](uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  };
+  auto distance = uint32_t{0};
+  std::memcpy(&distance, &intersection.distance, sizeof(distance));
+  auto key = hash(seed ^ (uint32_t)intersection.instance);
+  key      = hash(key ^ (uint32_t)intersection.element ^
+             ((uint64_t)(uint32_t)intersection.group << 32));
+  key      = hash(key ^ distance);
+  return (float)(key >> 40) / (float)(1 << 24);
+}
+
+// Intersect a ray with the scene, skipping transparent surfaces during
+// traversal. Surfaces are kept with probability equal to their opacity,
+// with random numbers hashed from a seed that is drawn from the path rng
+// at the first transparent surface, since traversal may test a hit more
+// than once. Rays that meet only opaque surfaces draw no random numbers,
+// and in opaque scenes hits are not filtered at all.
+// If an instance is given, the ray is intersected with it alone first, and
+// with the scene only if it misses, as for rays inside closed media.
+static bvh_intersection intersect_opaque_bvh(const bvh_data& bvh,
+    const scene_data& scene, const pathtrace_lights& lights, int instance,
+    const ray3f& ray, rng_state& rng) {
+  if (lights.opaque) {
+    if (instance != invalidid) {
+      auto intersection = intersect_bvh(bvh, scene, instance, ray);
+      if (intersection.hit) return intersection;
+    }
+    return intersect_bvh(bvh, scene, ray);
+  }
+  auto seed   = (uint64_t)0;
+  auto seeded = false;
+  auto filter = [&](const bvh_intersection& candidate) {
+    auto opacity = eval_opacity(scene, lights, candidate);
+    if (opacity >= 1) return true;
+    if (!seeded) {
+      seed   = (uint64_t)rand1i(rng, int_max);
+      seeded = true;
+    }
+    return rand_hit(seed, candidate) < opacity;
+  };
+  if (instance != invalidid) {
+    auto intersection = intersect_bvh(
+        bvh, scene, instance, ray, false, true, std::ref(filter));
+    if (intersection.hit) return intersection;
+  }
+  return intersect_bvh(bvh, scene, ray, false, true, std::ref(filter));
+}
+static bvh_intersection intersect_opaque_bvh(const bvh_data& bvh,
+    const scene_data& scene, const pathtrace_lights& lights, const ray3f& ray,
+    rng_state& rng) {
+  return intersect_opaque_bvh(bvh, scene, lights, invalidid, ray, rng);
+}
+
+// Per-thread hot-path counters
+#ifdef YOCTO_STATS
+static auto pathtrace_thread_stats = thread_stats<pathtrace_stats>{};
+#endif
+
+// Update the statistics of the calling thread
+static inline void update_pathtrace_stats(
+    uint64_t bounces, uint64_t spheretrace_steps, uint64_t lightpdf_rays) {
+#ifdef YOCTO_STATS
+  auto& stats = pathtrace_thread_stats.local();
+  stats.bounces += bounces;
+  stats.spheretrace_steps += spheretrace_steps;
+  stats.lightpdf_rays += lightpdf_rays;
+#endif
 }
 
 // Evaluates/sample the BRDF scaled by the cosine of the incoming direction.
@@ -256,13 +381,6 @@ static float sample_scattering_pdf(const material_point& material,
 
 // --- SDF ---
 
-struct spheretrace_result {
-  bool  hit      = false;       // did spheretrace hit something?
-  float dist     = flt_max;     // ray distance
-  int   instance = invalidid;   // Hitted instance (sdf grid)
-  int   sdf      = invalidid;   // Hitted signed distance function
-};
-
 // Spheretrace only on a specific signed distance function (used in MIS)
 spheretrace_result spheretrace(
     const scene_data& scene, const ray3f& ray, int sdf_handle, int maxiter) {
@@ -270,18 +388,20 @@ spheretrace_result spheretrace(
   auto sdf = scene.sdfs[sdf_handle];
   // Limit iterations to maxiter (avoid almost infinite while loops)
   // Maxiter can be tuned (good value: 200)
-  for (int i = 0; i < maxiter && t < ray.tmax; ++i) {
-    if (t >= ray.tmax) return {};
+  auto i = 0;
+  for (; i < maxiter && t < ray.tmax; ++i) {
     const auto& p   = ray_point(ray, t);
     // Obtain distance by evaluating sdf
     auto        res = sdf.f(transform_point(sdf.frame, p));
     // Check if distance is "near" zero ==> hit
     if (abs(res) < (flt_eps * t)) {
+      update_pathtrace_stats(0, i + 1, 0);
       return {true, t, invalidid, sdf_handle};
     }
     // Increate t by distance
     t += res;
   }
+  update_pathtrace_stats(0, i, 0);
   return {};
 }
 
@@ -291,18 +411,20 @@ spheretrace_result spheretrace(
   auto t = ray.tmin;
   // Limit iterations to maxiter (avoid almost infinite while loops)
   // Maxiter can be tuned (good value: 200)
-  for (int i = 0; i < maxiter && t < ray.tmax; ++i) {
-    if (t >= ray.tmax) return {};
+  auto i = 0;
+  for (; i < maxiter && t < ray.tmax; ++i) {
     const auto& p   = ray_point(ray, t);
     // Obtain distance to closer object
     auto        res = eval_sdf_scene(scene, p, t);
     // If distance is "near" zero ==> hit
     if (abs(res.result) < (flt_eps * t)) {
+      update_pathtrace_stats(0, i + 1, 0);
       return {true, t, res.instance, res.sdf};
     }
     // Otherwise increase t by distance
     t += res.result;
   }
+  update_pathtrace_stats(0, i, 0);
   return {};
 }
 
@@ -316,7 +438,7 @@ static vec3f sample_lights(const scene_data& scene,
   auto& light    = lights.lights[light_id];
   // Sample mesh
   if (light.instance != invalidid) {
-    auto& instance  = scene.instances[light.instance];
+    auto  instance  = get_instance(scene, light.instance);
     auto& shape     = scene.shapes[instance.shape];
     auto  element   = sample_discrete(light.elements_cdf, rel);
     auto  uv        = (!shape.triangles.empty()) ? sample_triangle(ruv) : ruv;
@@ -356,13 +478,14 @@ static float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
   auto pdf = 0.0f;
   for (auto& light : lights.lights) {
     if (light.instance != invalidid) {
-      auto& instance = scene.instances[light.instance];
+      auto instance = get_instance(scene, light.instance);
       // check all intersection
       auto lpdf          = 0.0f;
       auto next_position = position;
       for (auto bounce = 0; bounce < 100; bounce++) {
         auto intersection = intersect_bvh(
             bvh, scene, light.instance, {next_position, direction});
+        update_pathtrace_stats(0, 0, 1);
         if (!intersection.hit) break;
         // accumulate pdf
         auto lposition = eval_position(
@@ -384,6 +507,7 @@ static float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
       const auto& sdf          = scene.sdfs[light.sdf];
       auto        intersection = spheretrace(
           scene, ray, light.sdf, spheretrace_maxiter);
+      update_pathtrace_stats(0, 0, 1);
       if (intersection.hit) {
         vec3f lposition = ray_point(ray, intersection.dist);
         vec3f lnormal   = eval_sdf_normal(
@@ -420,19 +544,311 @@ static float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
   return pdf;
 }
 
+// Fraction of the directions sampled from the guiding trees, once trained
+static const auto guiding_fraction = 0.5f;
+
+// Map a direction to the unit square with the cylindrical mapping
+static vec2f guiding_square(const vec3f& direction) {
+  auto phi = atan2(direction.y, direction.x);
+  if (phi < 0) phi += 2 * pif;
+  return {clamp((direction.z + 1) / 2, 0.0f, 1.0f),
+      clamp(phi / (2 * pif), 0.0f, 1.0f)};
+}
+static vec3f guiding_direction(const vec2f& uv) {
+  auto cos_theta = 2 * uv.x - 1;
+  auto sin_theta = sqrt(max(1 - cos_theta * cos_theta, 0.0f));
+  auto phi       = 2 * pif * uv.y;
+  return {sin_theta * cos(phi), sin_theta * sin(phi), cos_theta};
+}
+
+// Quadrant of a point in a directional tree node, mapping the point to it
+static int guiding_quadrant(vec2f& uv) {
+  auto x = uv.x >= 0.5f ? 1 : 0, y = uv.y >= 0.5f ? 1 : 0;
+  uv     = {min(uv.x * 2 - x, 1.0f), min(uv.y * 2 - y, 1.0f)};
+  return x + 2 * y;
+}
+
+// Radiance of a directional tree node
+static float guiding_sum(const guiding_dnode& node) {
+  return node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+}
+
+// Sample a directional tree, descending it by picking quadrants with
+// probability proportional to their radiance, first along x then along y,
+// reusing the random numbers. Quadrants with no radiance are never picked,
+// and nodes with no radiance are sampled uniformly.
+static vec3f sample_dtree(const guiding_dtree& dtree, const vec2f& ruv) {
+  auto r      = ruv;
+  auto origin = vec2f{0, 0};
+  auto size   = 1.0f;
+  auto node   = 0;
+  while (true) {
+    auto& sums = dtree.nodes[node].sums;
+    auto  sum  = guiding_sum(dtree.nodes[node]);
+    if (sum <= 0) break;
+    auto left  = sums[0] + sums[2];
+    auto right = sums[1] + sums[3];
+    auto x     = r.x * sum < left || right <= 0 ? 0 : 1;
+    r.x        = x == 0 ? r.x * sum / left : (r.x * sum - left) / right;
+    auto bottom = sums[x];
+    auto top    = sums[x + 2];
+    auto y      = r.y * (bottom + top) < bottom || top <= 0 ? 0 : 1;
+    r.y         = y == 0 ? r.y * (bottom + top) / bottom
+                         : (r.y * (bottom + top) - bottom) / top;
+    r           = clamp(r, 0.0f, 1.0f);
+    size /= 2;
+    origin += vec2f{x * size, y * size};
+    node = dtree.nodes[node].children[x + 2 * y];
+    if (node == 0) break;
+  }
+  return guiding_direction(origin + r * size);
+}
+
+// Pdf of sampling a directional tree
+static float sample_dtree_pdf(
+    const guiding_dtree& dtree, const vec3f& direction) {
+  auto uv   = guiding_square(direction);
+  auto pdf  = 1 / (4 * pif);
+  auto node = 0;
+  while (true) {
+    auto sum = guiding_sum(dtree.nodes[node]);
+    if (sum <= 0) return pdf;
+    auto quadrant = guiding_quadrant(uv);
+    pdf *= 4 * dtree.nodes[node].sums[quadrant] / sum;
+    node = dtree.nodes[node].children[quadrant];
+    if (node == 0) return pdf;
+  }
+}
+
+// Spatial tree leaf of a point
+static int guiding_leaf(
+    const pathtrace_guiding& guiding, const vec3f& position) {
+  auto bbox = guiding.bbox;
+  auto node = 0, axis = 0;
+  while (guiding.nodes[node].children != 0) {
+    auto middle = (bbox.min[axis] + bbox.max[axis]) / 2;
+    if (position[axis] < middle) {
+      bbox.max[axis] = middle;
+      node           = guiding.nodes[node].children;
+    } else {
+      bbox.min[axis] = middle;
+      node           = guiding.nodes[node].children + 1;
+    }
+    axis = (axis + 1) % 3;
+  }
+  return node;
+}
+
+// Directional tree to sample at a point, if guiding is trained there
+static const guiding_dtree* get_dtree(
+    const pathtrace_guiding* guiding, const vec3f& position) {
+  if (guiding == nullptr || guiding->iterations == 0) return nullptr;
+  auto& dtree = guiding->nodes[guiding_leaf(*guiding, position)].sampling;
+  return guiding_sum(dtree.nodes[0]) > 0 ? &dtree : nullptr;
+}
+
+// Path vertex whose incident radiance is recorded for guiding, with the path
+// weight and radiance when leaving it, and the pdf of its direction
+struct guiding_vertex {
+  vec3f position  = {0, 0, 0};
+  vec3f direction = {0, 0, 0};
+  vec3f weight    = {0, 0, 0};
+  vec3f radiance  = {0, 0, 0};
+  float pdf       = 0;
+};
+
+// Record the incident radiance at the vertices of a path, from the radiance
+// the path gathered after them
+static void record_guiding(vector<guiding_record>& records,
+    const vector<guiding_vertex>& vertices, const vec3f& radiance) {
+  for (auto& vertex : vertices) {
+    auto incident = radiance - vertex.radiance;
+    auto value    = 0.0f;
+    for (auto c = 0; c < 3; c++) {
+      if (vertex.weight[c] > 0) value += incident[c] / vertex.weight[c];
+    }
+    value /= 3 * vertex.pdf;
+    if (!isfinite(value) || value < 0) continue;
+    records.push_back({vertex.position, vertex.direction, value});
+  }
+}
+
+// Rescale the vertices recorded along a path whose weight was divided by
+// `split` to split it. The radiance the path gathers afterwards then counts
+// as the one of all its split paths, which are not recorded.
+static void split_guiding(vector<guiding_vertex>& vertices,
+    const vec3f& radiance, float split) {
+  if (split == 1) return;
+  for (auto& vertex : vertices) {
+    vertex.radiance = radiance - (radiance - vertex.radiance) / split;
+    vertex.weight /= split;
+  }
+}
+
+// Number of scattering events of each type along a path
+struct path_depth {
+  int diffuse      = 0;
+  int specular     = 0;
+  int transmission = 0;
+  int volume       = 0;
+};
+
+// Count an event of a path, returning false if it exceeds the limit
+static bool next_depth(int& count, int limit) {
+  count += 1;
+  return limit < 0 || count <= limit;
+}
+
+// Count a surface scattering event by its type, returning false if the path
+// exceeds the limit of that type
+static bool next_depth(path_depth& depth, const material_point& material,
+    const vec3f& normal, const vec3f& outgoing, const vec3f& incoming,
+    const pathtrace_params& params) {
+  if (dot(normal, outgoing) * dot(normal, incoming) < 0) {
+    return next_depth(depth.transmission, params.transmission_bounces);
+  } else if (is_delta(material) || material.type == material_type::reflective) {
+    return next_depth(depth.specular, params.specular_bounces);
+  } else {
+    return next_depth(depth.diffuse, params.diffuse_bounces);
+  }
+}
+
+// Sample the next direction at a surface and update the path weight, with
+// MIS of the bsdf, the lights and the guiding tree, if given, for non-delta
+// materials. Returns a zero direction if sampling fails, and sets the pdf of
+// the direction, zero for delta materials.
+static vec3f sample_next(const scene_data& scene, const bvh_data& bvh,
+    const pathtrace_lights& lights, const shading_point& point,
+    const vec3f& outgoing, vec3f& weight, rng_state& rng,
+    const pathtrace_params& params, const guiding_dtree* dtree, float& pdf) {
+  auto& position = point.position;
+  auto& normal   = point.normal;
+  auto& material = point.material;
+  auto  incoming = vec3f{0, 0, 0};
+  if (!is_delta(material)) {
+    auto guided = dtree != nullptr ? guiding_fraction : 0.0f;
+    auto rnd    = rand1f(rng);
+    if (rnd < guided) {
+      incoming = sample_dtree(*dtree, rand2f(rng));
+    } else if (rnd < guided + (1 - guided) / 2) {
+      incoming = sample_bsdfcos(
+          material, normal, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      incoming = sample_lights(
+          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+    }
+    if (incoming == vec3f{0, 0, 0}) return incoming;
+    pdf = (1 - guided) *
+          (0.5f * sample_bsdfcos_pdf(material, normal, outgoing, incoming) +
+              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming,
+                         params.spheretrace_maxiter));
+    if (guided > 0) pdf += guided * sample_dtree_pdf(*dtree, incoming);
+    weight *= eval_bsdfcos(material, normal, outgoing, incoming) / pdf;
+  } else {
+    incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+    weight *= eval_delta(material, normal, outgoing, incoming) /
+              sample_delta_pdf(material, normal, outgoing, incoming);
+    pdf = 0;
+  }
+  return incoming;
+}
+
+// Sample the next direction in a volume and update the path weight, with
+// MIS of the phase function, the lights and the guiding tree, if given.
+// Sets the pdf of the direction.
+static vec3f sample_next(const scene_data& scene, const bvh_data& bvh,
+    const pathtrace_lights& lights, const material_point& vol,
+    const vec3f& position, const vec3f& outgoing, vec3f& weight,
+    rng_state& rng, const pathtrace_params& params, const guiding_dtree* dtree,
+    float& pdf) {
+  auto guided   = dtree != nullptr ? guiding_fraction : 0.0f;
+  auto rnd      = rand1f(rng);
+  auto incoming = vec3f{0, 0, 0};
+  if (rnd < guided) {
+    incoming = sample_dtree(*dtree, rand2f(rng));
+  } else if (rnd < guided + (1 - guided) / 2) {
+    incoming = sample_scattering(vol, outgoing, rand1f(rng), rand2f(rng));
+  } else {
+    incoming = sample_lights(
+        scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+  }
+  pdf = (1 - guided) * (0.5f * sample_scattering_pdf(vol, outgoing, incoming) +
+                           0.5f * sample_lights_pdf(scene, bvh, lights,
+                                      position, incoming,
+                                      params.spheretrace_maxiter));
+  if (guided > 0) pdf += guided * sample_dtree_pdf(*dtree, incoming);
+  weight *= eval_scattering(vol, outgoing, incoming) / pdf;
+  return incoming;
+}
+
+// Width of the weight window of adjoint-driven russian roulette, as the
+// ratio of its upper and lower bounds, and maximum number of split paths
+static const auto adjoint_window    = 5.0f;
+static const auto adjoint_maxsplits = 8;
+
+// Adjoint-driven russian roulette and splitting. The expected contribution
+// of a path to its pixel, relative to the pixel estimate, is its weight
+// scaled by `adjoint`. Paths below the weight window around one survive
+// with probability equal to their contribution, paths above it are split
+// into a number of paths whose expectation is their contribution, up to the
+// maximum. Updates the weight and returns the number of paths to continue,
+// setting `split` to the factor that divided the weight of split paths.
+// Not used at the first vertex, whose expected contribution is the pixel
+// estimate.
+static int adjoint_roulette(
+    vec3f& weight, float adjoint, rng_state& rng, float& split) {
+  auto contribution = max(weight) * adjoint;
+  auto lower        = 2 / (1 + adjoint_window);
+  if (contribution < lower) {
+    if (rand1f(rng) >= contribution) return 0;
+    weight *= 1 / contribution;
+    return 1;
+  } else if (contribution > lower * adjoint_window) {
+    auto target = min(contribution, (float)adjoint_maxsplits);
+    auto splits = (int)target;
+    if (rand1f(rng) < target - splits) splits += 1;
+    weight *= 1 / target;
+    split = target;
+    return splits;
+  } else {
+    return 1;
+  }
+}
+
+// Sampling data of the paths of a pixel
+struct path_sampler {
+  float                    adjoint = 0;        // adjoint roulette scale
+  const pathtrace_guiding* guiding = nullptr;  // guiding trees, if any
+  vector<guiding_record>*  records = nullptr;  // guiding samples, if training
+};
+
+// Path split off another one, traced after it
+struct path_split {
+  ray3f                  ray    = {};
+  vec3f                  weight = {0, 0, 0};
+  int                    bounce = 0;
+  path_depth             depth  = {};
+  vector<material_point> vstack = {};
+  int                    medium = invalidid;
+};
+
 // Shader for rendering only implicit surfaces
 // parameters like "bvh" are passed just to make the function call equal to other shaders
 static vec4f shade_implicit(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // initialize
   auto radiance = vec3f{0, 0, 0};
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
   auto hit      = false;
+  auto depth    = path_depth{};
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
+    // update statistics
+    update_pathtrace_stats(1, 0, 0);
+
     // intersect next point
     const auto& intersection = spheretrace(
         scene, ray, params.spheretrace_maxiter);
@@ -518,6 +934,10 @@ static vec4f shade_implicit(const scene_data& scene, const bvh_data& bvh,
                 sample_delta_pdf(material, normal, outgoing, incoming);
     }
 
+    // limit the scattering events of each type
+    if (!next_depth(depth, material, normal, outgoing, incoming, params))
+      break;
+
     // setup next iteration
     ray = {position, incoming};
     // check weight
@@ -537,7 +957,7 @@ static vec4f shade_implicit(const scene_data& scene, const bvh_data& bvh,
 // Normal for debugging implicits.
 static vec4f shade_implicit_normal(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   
   const auto& intersection = spheretrace(scene, ray, params.spheretrace_maxiter);
 
@@ -564,123 +984,168 @@ static vec4f shade_implicit_normal(const scene_data& scene, const bvh_data& bvh,
 // Recursive path tracing.
 static vec4f shade_volpathtrace(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // YOUR CODE GOES HERE ---------------
   // initialize
   auto radiance = vec3f{0, 0, 0};
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
   auto hit      = false;
+  auto depth    = path_depth{};
   auto vstack   = std::vector<material_point>();
-
-  // trace  path
-  for (auto bounce = 0; bounce < params.bounces; bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, scene, ray);
-    if (!intersection.hit) {
-      radiance += weight * eval_environment(scene, ray.d);
-      break;
-    }
-
-    // Sample transmittance
-    bool inVolume = false;
-    if (!vstack.empty()) {
-      const vec3f& density  = vstack.back().density;
-      float        distance = sample_transmittance(
-          density, intersection.distance, rand1f(rng), rand1f(rng));
-      weight *= eval_transmittance(density, distance) /
-                sample_transmittance_pdf(
-                    density, distance, intersection.distance);
-      inVolume              = distance < intersection.distance;
-      intersection.distance = distance;
-    }
-
-    // Handle surface
-    if (!inVolume) {
-      // prepare shading point
-      auto outgoing = -ray.d;
-      auto position = eval_shading_position(scene, intersection, outgoing);
-      auto normal   = eval_shading_normal(scene, intersection, outgoing);
-      auto material = eval_material(scene, intersection);
-
-      // handle opacity
-      if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
-        ray = {position + ray.d * 1e-2f, ray.d};
-        bounce -= 1;
-        continue;
+  auto medium   = invalidid;  // closed medium instance, if any
+  auto splits   = vector<path_split>{};
+  auto bounce   = 0;
+  auto record   = sampler.records != nullptr;  // record guiding samples
+  auto vertices = vector<guiding_vertex>{};
+
+  // trace  path, then the paths split from it
+  while (true) {
+    for (; bounce < params.bounces; bounce++) {
+      // update statistics
+      update_pathtrace_stats(1, 0, 0);
+
+      // intersect next point, inside closed media only with their boundary
+      auto intersection = intersect_opaque_bvh(
+          bvh, scene, lights, medium, ray, rng);
+      if (!intersection.hit) {
+        radiance += weight * eval_environment(scene, ray.d);
+        break;
       }
 
-      // set hit variables
-      if (bounce == 0) hit = true;
+      // Sample transmittance
+      bool inVolume = false;
+      if (!vstack.empty()) {
+        const vec3f& density  = vstack.back().density;
+        float        distance = sample_transmittance(
+            density, intersection.distance, rand1f(rng), rand1f(rng));
+        weight *= eval_transmittance(density, distance) /
+                  sample_transmittance_pdf(
+                      density, distance, intersection.distance);
+        inVolume              = distance < intersection.distance;
+        intersection.distance = distance;
+      }
 
-      // accumulate emission
-      radiance += weight * eval_emission(material, normal, outgoing);
+      // Handle surface
+      if (!inVolume) {
+        // prepare shading point
+        auto outgoing = -ray.d;
+        auto  point    = eval_shading_point(scene, intersection, outgoing);
+        auto& position = point.position;
+        auto& normal   = point.normal;
+        auto& material = point.material;
+
+        // set hit variables
+        if (bounce == 0) hit = true;
+
+        // accumulate emission
+        radiance += weight * eval_emission(material, normal, outgoing);
+
+        // adjoint-driven roulette and splitting
+        auto nsplits = 1;
+        if (sampler.adjoint > 0 && bounce > 0) {
+          auto split = 1.0f;
+          nsplits    = adjoint_roulette(weight, sampler.adjoint, rng, split);
+          if (nsplits == 0) break;
+          if (record) split_guiding(vertices, radiance, split);
+        }
 
-      // next direction
-      auto incoming = vec3f{0, 0, 0};
-      if (!is_delta(material)) {
-        if (rand1f(rng) < 0.5f) {
-          incoming = sample_bsdfcos(
-              material, normal, outgoing, rand1f(rng), rand2f(rng));
-        } else {
-          incoming = sample_lights(
-              scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+        // next direction, updating the media of paths crossing the surface
+        auto dtree   = get_dtree(sampler.guiding, position);
+        auto pdf     = 0.0f;
+        auto scatter = [&](vec3f& weight, path_depth& depth,
+                           vector<material_point>& vstack, int& medium) {
+          auto incoming = sample_next(scene, bvh, lights, point, outgoing,
+              weight, rng, params, dtree, pdf);
+          if (incoming == vec3f{0, 0, 0}) return incoming;
+          if (!next_depth(depth, material, normal, outgoing, incoming, params))
+            return vec3f{0, 0, 0};
+          if (is_volumetric(scene, intersection) &&
+              dot(normal, outgoing) * dot(normal, incoming) < 0) {
+            if (vstack.empty()) {
+              vstack.push_back(material);
+              medium = is_isolated(lights, intersection)
+                           ? intersection.instance
+                           : invalidid;
+            } else {
+              vstack.pop_back();
+              medium = invalidid;
+            }
+          }
+          return incoming;
+        };
+
+        // split paths, with their own directions
+        for (auto split = 1; split < nsplits; split++) {
+          auto path = path_split{{}, weight, bounce + 1, depth, vstack, medium};
+          auto incoming = scatter(path.weight, path.depth, path.vstack,
+              path.medium);
+          if (incoming == vec3f{0, 0, 0} || path.weight == vec3f{0, 0, 0} ||
+              !isfinite(path.weight))
+            continue;
+          path.ray = {position, incoming};
+          splits.push_back(std::move(path));
         }
+
+        // setup next iteration
+        auto incoming = scatter(weight, depth, vstack, medium);
         if (incoming == vec3f{0, 0, 0}) break;
-        weight *=
-            eval_bsdfcos(material, normal, outgoing, incoming) /
-            (0.5f * sample_bsdfcos_pdf(material, normal, outgoing, incoming) +
-                0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming,
-                           params.spheretrace_maxiter));
-      } else {
-        incoming = sample_delta(material, normal, outgoing, rand1f(rng));
-        weight *= eval_delta(material, normal, outgoing, incoming) /
-                  sample_delta_pdf(material, normal, outgoing, incoming);
+        ray = {position, incoming};
+        if (record && pdf > 0)
+          vertices.push_back({position, incoming, weight, radiance, pdf});
       }
-
-      // Update vstack
-      if (is_volumetric(scene, intersection) &&
-          dot(normal, outgoing) * dot(normal, incoming) < 0) {
-        if (vstack.empty())
-          vstack.push_back(eval_material(scene, intersection));
-        else
-          vstack.pop_back();
+      // Handle volume
+      else {
+        // prepare shading point
+        const vec3f& outgoing = -ray.d;
+        const vec3f& position = ray_point(ray, intersection.distance);
+
+        auto& vol = vstack.back();
+        radiance += weight *
+                    eval_emission(vol, position, outgoing);  // emission
+
+        // limit the scattering events in volumes
+        if (!next_depth(depth.volume, params.volume_bounces)) break;
+
+        // incoming
+        auto dtree    = get_dtree(sampler.guiding, position);
+        auto pdf      = 0.0f;
+        auto incoming = sample_next(scene, bvh, lights, vol, position,
+            outgoing, weight, rng, params, dtree, pdf);
+        ray = {position, incoming};  // setup recurse
+        if (record && pdf > 0)
+          vertices.push_back({position, incoming, weight, radiance, pdf});
       }
 
-      // setup next iteration
-      ray = {position, incoming};
-    }
-    // Handle volume
-    else {
-      // prepare shading point
-      const vec3f& outgoing = -ray.d;
-      const vec3f& position = ray_point(ray, intersection.distance);
-
-      auto& vol = vstack.back();
-      radiance += weight * eval_emission(vol, position, outgoing);  // emission
-
-      // incoming
-      vec3f incoming =
-          rand1f(rng) < 0.5
-              ? sample_scattering(vol, outgoing, rand1f(rng), rand2f(rng))
-              : sample_lights(scene, lights, position, rand1f(rng), rand1f(rng),
-                    rand2f(rng));
-      weight *= eval_scattering(vol, outgoing, incoming) /
-                (0.5f * sample_scattering_pdf(vol, outgoing, incoming) +
-                    0.5f * sample_lights_pdf(scene, bvh, lights, position,
-                               incoming, params.spheretrace_maxiter));
-      ray = {position, incoming};  // setup recurse
-    }
+      // check weight
+      if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
 
-    // check weight
-    if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
+      // russian roulette, also in volumes since path weights change too
+      // much across their vertices for adjoint-driven roulette
+      if ((sampler.adjoint == 0 || inVolume) && bounce > 3) {
+        auto rr_prob = min((float)0.99, max(weight));
+        if (rand1f(rng) >= rr_prob) break;
+        weight *= 1 / rr_prob;
+      }
+    }
 
-    // russian roulette
-    if (bounce > 3) {
-      auto rr_prob = min((float)0.99, max(weight));
-      if (rand1f(rng) >= rr_prob) break;
-      weight *= 1 / rr_prob;
+    // record guiding samples along the first path only, whose vertices
+    // were rescaled to stand also for the paths split from it
+    if (record) {
+      record_guiding(*sampler.records, vertices, radiance);
+      record = false;
     }
+
+    // continue with the next split path
+    if (splits.empty()) break;
+    auto& path = splits.back();
+    ray        = path.ray;
+    weight     = path.weight;
+    bounce     = path.bounce;
+    depth      = path.depth;
+    vstack     = std::move(path.vstack);
+    medium     = path.medium;
+    splits.pop_back();
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
@@ -689,73 +1154,108 @@ static vec4f shade_volpathtrace(const scene_data& scene, const bvh_data& bvh,
 // Recursive path tracing.
 static vec4f shade_pathtrace(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // initialize
   auto radiance = vec3f{0, 0, 0};
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
   auto hit      = false;
-  // trace  path
-  for (auto bounce = 0; bounce < params.bounces; bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, scene, ray);
-    if (!intersection.hit) {
-      radiance += weight * eval_environment(scene, ray.d);
-      break;
-    }
+  auto depth    = path_depth{};
+  auto splits   = vector<path_split>{};
+  auto bounce   = 0;
+  auto record   = sampler.records != nullptr;  // record guiding samples
+  auto vertices = vector<guiding_vertex>{};
+  // trace  path, then the paths split from it
+  while (true) {
+    for (; bounce < params.bounces; bounce++) {
+      // update statistics
+      update_pathtrace_stats(1, 0, 0);
+
+      // intersect next point
+      auto intersection = intersect_opaque_bvh(bvh, scene, lights, ray, rng);
+      if (!intersection.hit) {
+        radiance += weight * eval_environment(scene, ray.d);
+        break;
+      }
 
-    // prepare shading point
-    auto outgoing = -ray.d;
-    auto position = eval_shading_position(scene, intersection, outgoing);
-    auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
+      // prepare shading point
+      auto outgoing = -ray.d;
+      auto  point    = eval_shading_point(scene, intersection, outgoing);
+      auto& position = point.position;
+      auto& normal   = point.normal;
+      auto& material = point.material;
 
-    // handle opacity
-    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
-      bounce -= 1;
-      continue;
-    }
+      // set hit variables
+      if (bounce == 0) hit = true;
 
-    // set hit variables
-    if (bounce == 0) hit = true;
+      // accumulate emission
+      radiance += weight * eval_emission(material, normal, outgoing);
 
-    // accumulate emission
-    radiance += weight * eval_emission(material, normal, outgoing);
+      // adjoint-driven roulette and splitting
+      auto nsplits = 1;
+      if (sampler.adjoint > 0 && bounce > 0) {
+        auto split = 1.0f;
+        nsplits    = adjoint_roulette(weight, sampler.adjoint, rng, split);
+        if (nsplits == 0) break;
+        if (record) split_guiding(vertices, radiance, split);
+      }
 
-    // next direction
-    auto incoming = vec3f{0, 0, 0};
-    if (!is_delta(material)) {
-      if (rand1f(rng) < 0.5f) {
-        incoming = sample_bsdfcos(
-            material, normal, outgoing, rand1f(rng), rand2f(rng));
-      } else {
-        incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+      // split paths, with their own directions
+      auto dtree = get_dtree(sampler.guiding, position);
+      auto pdf   = 0.0f;
+      for (auto split = 1; split < nsplits; split++) {
+        auto path     = path_split{{}, weight, bounce + 1, depth};
+        auto incoming = sample_next(scene, bvh, lights, point, outgoing,
+            path.weight, rng, params, dtree, pdf);
+        if (incoming == vec3f{0, 0, 0} || path.weight == vec3f{0, 0, 0} ||
+            !isfinite(path.weight))
+          continue;
+        if (!next_depth(
+                path.depth, material, normal, outgoing, incoming, params))
+          continue;
+        path.ray = {position, incoming};
+        splits.push_back(std::move(path));
       }
+
+      // next direction
+      auto incoming = sample_next(scene, bvh, lights, point, outgoing, weight,
+          rng, params, dtree, pdf);
       if (incoming == vec3f{0, 0, 0}) break;
-      weight *=
-          eval_bsdfcos(material, normal, outgoing, incoming) /
-          (0.5f * sample_bsdfcos_pdf(material, normal, outgoing, incoming) +
-              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming,
-                         params.spheretrace_maxiter));
-    } else {
-      incoming = sample_delta(material, normal, outgoing, rand1f(rng));
-      weight *= eval_delta(material, normal, outgoing, incoming) /
-                sample_delta_pdf(material, normal, outgoing, incoming);
-    }
 
-    // setup next iteration
-    ray = {position, incoming};
-    // check weight
-    if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
+      // limit the scattering events of each type
+      if (!next_depth(depth, material, normal, outgoing, incoming, params))
+        break;
 
-    // russian roulette
-    if (bounce > 3) {
-      auto rr_prob = min((float)0.99, max(weight));
-      if (rand1f(rng) >= rr_prob) break;
-      weight *= 1 / rr_prob;
+      // setup next iteration
+      ray = {position, incoming};
+      if (record && pdf > 0)
+        vertices.push_back({position, incoming, weight, radiance, pdf});
+      // check weight
+      if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
+
+      // russian roulette
+      if (sampler.adjoint == 0 && bounce > 3) {
+        auto rr_prob = min((float)0.99, max(weight));
+        if (rand1f(rng) >= rr_prob) break;
+        weight *= 1 / rr_prob;
+      }
     }
+
+    // record guiding samples along the first path only, whose vertices
+    // were rescaled to stand also for the paths split from it
+    if (record) {
+      record_guiding(*sampler.records, vertices, radiance);
+      record = false;
+    }
+
+    // continue with the next split path
+    if (splits.empty()) break;
+    auto& path = splits.back();
+    ray        = path.ray;
+    weight     = path.weight;
+    bounce     = path.bounce;
+    depth      = path.depth;
+    splits.pop_back();
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
@@ -764,17 +1264,21 @@ static vec4f shade_pathtrace(const scene_data& scene, const bvh_data& bvh,
 // Recursive path tracing.
 static vec4f shade_naive(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // initialize
   auto radiance = vec3f{0, 0, 0};
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
   auto hit      = false;
+  auto depth    = path_depth{};
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
+    // update statistics
+    update_pathtrace_stats(1, 0, 0);
+
     // intersect next point
-    auto intersection = intersect_bvh(bvh, scene, ray);
+    auto intersection = intersect_opaque_bvh(bvh, scene, lights, ray, rng);
     if (!intersection.hit) {
       radiance += weight * eval_environment(scene, ray.d);
       break;
@@ -782,16 +1286,10 @@ static vec4f shade_naive(const scene_data& scene, const bvh_data& bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto position = eval_shading_position(scene, intersection, outgoing);
-    auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
-
-    // handle opacity
-    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
-      bounce -= 1;
-      continue;
-    }
+    auto  point    = eval_shading_point(scene, intersection, outgoing);
+    auto& position = point.position;
+    auto& normal   = point.normal;
+    auto& material = point.material;
 
     // set hit variables
     if (bounce == 0) hit = true;
@@ -814,6 +1312,10 @@ static vec4f shade_naive(const scene_data& scene, const bvh_data& bvh,
                 sample_delta_pdf(material, normal, outgoing, incoming);
     }
 
+    // limit the scattering events of each type
+    if (!next_depth(depth, material, normal, outgoing, incoming, params))
+      break;
+
     // check weight
     if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
 
@@ -834,17 +1336,21 @@ static vec4f shade_naive(const scene_data& scene, const bvh_data& bvh,
 // Eyelight for quick previewing.
 static vec4f shade_eyelight(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray_, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // initialize
   auto radiance = vec3f{0, 0, 0};
   auto weight   = vec3f{1, 1, 1};
   auto ray      = ray_;
   auto hit      = false;
+  auto depth    = path_depth{};
 
   // trace  path
   for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
+    // update statistics
+    update_pathtrace_stats(1, 0, 0);
+
     // intersect next point
-    auto intersection = intersect_bvh(bvh, scene, ray);
+    auto intersection = intersect_opaque_bvh(bvh, scene, lights, ray, rng);
     if (!intersection.hit) {
       radiance += weight * eval_environment(scene, ray.d);
       break;
@@ -852,16 +1358,10 @@ static vec4f shade_eyelight(const scene_data& scene, const bvh_data& bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto position = eval_shading_position(scene, intersection, outgoing);
-    auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
-
-    // handle opacity
-    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
-      bounce -= 1;
-      continue;
-    }
+    auto  point    = eval_shading_point(scene, intersection, outgoing);
+    auto& position = point.position;
+    auto& normal   = point.normal;
+    auto& material = point.material;
 
     // set hit variables
     if (bounce == 0) hit = true;
@@ -878,6 +1378,8 @@ static vec4f shade_eyelight(const scene_data& scene, const bvh_data& bvh,
     if (!is_delta(material)) break;
     incoming = sample_delta(material, normal, outgoing, rand1f(rng));
     if (incoming == vec3f{0, 0, 0}) break;
+    if (!next_depth(depth, material, normal, outgoing, incoming, params))
+      break;
     weight *= eval_delta(material, normal, outgoing, incoming) /
               sample_delta_pdf(material, normal, outgoing, incoming);
     if (weight == vec3f{0, 0, 0} || !isfinite(weight)) break;
@@ -892,47 +1394,50 @@ static vec4f shade_eyelight(const scene_data& scene, const bvh_data& bvh,
 // Normal for debugging.
 static vec4f shade_normal(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // intersect next point
   auto intersection = intersect_bvh(bvh, scene, ray);
   if (!intersection.hit) return {0, 0, 0, 0};
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto normal   = eval_shading_normal(scene, intersection, outgoing);
+  auto normal   = eval_shading_point(scene, intersection, outgoing).normal;
   return {normal.x, normal.y, normal.z, 1};
 }
 
 // Normal for debugging.
 static vec4f shade_texcoord(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // intersect next point
   auto intersection = intersect_bvh(bvh, scene, ray);
   if (!intersection.hit) return {0, 0, 0, 0};
 
   // prepare shading point
-  auto texcoord = eval_texcoord(scene, intersection);
+  auto texcoord = eval_shading_point(scene, intersection, -ray.d).texcoord;
   return {texcoord.x, texcoord.y, 0, 1};
 }
 
 // Color for debugging.
 static vec4f shade_color(const scene_data& scene, const bvh_data& bvh,
     const pathtrace_lights& lights, const ray3f& ray, rng_state& rng,
-    const pathtrace_params& params) {
+    const pathtrace_params& params, const path_sampler& sampler) {
   // intersect next point
   auto intersection = intersect_bvh(bvh, scene, ray);
   if (!intersection.hit) return {0, 0, 0, 0};
 
   // prepare shading point
-  auto color = eval_material(scene, intersection).color;
+  auto color = eval_shading_point(scene, intersection, -ray.d).material.color;
   return {color.x, color.y, color.z, 1};
 }
 
-// Trace a single ray from the camera using the given algorithm.
+// Trace a single ray from the camera using the given algorithm. Shaders
+// that support them use adjoint-driven roulette and path guiding as set by
+// `sampler`.
 using pathtrace_shader_func = vec4f (*)(const scene_data& scene,
     const bvh_scene& bvh, const pathtrace_lights& lights, const ray3f& ray,
-    rng_state& rng, const pathtrace_params& params);
+    rng_state& rng, const pathtrace_params& params,
+    const path_sampler& sampler);
 static pathtrace_shader_func get_shader(const pathtrace_params& params) {
   switch (params.shader) {
     case pathtrace_shader_type::volpathtrace: return shade_volpathtrace;
@@ -951,27 +1456,61 @@ static pathtrace_shader_func get_shader(const pathtrace_params& params) {
   }
 }
 
+// Builder of the shape bvhs built on demand, if any
+static function<bvh_data(const shape_data&)> lazy_shape_bvh(
+    const pathtrace_params& params) {
+  if (!params.lazy) return {};
+  if (params.sbvh) {
+    return [](const shape_data& shape) { return make_sbvh(shape); };
+  } else {
+    return [](const shape_data& shape) { return make_bvh(shape); };
+  }
+}
+
 // Build the bvh acceleration structure.
 bvh_scene make_bvh(const scene_data& scene, const pathtrace_params& params) {
-  return make_bvh(scene, false, false, params.noparallel);
+  auto bvh = bvh_scene{};
+  if (params.sbvh && !params.lazy) {
+    bvh.shapes.resize(scene.shapes.size());
+    if (params.noparallel) {
+      for (auto idx : range(scene.shapes.size())) {
+        bvh.shapes[idx] = make_sbvh(scene.shapes[idx]);
+      }
+    } else {
+      parallel_for(scene.shapes.size(), [&](size_t idx) {
+        bvh.shapes[idx] = make_sbvh(scene.shapes[idx]);
+      });
+    }
+  }
+  complete_bvh(bvh, scene, false, params.noparallel, params.flatten,
+      lazy_shape_bvh(params));
+  return bvh;
 }
 
-// Init a sequence of random number generators.
-pathtrace_state make_state(
+// Image size of a render
+static vec2i get_render_size(
     const scene_data& scene, const pathtrace_params& params) {
   auto& camera = scene.cameras[params.camera];
-  auto  state  = pathtrace_state{};
   if (camera.aspect >= 1) {
-    state.width  = params.resolution;
-    state.height = (int)round(params.resolution / camera.aspect);
+    return {params.resolution, (int)round(params.resolution / camera.aspect)};
   } else {
-    state.height = params.resolution;
-    state.width  = (int)round(params.resolution * camera.aspect);
+    return {(int)round(params.resolution * camera.aspect), params.resolution};
   }
+}
+
+// Init a sequence of random number generators.
+pathtrace_state make_state(
+    const scene_data& scene, const pathtrace_params& params) {
+  auto state    = pathtrace_state{};
+  auto size     = get_render_size(scene, params);
+  state.width   = size.x;
+  state.height  = size.y;
   state.samples = 0;
   state.image.assign(state.width * state.height, {0, 0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
   state.rngs.assign(state.width * state.height, {});
+  if (params.cost != pathtrace_cost_type::none)
+    state.cost.assign(state.width * state.height, 0);
   auto rng_ = make_rng(1301081);
   for (auto& rng : state.rngs) {
     rng = make_rng(961748941ull, rand1i(rng_, 1 << 31) / 2 + 1);
@@ -979,13 +1518,54 @@ pathtrace_state make_state(
   return state;
 }
 
+// Reset accumulation buffers in place
+void reset_state(pathtrace_state& state, const scene_data& scene,
+    const pathtrace_params& params) {
+  auto size = get_render_size(scene, params);
+  if (size != vec2i{state.width, state.height} || state.rngs.empty()) {
+    state = make_state(scene, params);
+    return;
+  }
+  state.samples = 0;
+  std::fill(state.image.begin(), state.image.end(), vec4f{0, 0, 0, 0});
+  std::fill(state.hits.begin(), state.hits.end(), 0);
+  state.adjoint.clear();
+  state.guiding = {};
+  if (params.cost != pathtrace_cost_type::none) {
+    state.cost.assign(state.width * state.height, 0);
+  } else {
+    state.cost.clear();
+  }
+}
+
 // Init trace lights
 pathtrace_lights make_lights(
     const scene_data& scene, const pathtrace_params& params) {
+  auto zone   = trace_zone{"make_lights"};
   auto lights = pathtrace_lights{};
 
-  for (auto handle = 0; handle < scene.instances.size(); handle++) {
-    auto& instance = scene.instances[handle];
+  // transparency
+  lights.transparent = vector<bool>(scene.materials.size(), false);
+  for (auto idx = 0; idx < (int)scene.materials.size(); idx++) {
+    auto& material    = scene.materials[idx];
+    auto  transparent = material.opacity < 1;
+    if (material.color_tex != invalidid) {
+      auto& texture = scene.textures[material.color_tex];
+      for (auto& pixel : texture.pixelsf) transparent |= pixel.w < 1;
+      for (auto& pixel : texture.pixelsb) transparent |= pixel.w < 255;
+    }
+    lights.transparent[idx] = transparent;
+    if (transparent) lights.opaque = false;
+  }
+  for (auto& shape : scene.shapes) {
+    for (auto& color : shape.colors) lights.opaque &= color.w >= 1;
+  }
+  for (auto& array : scene.instance_arrays) {
+    for (auto& color : array.colors) lights.opaque &= color.w >= 1;
+  }
+
+  for (auto handle = 0; handle < num_instances(scene); handle++) {
+    auto  instance = get_instance(scene, handle);
     auto& material = scene.materials[instance.material];
     if (material.emission == vec3f{0, 0, 0}) continue;
     auto& shape = scene.shapes[instance.shape];
@@ -997,8 +1577,8 @@ pathtrace_lights make_lights(
       light.elements_cdf = vector<float>(shape.triangles.size());
       for (auto idx = 0; idx < light.elements_cdf.size(); idx++) {
         auto& t                 = shape.triangles[idx];
-        light.elements_cdf[idx] = triangle_area(
-            shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+        light.elements_cdf[idx] = triangle_area(get_position(shape, t.x),
+            get_position(shape, t.y), get_position(shape, t.z));
         if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
       }
     }
@@ -1006,8 +1586,9 @@ pathtrace_lights make_lights(
       light.elements_cdf = vector<float>(shape.quads.size());
       for (auto idx = 0; idx < light.elements_cdf.size(); idx++) {
         auto& t                 = shape.quads[idx];
-        light.elements_cdf[idx] = quad_area(shape.positions[t.x],
-            shape.positions[t.y], shape.positions[t.z], shape.positions[t.w]);
+        light.elements_cdf[idx] = quad_area(get_position(shape, t.x),
+            get_position(shape, t.y), get_position(shape, t.z),
+            get_position(shape, t.w));
         if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
       }
     }
@@ -1048,47 +1629,350 @@ pathtrace_lights make_lights(
   return lights;
 }
 
-// Progressively compute an image by calling trace_samples multiple times.
-void pathtrace_samples(pathtrace_state& state, const scene_data& scene,
+// Find the volumetric instances whose bounds overlap no other primitive
+static vector<bool> make_isolated(
+    const scene_data& scene, const bvh_scene& bvh) {
+  auto isolated = vector<bool>(num_instances(scene), false);
+  for (auto instance = 0; instance < (int)isolated.size(); instance++) {
+    if (!is_volumetric(scene, get_instance(scene, instance))) continue;
+    isolated[instance] = is_isolated_instance(bvh, scene, instance);
+  }
+  return isolated;
+}
+
+// Initialize lights and isolated instances
+pathtrace_lights make_lights(const scene_data& scene, const bvh_scene& bvh,
+    const pathtrace_params& params) {
+  auto lights     = make_lights(scene, params);
+  lights.isolated = make_isolated(scene, bvh);
+  return lights;
+}
+
+// Accumulate statistics
+pathtrace_stats& operator+=(pathtrace_stats& a, const pathtrace_stats& b) {
+  a.samples += b.samples;
+  a.paths += b.paths;
+  a.bounces += b.bounces;
+  a.rays += b.rays;
+  a.nodes += b.nodes;
+  a.primitives += b.primitives;
+  a.instances += b.instances;
+  a.spheretrace_steps += b.spheretrace_steps;
+  a.lightpdf_rays += b.lightpdf_rays;
+  a.time += b.time;
+  return a;
+}
+
+// Size of the square tiles rendered by each task
+static const auto pathtrace_tile_size = 32;
+
+// Cost counter of the calling thread
+static int64_t get_cost_counter(const pathtrace_params& params) {
+  switch (params.cost) {
+    case pathtrace_cost_type::none: return 0;
+    case pathtrace_cost_type::time:
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+    case pathtrace_cost_type::nodes:
+      return (int64_t)get_bvh_thread_stats().nodes;
+    case pathtrace_cost_type::spheretrace:
+#ifdef YOCTO_STATS
+      return (int64_t)pathtrace_thread_stats.local().spheretrace_steps;
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+// Trace one sample for a pixel, jittered or at the pixel center
+static void pathtrace_sample(pathtrace_state& state, const scene_data& scene,
     const bvh_scene& bvh, const pathtrace_lights& lights,
+    const camera_data& camera, pathtrace_shader_func shader, int idx,
+    bool jitter, const pathtrace_params& params,
+    vector<guiding_record>* records) {
+  auto start    = get_cost_counter(params);
+  auto i = idx % state.width, j = idx / state.width;
+  auto puv      = jitter ? rand2f(state.rngs[idx]) : vec2f{0.5f, 0.5f};
+  auto u        = (i + puv.x) / state.width, v = (j + puv.y) / state.height;
+  auto ray      = eval_camera(camera, {u, v}, rand2f(state.rngs[idx]));
+  auto sampler  = path_sampler{};
+  if (!state.adjoint.empty()) sampler.adjoint = state.adjoint[idx];
+  if (params.guiding) {
+    sampler.guiding = &state.guiding;
+    sampler.records = records;
+  }
+  auto radiance = shader(
+      scene, bvh, lights, ray, state.rngs[idx], params, sampler);
+  if (!isfinite(radiance)) radiance = {0, 0, 0};
+  state.image[idx] += radiance;
+  state.hits[idx] += 1;
+  if (!state.cost.empty())
+    state.cost[idx] += (float)(get_cost_counter(params) - start);
+}
+
+// Minimum pixel estimate, relative to the image mean, so that pixels that
+// got no radiance in the first samples are not split at every vertex
+static const auto adjoint_minestimate = 0.05f;
+
+// Compute the adjoint-driven roulette scale of each pixel from the samples
+// accumulated so far. The radiance reaching path vertices is approximated
+// by the image mean, and pixel estimates are box filtered to lower noise.
+static void make_adjoint(pathtrace_state& state) {
+  auto zone      = trace_zone{"make_adjoint"};
+  auto luminance = vector<float>(state.width * state.height, 0);
+  auto mean      = 0.0;
+  for (auto idx = 0; idx < (int)luminance.size(); idx++) {
+    auto& pixel    = state.image[idx];
+    luminance[idx] = (pixel.x + pixel.y + pixel.z) /
+                     (3 * (float)max(state.hits[idx], 1));
+    mean += luminance[idx];
+  }
+  mean /= max((int)luminance.size(), 1);
+  state.adjoint.assign(state.width * state.height, 0);
+  if (mean <= 0) return;
+  for (auto j = 0; j < state.height; j++) {
+    for (auto i = 0; i < state.width; i++) {
+      auto estimate = 0.0f;
+      auto count    = 0;
+      for (auto jj = max(j - 1, 0); jj <= min(j + 1, state.height - 1); jj++) {
+        for (auto ii = max(i - 1, 0); ii <= min(i + 1, state.width - 1);
+             ii++) {
+          estimate += luminance[jj * state.width + ii];
+          count += 1;
+        }
+      }
+      estimate = clamp(estimate / count, adjoint_minestimate * (float)mean,
+          4 * (float)mean);
+      state.adjoint[j * state.width + i] = (float)mean / estimate;
+    }
+  }
+}
+
+// Fraction of the radiance of a directional tree above which its quadrants
+// are subdivided, and maximum depth of directional trees
+static const auto guiding_dthreshold = 0.01f;
+static const auto guiding_dmaxdepth  = 20;
+
+// Records of a spatial tree leaf in a training iteration, scaled by the
+// square root of the samples of the iteration, above which it is split
+static const auto guiding_sthreshold = 12000.0f;
+
+// Initialize path guiding with a single spatial leaf over the scene bounds,
+// enlarged to a cube.
+static void make_guiding(pathtrace_guiding& guiding, const scene_data& scene) {
+  auto bbox          = compute_bounds(scene);
+  auto extent        = bbox.min.x <= bbox.max.x ? max(size(bbox)) : 1.0f;
+  auto half          = vec3f{1, 1, 1} * (extent * 0.51f + 1e-4f);
+  auto middle        = bbox.min.x <= bbox.max.x ? center(bbox) : vec3f{0, 0, 0};
+  guiding.bbox       = {middle - half, middle + half};
+  guiding.nodes      = {guiding_snode{}};
+  guiding.iterations = 0;
+  guiding.records    = {};
+}
+
+// Add the radiance of a record to a directional tree
+static void splat_dtree(
+    guiding_dtree& dtree, const vec3f& direction, float radiance) {
+  auto uv   = guiding_square(direction);
+  auto node = 0;
+  while (true) {
+    auto quadrant = guiding_quadrant(uv);
+    dtree.nodes[node].sums[quadrant] += radiance;
+    node = dtree.nodes[node].children[quadrant];
+    if (node == 0) return;
+  }
+}
+
+// Structure of a directional tree for the next training iteration, that
+// subdivides the quadrants with more than a fraction of the radiance and
+// merges the others, with zero radiance.
+static guiding_dtree refine_dtree(const guiding_dtree& dtree) {
+  auto refined = guiding_dtree{};
+  auto total   = guiding_sum(dtree.nodes[0]);
+  if (total <= 0) return refined;
+  auto stack = vector<vec3i>{{0, 0, 1}};  // source node, node, depth
+  while (!stack.empty()) {
+    auto [source, node, depth] = stack.back();
+    stack.pop_back();
+    for (auto quadrant = 0; quadrant < 4; quadrant++) {
+      auto& snode = dtree.nodes[source];
+      if (snode.sums[quadrant] <= total * guiding_dthreshold) continue;
+      if (depth >= guiding_dmaxdepth) continue;
+      auto child = (int)refined.nodes.size();
+      refined.nodes.emplace_back();
+      refined.nodes[node].children[quadrant] = child;
+      if (snode.children[quadrant] != 0)
+        stack.push_back({snode.children[quadrant], child, depth + 1});
+    }
+  }
+  return refined;
+}
+
+// Add the samples recorded in a pass to the building trees. At the end of
+// training iterations, whose number of samples doubles, split the spatial
+// leaves with many records and refine the directional trees. Records are
+// sorted by leaf, so that each leaf is updated by a single task.
+static void update_guiding(pathtrace_guiding& guiding, int samples,
     const pathtrace_params& params) {
-  if (state.samples >= params.samples) return;
+  auto zone    = trace_zone{"update_guiding"};
+  auto records = vector<guiding_record>{};
+  for (auto& tile : guiding.records) {
+    records.insert(records.end(), tile.begin(), tile.end());
+    tile.clear();
+  }
+
+  // run over leaves in parallel
+  auto for_leaves = [&](auto&& func) {
+    auto nodes = (int)guiding.nodes.size();
+    if (params.noparallel) {
+      for (auto node = 0; node < nodes; node++) {
+        if (guiding.nodes[node].children == 0) func(node);
+      }
+    } else {
+      parallel_for(nodes, [&](int node) {
+        if (guiding.nodes[node].children == 0) func(node);
+      });
+    }
+  };
+
+  // sort records by leaf
+  auto offsets = vector<int>(guiding.nodes.size() + 1, 0);
+  auto leaves  = vector<int>(records.size());
+  for (auto idx = 0; idx < (int)records.size(); idx++) {
+    leaves[idx] = guiding_leaf(guiding, records[idx].position);
+    offsets[leaves[idx] + 1] += 1;
+  }
+  for (auto node = 0; node < (int)guiding.nodes.size(); node++) {
+    offsets[node + 1] += offsets[node];
+  }
+  auto sorted = vector<int>(records.size());
+  auto next   = offsets;
+  for (auto idx = 0; idx < (int)records.size(); idx++) {
+    sorted[next[leaves[idx]]++] = idx;
+  }
+
+  // splat records
+  for_leaves([&](int node) {
+    auto& snode = guiding.nodes[node];
+    for (auto idx = offsets[node]; idx < offsets[node + 1]; idx++) {
+      auto& record = records[sorted[idx]];
+      splat_dtree(snode.building, record.direction, record.radiance);
+    }
+    snode.records += offsets[node + 1] - offsets[node];
+  });
+
+  // check the end of the training iteration
+  if ((samples & (samples - 1)) != 0 && samples != params.guiding_samples)
+    return;
+
+  // split leaves with many records, giving children half of them
+  auto threshold = guiding_sthreshold * sqrt((float)max(samples / 2, 1));
+  for (auto node = 0; node < (int)guiding.nodes.size(); node++) {
+    if (guiding.nodes[node].children != 0) continue;
+    if (guiding.nodes[node].records <= threshold) continue;
+    auto child = guiding.nodes[node];
+    child.records /= 2;
+    guiding.nodes[node]          = guiding_snode{};
+    guiding.nodes[node].children = (int)guiding.nodes.size();
+    guiding.nodes.push_back(child);
+    guiding.nodes.push_back(child);
+  }
+
+  // sample the radiance of this iteration, and refine its trees to record
+  // the next one
+  for_leaves([&](int node) {
+    auto& snode    = guiding.nodes[node];
+    snode.sampling = std::move(snode.building);
+    snode.building = refine_dtree(snode.sampling);
+    snode.records  = 0;
+  });
+  guiding.iterations += 1;
+}
+
+// Progressively compute an image by calling trace_samples multiple times.
+pathtrace_stats pathtrace_samples(pathtrace_state& state,
+    const scene_data& scene, const bvh_scene& bvh,
+    const pathtrace_lights& lights, const pathtrace_params& params,
+    const vec2f& focus, const pathtrace_tile_callback& tile_cb) {
+  if (state.samples >= params.samples) return {};
+  auto zone  = trace_zone{"pathtrace_samples"};
+  auto timer = simple_timer{};
+#ifdef YOCTO_STATS
+  reset_bvh_stats();
+  pathtrace_thread_stats.reset();
+#endif
+  if (params.adrrs && state.samples == params.adrrs_samples)
+    make_adjoint(state);
+  if (params.guiding && state.guiding.nodes.empty())
+    make_guiding(state.guiding, scene);
   auto& camera = scene.cameras[params.camera];
   auto  shader = get_shader(params);
   state.samples += 1;
-  if (params.samples == 1) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u = (i + 0.5f) / state.width, v = (j + 0.5f) / state.height;
-      auto ray      = eval_camera(camera, {u, v}, rand2f(state.rngs[idx]));
-      auto radiance = shader(scene, bvh, lights, ray, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
-    }
-  } else if (params.noparallel) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v}, rand2f(state.rngs[idx]));
-      auto radiance = shader(scene, bvh, lights, ray, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
+  // render in tiles, the first sample at pixel centers
+  auto jitter  = params.samples != 1;
+  auto tiles_x = (state.width - 1) / pathtrace_tile_size + 1;
+  auto tiles_y = (state.height - 1) / pathtrace_tile_size + 1;
+
+  // order tiles by distance from the focus point
+  auto tiles  = vector<int>(tiles_x * tiles_y);
+  auto center = [&](int tile) {
+    auto size = (float)pathtrace_tile_size;
+    return vec2f{((tile % tiles_x) + 0.5f) * size - focus.x * state.width,
+        ((tile / tiles_x) + 0.5f) * size - focus.y * state.height};
+  };
+  for (auto tile = 0; tile < (int)tiles.size(); tile++) tiles[tile] = tile;
+  std::sort(tiles.begin(), tiles.end(), [&](int a, int b) {
+    return dot(center(a), center(a)) < dot(center(b), center(b));
+  });
+
+  // record guiding samples of each tile apart, while training
+  auto training = params.guiding && state.samples <= params.guiding_samples;
+  if (training) state.guiding.records.resize(tiles.size());
+
+  auto canceled    = std::atomic<bool>{false};
+  auto render_tile = [&](int order) {
+    if (canceled) return;
+    auto zone    = trace_zone{"render_tile"};
+    auto tile    = tiles[order];
+    auto i0      = (tile % tiles_x) * pathtrace_tile_size;
+    auto j0      = (tile / tiles_x) * pathtrace_tile_size;
+    auto i1      = min(i0 + pathtrace_tile_size, state.width);
+    auto j1      = min(j0 + pathtrace_tile_size, state.height);
+    auto records = training ? &state.guiding.records[tile] : nullptr;
+    for (auto j = j0; j < j1; j++) {
+      for (auto i = i0; i < i1; i++) {
+        pathtrace_sample(state, scene, bvh, lights, camera, shader,
+            j * state.width + i, jitter, params, records);
+      }
     }
+    if (tile_cb && !tile_cb(state, {i0, j0}, {i1, j1})) canceled = true;
+  };
+  if (params.noparallel) {
+    for (auto order = 0; order < (int)tiles.size(); order++) render_tile(order);
   } else {
-    parallel_for(state.width * state.height, [&](int idx) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v}, rand2f(state.rngs[idx]));
-      auto radiance = shader(scene, bvh, lights, ray, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
-    });
+    parallel_for((int)tiles.size(), render_tile);
   }
+
+  // train path guiding
+  if (training && !canceled)
+    update_guiding(state.guiding, state.samples, params);
+
+  // collect statistics
+  auto stats = pathtrace_stats{};
+#ifdef YOCTO_STATS
+  stats            = pathtrace_thread_stats.sum();
+  auto bvh_stats   = get_bvh_stats();
+  stats.rays       = bvh_stats.rays;
+  stats.nodes      = bvh_stats.nodes;
+  stats.primitives = bvh_stats.primitives;
+  stats.instances  = bvh_stats.instances;
+#endif
+  stats.samples = 1;
+  stats.paths   = (uint64_t)state.width * (uint64_t)state.height;
+  stats.time    = elapsed_nanoseconds(timer);
+  return stats;
 }
 
 // Check image type
@@ -1115,6 +1999,31 @@ void get_render(color_image& image, const pathtrace_state& state) {
   }
 }
 
+// Get per-pixel cost
+color_image get_cost(const pathtrace_state& state, bool falsecolor) {
+  auto image = make_image(state.width, state.height, true);
+  if (state.cost.empty() || state.samples == 0) return image;
+  auto scale = 1.0f / (float)state.samples;
+  if (!falsecolor) {
+    for (auto idx = 0; idx < state.width * state.height; idx++) {
+      auto cost         = state.cost[idx] * scale;
+      image.pixels[idx] = {cost, cost, cost, 1};
+    }
+  } else {
+    // normalize by the 99th percentile so that a few outliers, e.g. threads
+    // preempted while timing, do not flatten the map
+    auto sorted = state.cost;
+    auto nth    = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    auto norm = *nth > 0 ? 1 / *nth : 0.0f;
+    for (auto idx = 0; idx < state.width * state.height; idx++) {
+      auto color        = colormap(clamp(state.cost[idx] * norm, 0.0f, 1.0f));
+      image.pixels[idx] = {color.x, color.y, color.z, 1};
+    }
+  }
+  return image;
+}
+
 // perform one level of subdivision and modify
 template <typename T>
 static void tesselate_catmullclark(
@@ -1273,10 +2182,75 @@ void tesselate_surface(
 }
 
 void tesselate_surfaces(scene_data& scene) {
+  auto zone = trace_zone{"tesselate_surfaces"};
+
   // tesselate shapes
   for (auto& subdiv : scene.subdivs) {
+    auto subdiv_zone = trace_zone{"tesselate_surface"};
     tesselate_surface(scene.shapes[subdiv.shape], subdiv, scene);
   }
 }
 
+// Load a scene and initialize its rendering data
+bool load_render_data(const string& filename, scene_data& scene,
+    bvh_scene& bvh, pathtrace_lights& lights, pathtrace_state& state,
+    const pathtrace_params& params, string& error, bool compress) {
+  auto zone = trace_zone{"load_render_data"};
+
+  // shape bvhs are sized by the first shape that is ready
+  auto bvh_sized   = std::once_flag{};
+  auto build_shape = [&](int shape_id) {
+    std::call_once(
+        bvh_sized, [&]() { bvh.shapes.resize(scene.shapes.size()); });
+    auto& shape = scene.shapes[shape_id];
+    if (compress) compress_shape(shape);
+    if (params.lazy) return;
+    bvh.shapes[shape_id] = params.sbvh ? make_sbvh(shape) : make_bvh(shape);
+  };
+
+  // load scene, building the bvh of the shapes that are not tesselated
+  auto shape_loaded = [&](int shape_id) {
+    for (auto& subdiv : scene.subdivs) {
+      if (subdiv.shape == shape_id) return;
+    }
+    build_shape(shape_id);
+  };
+  if (!load_scene(filename, scene, error, shape_loaded, params.noparallel))
+    return false;
+
+  // tesselate subdivs, building the bvh of their shapes
+  auto tesselate = [&](int subdiv_id) {
+    auto  subdiv_zone = trace_zone{"tesselate_surface"};
+    auto& subdiv      = scene.subdivs[subdiv_id];
+    tesselate_surface(scene.shapes[subdiv.shape], subdiv, scene);
+    build_shape(subdiv.shape);
+  };
+  if (params.noparallel) {
+    for (auto subdiv_id : range((int)scene.subdivs.size()))
+      tesselate(subdiv_id);
+  } else {
+    parallel_for((int)scene.subdivs.size(), tesselate);
+  }
+
+  // init lights and state while completing the bvh
+  auto init_lights_state = [&]() {
+    lights = make_lights(scene, params);
+    state  = make_state(scene, params);
+  };
+  if (params.noparallel) {
+    init_lights_state();
+    complete_bvh(bvh, scene, false, true, params.flatten,
+        lazy_shape_bvh(params));
+  } else {
+    auto lights_state = run_async(init_lights_state);
+    complete_bvh(bvh, scene, false, false, params.flatten,
+        lazy_shape_bvh(params));
+    lights_state.get();
+  }
+  lights.isolated = make_isolated(scene, bvh);
+
+  // done
+  return true;
+}
+
 }  // namespace yocto
@@ -53,6 +53,46 @@
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Directional quadtree of path guiding, over the cylindrical mapping of the
+// sphere of directions, which preserves areas. Nodes store the radiance of
+// their four quadrants and the index of their children, zero for leaves.
+struct guiding_dnode {
+  array<float, 4> sums     = {0, 0, 0, 0};
+  array<int, 4>   children = {0, 0, 0, 0};
+};
+struct guiding_dtree {
+  vector<guiding_dnode> nodes = {guiding_dnode{}};
+};
+
+// Spatial binary tree of path guiding, that splits the scene bounds in half
+// along the x, y and z axes in turn. Leaves have a directional tree learned
+// in the last training iteration, used for sampling, and one that records
+// the current iteration.
+struct guiding_snode {
+  int           children = 0;  // first of two children, zero for leaves
+  int           records  = 0;  // records in the current iteration
+  guiding_dtree sampling = {};
+  guiding_dtree building = {};
+};
+
+// Incident radiance sample of path guiding, divided by its pdf
+struct guiding_record {
+  vec3f position  = {0, 0, 0};
+  vec3f direction = {0, 0, 0};
+  float radiance  = 0;
+};
+
+// Spatial-directional tree of path guiding (SD-tree), learned from the
+// incident radiance at the path vertices of the first rendering passes.
+// Samples are recorded per image tile, without synchronization, and added to
+// the tree after each pass.
+struct pathtrace_guiding {
+  bbox3f                         bbox       = invalidb3f;
+  vector<guiding_snode>          nodes      = {};
+  int                            iterations = 0;   // training iterations done
+  vector<vector<guiding_record>> records    = {};  // samples of each tile
+};
+
 // Rendering state
 struct pathtrace_state {
   int               width   = 0;
@@ -61,6 +101,9 @@ struct pathtrace_state {
   vector<vec4f>     image   = {};
   vector<int>       hits    = {};
   vector<rng_state> rngs    = {};
+  vector<float>     cost    = {};  // per-pixel cost, if requested
+  vector<float>     adjoint = {};  // per-pixel adjoint roulette scale
+  pathtrace_guiding guiding = {};  // path guiding, if requested
 };
 
 }  // namespace yocto
@@ -83,19 +126,53 @@ enum struct pathtrace_shader_type {
   implicit_normal,
 };
 
-// Options for trace functions
+// Per-pixel cost recorded alongside the render
+enum struct pathtrace_cost_type {
+  none,         // no cost buffer
+  time,         // nanoseconds
+  nodes,        // bvh nodes visited (needs YOCTO_STATS)
+  spheretrace,  // sphere tracing iterations (needs YOCTO_STATS)
+};
+
+const auto pathtrace_cost_names = vector<string>{
+    "none", "time", "nodes", "spheretrace"};
+
+// Options for trace functions. Besides the total number of `bounces`,
+// paths are limited by the number of scattering events of each type, with
+// negative values for no limit. Scattering is counted as transmission when
+// the path crosses the surface, as specular for delta or mirror-like
+// reflection, as diffuse for other reflections and as volume inside media.
+// With `adrrs`, path tracing shaders replace russian roulette at surfaces
+// with adjoint-driven roulette and splitting, that compares the expected
+// contribution of paths to a pixel estimate from the first `adrrs_samples`.
+// With `guiding`, path tracing shaders learn the incident radiance in the
+// scene during the first `guiding_samples` and sample it together with the
+// bsdfs, the phase functions and the lights.
 struct pathtrace_params {
-  int                   camera              = 0;
-  int                   resolution          = 720;
-  pathtrace_shader_type shader              = pathtrace_shader_type::pathtrace;
-  int                   samples             = 512;
-  int                   bounces             = 4;
-  bool                  noparallel          = false;
-  int                   pratio              = 8;
-  float                 exposure            = 0;
-  bool                  filmic              = false;
-  bool                  noimplicit_mis      = false;
-  int                   spheretrace_maxiter = 450;
+  int                   camera               = 0;
+  int                   resolution           = 720;
+  pathtrace_shader_type shader               =
+      pathtrace_shader_type::pathtrace;
+  int                   samples              = 512;
+  int                   bounces              = 4;
+  int                   diffuse_bounces      = -1;
+  int                   specular_bounces     = -1;
+  int                   transmission_bounces = -1;
+  int                   volume_bounces       = -1;
+  bool                  noparallel           = false;
+  int                   pratio               = 8;
+  float                 exposure             = 0;
+  bool                  filmic               = false;
+  bool                  noimplicit_mis       = false;
+  int                   spheretrace_maxiter  = 450;
+  pathtrace_cost_type   cost                 = pathtrace_cost_type::none;
+  bool                  sbvh                 = false;  // spatial split bvhs
+  bool                  flatten              = false;  // flatten instances
+  bool                  lazy                 = false;  // on demand shape bvhs
+  bool                  adrrs                = false;  // adjoint roulette
+  int                   adrrs_samples        = 4;
+  bool                  guiding              = false;  // path guiding
+  int                   guiding_samples      = 32;
 };
 
 const auto pathtrace_shader_names = vector<string>{"volpathtrace", "pathtrace",
@@ -110,34 +187,119 @@ struct pathtrace_light {
   vector<float> elements_cdf = {};
 };
 
-// Scene lights
+// Scene lights, together with the scene properties used to trace rays.
+// Materials are transparent if their opacity, or the alpha of their color
+// texture, is below one. Scenes are opaque if no material, shape color or
+// instance color is transparent. Volumetric instances are isolated if their
+// bounds overlap no other primitive, so that rays inside them are
+// intersected with them alone. Isolation needs the bvh, and is computed
+// only when lights are made with it.
 struct pathtrace_lights {
-  vector<pathtrace_light> lights = {};
+  vector<pathtrace_light> lights      = {};
+  vector<bool>            transparent = {};  // per material
+  bool                    opaque      = true;
+  vector<bool>            isolated    = {};  // per instance
 };
 
+// Render statistics returned by `pathtrace_samples()`. Hot-path counters
+// are collected per thread only when compiling with YOCTO_STATS, otherwise
+// they stay zero.
+struct pathtrace_stats {
+  int      samples           = 0;  // samples per pixel traced
+  uint64_t paths             = 0;  // camera paths
+  uint64_t bounces           = 0;  // path vertices
+  uint64_t rays              = 0;  // bvh ray queries
+  uint64_t nodes             = 0;  // bvh nodes visited
+  uint64_t primitives        = 0;  // primitive intersection tests
+  uint64_t instances         = 0;  // instance traversals
+  uint64_t spheretrace_steps = 0;  // sphere tracing iterations
+  uint64_t lightpdf_rays     = 0;  // light pdf re-intersections
+  int64_t  time              = 0;  // render time in nanoseconds
+};
+
+// Accumulate statistics
+pathtrace_stats& operator+=(pathtrace_stats& a, const pathtrace_stats& b);
+
 // Initialize state.
 pathtrace_state make_state(
     const scene_data& scene, const pathtrace_params& params);
 
-// Build the bvh acceleration structure.
+// Reset the accumulation buffers of a state for a new render. Buffers and
+// random number generators are reused, unless the image size changed.
+void reset_state(pathtrace_state& state, const scene_data& scene,
+    const pathtrace_params& params);
+
+// Build the bvh acceleration structure. With `sbvh`, shape bvhs use spatial
+// splits. With `flatten`, single identity instances are flattened. With
+// `lazy`, shape bvhs are built during rendering, when rays first reach them.
 bvh_scene make_bvh(const scene_data& scene, const pathtrace_params& params);
 
-// Initialize lights.
+// Initialize lights. With the bvh, also find the isolated instances.
 pathtrace_lights make_lights(
     const scene_data& scene, const pathtrace_params& params);
+pathtrace_lights make_lights(const scene_data& scene, const bvh_scene& bvh,
+    const pathtrace_params& params);
 
 // Tesselate subdivs
 void tesselate_surfaces(scene_data& scene);
 
-// Progressively computes an image.
-void pathtrace_samples(pathtrace_state& state, const scene_data& scene,
-    const bvh_scene& bvh, const pathtrace_lights& lights,
-    const pathtrace_params& params);
+// Load a scene and initialize its rendering data, overlapping the steps that
+// do not depend on each other. Each shape bvh is built by the thread that
+// loaded or tesselated the shape, while lights and state are initialized
+// together with the instance bvh. With `compress`, shapes are compressed
+// before building their bvh.
+bool load_render_data(const string& filename, scene_data& scene,
+    bvh_scene& bvh, pathtrace_lights& lights, pathtrace_state& state,
+    const pathtrace_params& params, string& error, bool compress = false);
+
+// Callback invoked, concurrently from the render threads, when the pixels in
+// [start, end) have received their sample. Returning false cancels the pass,
+// leaving the remaining tiles without it, so the state should be reset.
+using pathtrace_tile_callback = function<bool(
+    const pathtrace_state& state, const vec2i& start, const vec2i& end)>;
+
+// Progressively computes an image. Returns the statistics of this pass.
+// Tiles closest to `focus`, in normalized image coordinates, are scheduled
+// first, so that the region of interest refines first. Interactive viewers
+// use `tile_cb` to show tiles as they complete.
+pathtrace_stats pathtrace_samples(pathtrace_state& state,
+    const scene_data& scene, const bvh_scene& bvh,
+    const pathtrace_lights& lights, const pathtrace_params& params,
+    const vec2f&                   focus   = {0.5f, 0.5f},
+    const pathtrace_tile_callback& tile_cb = {});
 
 // Get resulting render
 color_image get_render(const pathtrace_state& state);
 void        get_render(color_image& render, const pathtrace_state& state);
 
+// Get the per-pixel cost averaged over samples. With `falsecolor`, the cost
+// is normalized by its 99th percentile and mapped to a colormap, otherwise it
+// is stored as is in all channels.
+color_image get_cost(const pathtrace_state& state, bool falsecolor = false);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// LOW LEVEL API
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Sphere tracing result
+struct spheretrace_result {
+  bool  hit      = false;       // did spheretrace hit something?
+  float dist     = flt_max;     // ray distance
+  int   instance = invalidid;   // Hitted instance (sdf grid)
+  int   sdf      = invalidid;   // Hitted signed distance function
+};
+
+// Spheretrace only on a specific signed distance function (used in MIS)
+spheretrace_result spheretrace(
+    const scene_data& scene, const ray3f& ray, int sdf_handle, int maxiter);
+
+// Spheretrace on whole scene (used by the shaders)
+spheretrace_result spheretrace(
+    const scene_data& scene, const ray3f& ray, int maxiter);
+
 }  // namespace yocto
 
 #endif